@@ -0,0 +1,273 @@
+#include "block_cache.h"
+#include "config.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+/**
+ * Cached piece of state. Entries of a bucket are chained through c_next
+ * (-1 ends a chain).
+ */
+typedef struct {
+    uint64_t c_key;
+    int32_t c_next;
+    uint32_t c_pins;   // pinned entries are never evicted
+    bool c_referenced; // accessed since the clock hand last passed
+} cache_entry_t;
+
+typedef struct {
+    _Alignas(64) pthread_mutex_t lock;
+    cache_entry_t *entries; // in clock order
+    int32_t *buckets;       // first entry of each chain (-1 if none)
+    size_t capacity;        // entries (and buckets; a power of two)
+    size_t used;
+    size_t hand; // next entry the clock considers for eviction
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} cache_shard_t;
+
+static cache_shard_t cache_shards[BLOCK_CACHE_SHARDS];
+static size_t cache_shard_capacity; // 0 if the cache is disabled
+
+/**
+ * Mix a key into a hash (splitmix64 finalizer): the low bits pick the shard,
+ * the high bits the bucket.
+ */
+static uint64_t cache_hash(uint64_t key) {
+    key ^= key >> 30;
+    key *= UINT64_C(0xbf58476d1ce4e5b9);
+    key ^= key >> 27;
+    key *= UINT64_C(0x94d049bb133111eb);
+    key ^= key >> 31;
+    return key;
+}
+
+/**
+ * Initialize the buffer cache.
+ *
+ * Input:
+ *   - capacity: number of pieces of state the cache holds (0 disables it,
+ *     so that every access pays the storage latency)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int block_cache_init(size_t capacity) {
+    size_t per_shard = 1;
+    while (per_shard * BLOCK_CACHE_SHARDS < capacity) {
+        per_shard *= 2;
+    }
+    cache_shard_capacity = capacity == 0 ? 0 : per_shard;
+
+    for (size_t s = 0; s < BLOCK_CACHE_SHARDS; s++) {
+        cache_shard_t *shard = &cache_shards[s];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->capacity = cache_shard_capacity;
+        shard->used = 0;
+        shard->hand = 0;
+        shard->hits = shard->misses = shard->evictions = 0;
+        shard->entries = NULL;
+        shard->buckets = NULL;
+        if (cache_shard_capacity == 0) {
+            continue;
+        }
+
+        shard->entries = malloc(per_shard * sizeof(cache_entry_t));
+        shard->buckets = malloc(per_shard * sizeof(int32_t));
+        if (shard->entries == NULL || shard->buckets == NULL) {
+            return -1;
+        }
+        for (size_t b = 0; b < per_shard; b++) {
+            shard->buckets[b] = -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Destroy the buffer cache.
+ */
+void block_cache_destroy(void) {
+    for (size_t s = 0; s < BLOCK_CACHE_SHARDS; s++) {
+        cache_shard_t *shard = &cache_shards[s];
+        pthread_mutex_destroy(&shard->lock);
+        free(shard->entries);
+        free(shard->buckets);
+        shard->entries = NULL;
+        shard->buckets = NULL;
+    }
+    cache_shard_capacity = 0;
+}
+
+/**
+ * Unlink an entry from its bucket's chain. Must be called with the shard's
+ * lock held.
+ */
+static void cache_unlink(cache_shard_t *shard, int32_t index) {
+    size_t bucket = (size_t)(cache_hash(shard->entries[index].c_key) >> 32) &
+                    (shard->capacity - 1);
+    int32_t *link = &shard->buckets[bucket];
+    while (*link != index) {
+        link = &shard->entries[*link].c_next;
+    }
+    *link = shard->entries[index].c_next;
+}
+
+/**
+ * Look a key up in the cache, inserting it on a miss (evicting the first
+ * entry the clock hand finds unreferenced and unpinned if the shard is full;
+ * if every entry is pinned, the key is not inserted).
+ *
+ * Input:
+ *   - key: the key
+ *   - pin: true to also pin the key's entry
+ *
+ * Returns true on a hit, false on a miss.
+ */
+static bool cache_access(uint64_t key, bool pin) {
+    uint64_t hash = cache_hash(key);
+    cache_shard_t *shard = &cache_shards[hash % BLOCK_CACHE_SHARDS];
+    size_t bucket = (size_t)(hash >> 32) & (shard->capacity - 1);
+
+    pthread_mutex_lock(&shard->lock);
+    for (int32_t i = shard->buckets[bucket]; i != -1;
+         i = shard->entries[i].c_next) {
+        if (shard->entries[i].c_key == key) {
+            shard->entries[i].c_referenced = true;
+            shard->entries[i].c_pins += pin;
+            shard->hits++;
+            pthread_mutex_unlock(&shard->lock);
+            return true;
+        }
+    }
+
+    int32_t index;
+    if (shard->used < shard->capacity) {
+        index = (int32_t)shard->used++;
+    } else {
+        // Give referenced entries a second chance (a third pass over the
+        // shard only finds pinned entries)
+        size_t steps = 0;
+        while (shard->entries[shard->hand].c_referenced ||
+               shard->entries[shard->hand].c_pins > 0) {
+            if (++steps > 2 * shard->capacity) {
+                shard->misses++;
+                pthread_mutex_unlock(&shard->lock);
+                return false;
+            }
+            shard->entries[shard->hand].c_referenced = false;
+            shard->hand = (shard->hand + 1) & (shard->capacity - 1);
+        }
+        index = (int32_t)shard->hand;
+        shard->hand = (shard->hand + 1) & (shard->capacity - 1);
+        cache_unlink(shard, index);
+        shard->evictions++;
+    }
+
+    // New entries start unreferenced, so that data read once (e.g., a scan)
+    // is the first to go
+    shard->entries[index].c_key = key;
+    shard->entries[index].c_referenced = false;
+    shard->entries[index].c_pins = pin;
+    shard->entries[index].c_next = shard->buckets[bucket];
+    shard->buckets[bucket] = index;
+    shard->misses++;
+    pthread_mutex_unlock(&shard->lock);
+    return false;
+}
+
+/**
+ * Access a run of pieces of state through the cache.
+ *
+ * Input:
+ *   - kind: what the pieces are
+ *   - number: number of the first piece (inumber, block number, etc.)
+ *   - count: number of consecutive pieces
+ *
+ * Returns the number of pieces that missed the cache (count if the cache is
+ * disabled).
+ */
+size_t block_cache_touch(cache_kind_t kind, size_t number, size_t count) {
+    if (cache_shard_capacity == 0) {
+        return count;
+    }
+
+    size_t misses = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t key = (uint64_t)kind << 56 | (uint64_t)(number + i);
+        if (!cache_access(key, false)) {
+            misses++;
+        }
+    }
+    return misses;
+}
+
+/**
+ * Access a piece of state through the cache, and keep it cached until it is
+ * unpinned (pins are counted).
+ *
+ * Input:
+ *   - kind: what the piece is
+ *   - number: number of the piece
+ *
+ * Returns true if it was already cached (always false if the cache is
+ * disabled).
+ */
+bool block_cache_pin(cache_kind_t kind, size_t number) {
+    if (cache_shard_capacity == 0) {
+        return false;
+    }
+    return cache_access((uint64_t)kind << 56 | (uint64_t)number, true);
+}
+
+/**
+ * Undo a block_cache_pin, letting the piece of state be evicted once it is
+ * no longer pinned.
+ *
+ * Input:
+ *   - kind: what the piece is
+ *   - number: number of the piece
+ */
+void block_cache_unpin(cache_kind_t kind, size_t number) {
+    if (cache_shard_capacity == 0) {
+        return;
+    }
+
+    uint64_t key = (uint64_t)kind << 56 | (uint64_t)number;
+    uint64_t hash = cache_hash(key);
+    cache_shard_t *shard = &cache_shards[hash % BLOCK_CACHE_SHARDS];
+    size_t bucket = (size_t)(hash >> 32) & (shard->capacity - 1);
+
+    pthread_mutex_lock(&shard->lock);
+    for (int32_t i = shard->buckets[bucket]; i != -1;
+         i = shard->entries[i].c_next) {
+        if (shard->entries[i].c_key == key) {
+            if (shard->entries[i].c_pins > 0) {
+                shard->entries[i].c_pins--;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * Obtain the cache's counters, summed over its shards.
+ *
+ * Input:
+ *   - hits, misses, evictions: where to store the counters
+ */
+void block_cache_stats(uint64_t *hits, uint64_t *misses,
+                       uint64_t *evictions) {
+    *hits = *misses = *evictions = 0;
+    for (size_t s = 0; s < BLOCK_CACHE_SHARDS; s++) {
+        cache_shard_t *shard = &cache_shards[s];
+        pthread_mutex_lock(&shard->lock);
+        *hits += shard->hits;
+        *misses += shard->misses;
+        *evictions += shard->evictions;
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Buffer cache: tracks which pieces of the persistent state (inodes, data
+ * blocks and bitmap blocks) were accessed recently, so that only accesses
+ * missing the cache pay the emulated storage latency. Entries are spread
+ * over independently locked shards, each evicting with the CLOCK algorithm.
+ * Pinned entries stay cached until unpinned.
+ */
+
+typedef enum {
+    CACHE_INODE,
+    CACHE_DATA_BLOCK,
+    CACHE_INODE_BITMAP,
+    CACHE_BLOCK_BITMAP,
+} cache_kind_t;
+
+int block_cache_init(size_t capacity);
+void block_cache_destroy(void);
+
+size_t block_cache_touch(cache_kind_t kind, size_t number, size_t count);
+bool block_cache_pin(cache_kind_t kind, size_t number);
+void block_cache_unpin(cache_kind_t kind, size_t number);
+void block_cache_stats(uint64_t *hits, uint64_t *misses,
+                       uint64_t *evictions);
+
+#endif // BLOCK_CACHE_H
@@ -0,0 +1,675 @@
+#define _DEFAULT_SOURCE // preadv, pwritev
+#include "block_device.h"
+#include "betterassert.h"
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+struct block_device {
+    size_t size;
+    char *memory;         // RAM backend (NULL for the file backend)
+    int fd;               // file backend, or file a RAM backend writes to
+    size_t file_offset;   // where the device starts within the file
+    unsigned queue_depth; // 0 to do the I/O synchronously
+    uint64_t id;          // tells the rings of different devices apart
+    atomic_bool no_uring; // io_uring could not be set up
+};
+
+/**
+ * Requests of a batch merged into a single vectored transfer.
+ */
+typedef struct {
+    block_io_t *io;
+    block_op_t op;
+    size_t offset;
+    size_t len;
+    struct iovec *iov;
+    int iovcnt;
+} block_segment_t;
+
+struct block_io {
+    block_device_t *device;
+    struct block_ring *ring; // NULL if the I/O was done synchronously
+    block_segment_t *segments;
+    struct iovec *iov;
+    size_t count;
+    size_t submitted;
+    size_t completed;
+    ssize_t bytes;
+    bool failed;
+};
+
+/**
+ * A thread's io_uring instance, with its rings mapped.
+ */
+typedef struct block_ring {
+    int fd;             // -1 once its device is closed
+    uint64_t device_id; // device the ring was set up for
+    unsigned entries;
+    unsigned in_flight;
+    bool failed; // io_uring_enter failed: nothing more is submitted
+
+    void *sq_map;
+    size_t sq_map_len;
+    void *cq_map; // same as sq_map if the kernel maps both rings at once
+    size_t cq_map_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct block_ring *next;
+} block_ring_t;
+
+static atomic_uint_least64_t device_ids;
+
+static block_ring_t *rings; // every thread's ring
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local block_ring_t *thread_ring;
+static _Thread_local uint64_t thread_ring_device_id;
+
+/**
+ * Release the kernel resources of a ring. Must be called with rings_lock
+ * held.
+ */
+static void block_ring_teardown(block_ring_t *ring) {
+    if (ring->fd == -1) {
+        return;
+    }
+    munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_map != ring->sq_map) {
+        munmap(ring->cq_map, ring->cq_map_len);
+    }
+    munmap(ring->sq_map, ring->sq_map_len);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+/**
+ * Unregister and free a ring (when its thread exits, or moves on to another
+ * device).
+ */
+static void block_ring_free(void *arg) {
+    block_ring_t *ring = arg;
+
+    pthread_mutex_lock(&rings_lock);
+    for (block_ring_t **p = &rings; *p != NULL; p = &(*p)->next) {
+        if (*p == ring) {
+            *p = ring->next;
+            break;
+        }
+    }
+    block_ring_teardown(ring);
+    pthread_mutex_unlock(&rings_lock);
+    free(ring);
+}
+
+static void block_ring_key_create(void) {
+    ALWAYS_ASSERT(pthread_key_create(&ring_key, block_ring_free) == 0,
+                  "block_ring_get: failed to create ring key");
+}
+
+/**
+ * Set up an io_uring instance for a device.
+ *
+ * Returns the ring, or NULL if io_uring is not available.
+ */
+static block_ring_t *block_ring_create(block_device_t *device) {
+    block_ring_t *ring = calloc(1, sizeof(block_ring_t));
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring->fd = (int)syscall(__NR_io_uring_setup, device->queue_depth, &p);
+    if (ring->fd < 0) {
+        free(ring);
+        return NULL;
+    }
+
+    ring->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_map_len =
+        p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && ring->cq_map_len > ring->sq_map_len) {
+        ring->sq_map_len = ring->cq_map_len;
+    }
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_SQ_RING);
+    ring->cq_map = single ? ring->sq_map
+                          : mmap(NULL, ring->cq_map_len,
+                                 PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_POPULATE, ring->fd,
+                                 IORING_OFF_CQ_RING);
+    void *sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED ||
+        sqes == MAP_FAILED) {
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, ring->sqes_len);
+        }
+        if (ring->cq_map != MAP_FAILED && !single) {
+            munmap(ring->cq_map, ring->cq_map_len);
+        }
+        if (ring->sq_map != MAP_FAILED) {
+            munmap(ring->sq_map, ring->sq_map_len);
+        }
+        close(ring->fd);
+        free(ring);
+        return NULL;
+    }
+
+    char *sq = ring->sq_map;
+    char *cq = ring->cq_map;
+    ring->sqes = sqes;
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    // Completions never overflow: at most one per submission slot is pending
+    ring->entries = p.sq_entries < p.cq_entries ? p.sq_entries : p.cq_entries;
+    ring->device_id = device->id;
+    return ring;
+}
+
+/**
+ * Obtain the calling thread's ring for a device, setting it up on first use.
+ *
+ * Returns the ring, or NULL if the I/O is to be done synchronously.
+ */
+static block_ring_t *block_ring_get(block_device_t *device) {
+    if (device->queue_depth == 0 || atomic_load(&device->no_uring)) {
+        return NULL;
+    }
+    if (thread_ring != NULL && thread_ring_device_id == device->id) {
+        return thread_ring;
+    }
+
+    pthread_once(&ring_key_once, block_ring_key_create);
+    if (thread_ring != NULL) {
+        block_ring_free(thread_ring); // set up for an earlier device
+        thread_ring = NULL;
+        pthread_setspecific(ring_key, NULL);
+    }
+
+    block_ring_t *ring = block_ring_create(device);
+    if (ring == NULL) {
+        atomic_store(&device->no_uring, true);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&rings_lock);
+    ring->next = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_lock);
+
+    pthread_setspecific(ring_key, ring);
+    thread_ring = ring;
+    thread_ring_device_id = device->id;
+    return ring;
+}
+
+/**
+ * Transfer (the rest of) a segment with preadv/pwritev.
+ *
+ * Input:
+ *   - segment: the segment
+ *   - done: bytes of the segment already transferred
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int block_segment_sync(block_segment_t *segment, size_t done) {
+    block_device_t *device = segment->io->device;
+    struct iovec *iov = segment->iov;
+    int iovcnt = segment->iovcnt;
+
+    while (done < segment->len) {
+        // Skip what was already transferred
+        struct iovec first;
+        size_t skip = done;
+        int v = 0;
+        while (skip >= iov[v].iov_len) {
+            skip -= iov[v].iov_len;
+            v++;
+        }
+        first.iov_base = (char *)iov[v].iov_base + skip;
+        first.iov_len = iov[v].iov_len - skip;
+
+        struct iovec saved = iov[v];
+        iov[v] = first;
+        off_t offset = (off_t)(segment->offset + done);
+        ssize_t n = segment->op == BLOCK_READ
+                        ? preadv(device->fd, &iov[v], iovcnt - v, offset)
+                        : pwritev(device->fd, &iov[v], iovcnt - v, offset);
+        iov[v] = saved;
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1; // failure, or past the end of the device
+        }
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * Account for a finished segment, completing it synchronously if the kernel
+ * only did part of it.
+ *
+ * Input:
+ *   - segment: the segment
+ *   - result: bytes transferred by the kernel, or a negated errno
+ */
+static void block_segment_complete(block_segment_t *segment, int result) {
+    block_io_t *io = segment->io;
+
+    bool retry = result == -EINTR || result == -EAGAIN;
+    if ((result >= 0 || retry) &&
+        block_segment_sync(segment, result > 0 ? (size_t)result : 0) == 0) {
+        io->bytes += (ssize_t)segment->len;
+    } else {
+        io->failed = true;
+    }
+    io->completed++;
+}
+
+/**
+ * Stop using io_uring for a device after io_uring_enter failed (other than
+ * being interrupted), for a ring and for the rings set up after it.
+ */
+static void block_ring_fail(block_ring_t *ring, block_device_t *device) {
+    ring->failed = true;
+    atomic_store(&device->no_uring, true);
+}
+
+/**
+ * Queue as many of a batch's pending segments as the ring has room for, and
+ * hand them to the kernel. If the kernel refuses them, they (and the rest of
+ * the batch) are transferred synchronously instead.
+ */
+static void block_ring_submit(block_ring_t *ring, block_io_t *io) {
+    if (ring->failed) {
+        for (; io->submitted < io->count; io->submitted++) {
+            block_segment_complete(&io->segments[io->submitted], 0);
+        }
+        return;
+    }
+
+    unsigned tail = *ring->sq_tail; // only this thread writes it
+    unsigned queued = 0;
+
+    while (io->submitted < io->count && ring->in_flight < ring->entries) {
+        block_segment_t *segment = &io->segments[io->submitted++];
+        unsigned index = tail & ring->sq_mask;
+        struct io_uring_sqe *sqe = &ring->sqes[index];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = segment->op == BLOCK_READ ? IORING_OP_READV
+                                                : IORING_OP_WRITEV;
+        sqe->fd = io->device->fd;
+        sqe->addr = (uint64_t)(uintptr_t)segment->iov;
+        sqe->len = (unsigned)segment->iovcnt;
+        sqe->off = segment->offset;
+        sqe->user_data = (uint64_t)(uintptr_t)segment;
+        ring->sq_array[index] = index;
+
+        tail++;
+        queued++;
+        ring->in_flight++;
+    }
+    if (queued == 0) {
+        return;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    while (queued > 0) {
+        long n = syscall(__NR_io_uring_enter, ring->fd, queued, 0, 0, NULL, 0);
+        if (n == -1 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        queued -= (unsigned)n;
+    }
+    if (queued > 0) {
+        // The kernel never saw the last entries: take them back, and do
+        // them (and the rest of the batch) synchronously
+        __atomic_store_n(ring->sq_tail, tail - queued, __ATOMIC_RELEASE);
+        ring->in_flight -= queued;
+        io->submitted -= queued;
+        block_ring_fail(ring, io->device);
+        block_ring_submit(ring, io);
+    }
+}
+
+/**
+ * Process the completions of a ring, waiting for at least one (if waiting
+ * through the kernel fails, the transfers it already took still complete
+ * into the ring, so the thread polls for them instead).
+ */
+static void block_ring_reap(block_ring_t *ring, block_device_t *device) {
+    unsigned head = *ring->cq_head; // only this thread writes it
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head == tail) {
+        if (ring->failed) {
+            sched_yield();
+        } else if (syscall(__NR_io_uring_enter, ring->fd, 0, 1,
+                           IORING_ENTER_GETEVENTS, NULL, 0) == -1 &&
+                   errno != EINTR && errno != EAGAIN) {
+            block_ring_fail(ring, device);
+        }
+        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    }
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe const *cqe = &ring->cqes[head & ring->cq_mask];
+        block_segment_complete((block_segment_t *)(uintptr_t)cqe->user_data,
+                               cqe->res);
+        ring->in_flight--;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * Open a RAM block device over a memory area (not owned by the device).
+ *
+ * Input:
+ *   - memory: the memory holding the blocks
+ *   - size: size of the device
+ *
+ * Returns the device, or NULL in the case of error.
+ */
+block_device_t *block_device_ram_open(void *memory, size_t size) {
+    block_device_t *device = calloc(1, sizeof(block_device_t));
+    if (device == NULL) {
+        return NULL;
+    }
+    device->size = size;
+    device->memory = memory;
+    device->fd = -1;
+    device->id = atomic_fetch_add(&device_ids, 1) + 1;
+    return device;
+}
+
+/**
+ * Open a RAM block device over a private mapping of a range of a host file
+ * (the data blocks of an image): reads are served from memory, and writes go
+ * to memory and through to the file.
+ *
+ * Input:
+ *   - memory: the memory holding the blocks
+ *   - size: size of the device
+ *   - fd: the file (duplicated, so the caller keeps its descriptor)
+ *   - offset: where the device starts within the file
+ *
+ * Returns the device, or NULL in the case of error.
+ */
+block_device_t *block_device_mapped_open(void *memory, size_t size, int fd,
+                                         size_t offset) {
+    block_device_t *device = block_device_ram_open(memory, size);
+    if (device == NULL) {
+        return NULL;
+    }
+    device->fd = dup(fd);
+    if (device->fd == -1) {
+        free(device);
+        return NULL;
+    }
+    device->file_offset = offset;
+    return device;
+}
+
+/**
+ * Open a file block device, creating the file if it does not exist and
+ * setting its size.
+ *
+ * Input:
+ *   - path: path name of the host file
+ *   - size: size of the device
+ *   - queue_depth: maximum number of transfers in flight per thread (0 to use
+ *     preadv/pwritev instead of io_uring)
+ *
+ * Returns the device, or NULL in the case of error.
+ */
+block_device_t *block_device_file_open(char const *path, size_t size,
+                                       unsigned queue_depth) {
+    block_device_t *device = calloc(1, sizeof(block_device_t));
+    if (device == NULL) {
+        return NULL;
+    }
+
+    device->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (device->fd == -1 || ftruncate(device->fd, (off_t)size) == -1) {
+        if (device->fd != -1) {
+            close(device->fd);
+        }
+        free(device);
+        return NULL;
+    }
+    device->size = size;
+    device->queue_depth = queue_depth;
+    device->id = atomic_fetch_add(&device_ids, 1) + 1;
+    return device;
+}
+
+/**
+ * Close a block device. No I/O may be in flight.
+ */
+void block_device_close(block_device_t *device) {
+    if (device == NULL) {
+        return;
+    }
+
+    // Rings of other threads are freed when those threads exit
+    pthread_mutex_lock(&rings_lock);
+    for (block_ring_t *ring = rings; ring != NULL; ring = ring->next) {
+        if (ring->device_id == device->id) {
+            block_ring_teardown(ring);
+        }
+    }
+    pthread_mutex_unlock(&rings_lock);
+
+    if (device->fd != -1) {
+        close(device->fd);
+    }
+    free(device);
+}
+
+/**
+ * Obtain the memory holding the blocks of a device.
+ *
+ * Returns the memory, or NULL if the blocks are not addressable.
+ */
+void *block_device_memory(block_device_t const *device) {
+    return device->memory;
+}
+
+/**
+ * Make the writes done so far reach storage. The memory of a RAM device is
+ * synced by its owner (a mapped device syncs the file it writes to).
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int block_device_sync(block_device_t *device) {
+    return device->fd == -1 ? 0 : fdatasync(device->fd);
+}
+
+/**
+ * Write a range of a mapped device's memory through to its file.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int block_device_write_through(block_device_t *device, size_t offset,
+                                      size_t len) {
+    char const *data = device->memory + offset;
+    offset += device->file_offset;
+    while (len > 0) {
+        ssize_t n = pwrite(device->fd, data, len, (off_t)offset);
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+        offset += (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * Start a batch of transfers. Requests on adjacent ranges (in the order
+ * given) are merged into one transfer. The buffers must stay valid until
+ * the batch is waited for.
+ *
+ * Input:
+ *   - device: the device
+ *   - requests: the transfers (the array itself may be reused right away)
+ *   - count: number of transfers
+ *
+ * Returns the batch, to be waited for with block_device_wait (by the same
+ * thread), or NULL in the case of error.
+ */
+block_io_t *block_device_submit(block_device_t *device,
+                                block_request_t const *requests,
+                                size_t count) {
+    block_io_t *io = calloc(1, sizeof(block_io_t));
+    if (io == NULL) {
+        return NULL;
+    }
+    io->device = device;
+
+    for (size_t i = 0; i < count; i++) {
+        ALWAYS_ASSERT(requests[i].r_offset <= device->size &&
+                          requests[i].r_len <=
+                              device->size - requests[i].r_offset,
+                      "block_device_submit: request past the end");
+    }
+
+    // Blocks in memory need no queueing
+    if (device->memory != NULL) {
+        for (size_t i = 0; i < count; i++) {
+            char *data = device->memory + requests[i].r_offset;
+            if (requests[i].r_op == BLOCK_READ) {
+                memcpy(requests[i].r_buffer, data, requests[i].r_len);
+            } else {
+                memcpy(data, requests[i].r_buffer, requests[i].r_len);
+                if (device->fd != -1 &&
+                    block_device_write_through(device, requests[i].r_offset,
+                                               requests[i].r_len) == -1) {
+                    io->failed = true;
+                }
+            }
+            io->bytes += (ssize_t)requests[i].r_len;
+        }
+        return io;
+    }
+
+    io->segments = malloc(count * sizeof(block_segment_t) + 1);
+    io->iov = malloc(count * sizeof(struct iovec) + 1);
+    if (io->segments == NULL || io->iov == NULL) {
+        free(io->segments);
+        free(io->iov);
+        free(io);
+        return NULL;
+    }
+
+    // Merged requests keep consecutive slots of the iovec array
+    for (size_t i = 0; i < count; i++) {
+        block_request_t const *r = &requests[i];
+        block_segment_t *last =
+            io->count > 0 ? &io->segments[io->count - 1] : NULL;
+        io->iov[i].iov_base = r->r_buffer;
+        io->iov[i].iov_len = r->r_len;
+
+        if (last != NULL && last->op == r->r_op &&
+            last->offset + last->len == r->r_offset &&
+            last->iovcnt < BLOCK_DEVICE_MAX_IOVECS) {
+            last->len += r->r_len;
+            last->iovcnt++;
+        } else {
+            io->segments[io->count++] = (block_segment_t){.io = io,
+                                                          .op = r->r_op,
+                                                          .offset = r->r_offset,
+                                                          .len = r->r_len,
+                                                          .iov = &io->iov[i],
+                                                          .iovcnt = 1};
+        }
+    }
+
+    io->ring = block_ring_get(device);
+    if (io->ring == NULL) {
+        for (; io->submitted < io->count; io->submitted++) {
+            block_segment_complete(&io->segments[io->submitted], 0);
+        }
+    } else {
+        block_ring_submit(io->ring, io);
+    }
+    return io;
+}
+
+/**
+ * Wait for a batch of transfers to complete, and free it.
+ *
+ * Input:
+ *   - io: the batch (NULL if it could not be submitted)
+ *
+ * Returns the number of bytes transferred, or -1 if any transfer failed.
+ */
+ssize_t block_device_wait(block_io_t *io) {
+    if (io == NULL) {
+        return -1;
+    }
+
+    while (io->completed < io->count) {
+        block_ring_submit(io->ring, io);
+        if (io->completed < io->count) {
+            block_ring_reap(io->ring, io->device);
+        }
+    }
+
+    ssize_t result = io->failed ? -1 : io->bytes;
+    free(io->segments);
+    free(io->iov);
+    free(io);
+    return result;
+}
+
+/**
+ * Do a batch of transfers (see block_device_submit) and wait for them.
+ *
+ * Returns the number of bytes transferred, or -1 if any transfer failed.
+ */
+ssize_t block_device_io(block_device_t *device,
+                        block_request_t const *requests, size_t count) {
+    return block_device_wait(block_device_submit(device, requests, count));
+}
@@ -0,0 +1,52 @@
+#ifndef BLOCK_DEVICE_H
+#define BLOCK_DEVICE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Block device: the storage under the data blocks. The RAM backend keeps them
+ * in memory (addressable, so callers may also access them directly, see
+ * block_device_memory), optionally writing them through to a host file it is
+ * a private mapping of; the file backend keeps them in a host file, doing I/O
+ * through io_uring (one ring per thread) or, if that is not available,
+ * through preadv/pwritev.
+ *
+ * Requests are submitted in batches and completed asynchronously: requests
+ * of a batch that touch adjacent ranges are merged, and up to the queue depth
+ * of them are in flight at a time.
+ */
+
+typedef enum { BLOCK_READ, BLOCK_WRITE } block_op_t;
+
+/**
+ * A transfer between a buffer and a byte range of the device.
+ */
+typedef struct {
+    block_op_t r_op;
+    size_t r_offset; // within the device
+    void *r_buffer;
+    size_t r_len;
+} block_request_t;
+
+typedef struct block_device block_device_t;
+typedef struct block_io block_io_t;
+
+block_device_t *block_device_ram_open(void *memory, size_t size);
+block_device_t *block_device_mapped_open(void *memory, size_t size, int fd,
+                                         size_t offset);
+block_device_t *block_device_file_open(char const *path, size_t size,
+                                       unsigned queue_depth);
+void block_device_close(block_device_t *device);
+
+void *block_device_memory(block_device_t const *device);
+int block_device_sync(block_device_t *device);
+
+block_io_t *block_device_submit(block_device_t *device,
+                                block_request_t const *requests,
+                                size_t count);
+ssize_t block_device_wait(block_io_t *io);
+ssize_t block_device_io(block_device_t *device,
+                        block_request_t const *requests, size_t count);
+
+#endif // BLOCK_DEVICE_H
@@ -6,6 +6,72 @@
 
 #define MAX_FILE_NAME (40)
 
+// Number of extents stored directly in the inode; further extents spill into
+// a dedicated overflow block
+#define INODE_INLINE_EXTENTS (4)
+
 #define DELAY (5000)
 
+// Dentry cache associativity and number of locks guarding its sets
+#define DCACHE_WAYS (4)
+#define DCACHE_LOCKS (64)
+
+// Longest chain of symbolic links followed when opening a file
+#define MAX_SYMLINK_HOPS (40)
+
+// Longest symbolic link target, including the terminating null byte (targets
+// too long to fit in the inode take a data block, and are also limited to its
+// size)
+#define MAX_SYMLINK_TARGET (1024)
+
+// Number of free block numbers each thread keeps cached for allocation
+#define BLOCK_MAGAZINE_SIZE (64)
+
+// Size of the explicit huge pages backing the data blocks (when asked for),
+// and most NUMA nodes the free blocks can be split over
+#define HUGE_PAGE_SIZE (2 << 20)
+#define MAX_NUMA_NODES (64)
+
+// Number of open file table slots allocated at a time
+#define OPEN_FILE_SEGMENT_SIZE (1024)
+
+// Maximum number of contiguous spans handed out by a single borrow
+#define TFS_BORROW_MAX_SPANS (16)
+
+// Number of blocks written per call when copying from the host file system
+#define TFS_COPY_STRIDE_BLOCKS (256)
+
+// Number of new files a tree import creates at a time, before handing them to
+// the copy workers
+#define IMPORT_BATCH (64)
+
+// Default number of transfers in flight per thread on a block device file,
+// requests merged into one transfer at most, and requests issued at a time by
+// a single file read or write
+#define BLOCK_DEVICE_QUEUE_DEPTH (64)
+#define BLOCK_DEVICE_MAX_IOVECS (64)
+#define BLOCK_DEVICE_BATCH (256)
+
+// Default number of entries of the buffer cache, and number of independently
+// locked shards they are spread over
+#define BLOCK_CACHE_SIZE (4096)
+#define BLOCK_CACHE_SHARDS (64)
+
+// Default size of the write-back buffer of a file being appended to, and
+// block bitmap words searched at most for a run of blocks to flush it to
+#define WRITEBACK_BUFFER_SIZE (64 << 10)
+#define BLOCK_RUN_SCAN_WORDS (16)
+
+// Blocks prefetched by the first read-ahead of a sequential reader (the
+// window then doubles up to tfs_params.readahead_max_blocks), default maximum,
+// and block runs queued for prefetching at most
+#define READAHEAD_MIN_BLOCKS (4)
+#define READAHEAD_MAX_BLOCKS (64)
+#define READAHEAD_QUEUE_SIZE (256)
+
+// Committed journal transactions kept in memory before being written anyway,
+// and journal size that triggers a checkpoint of the image
+#define JOURNAL_BUFFER_SIZE (1 << 20)
+#define JOURNAL_CHECKPOINT_SIZE (64 << 20)
+
 #endif // CONFIG_H
@@ -0,0 +1,253 @@
+#include "dcache.h"
+#include "config.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Cached directory entry. d_inumber holds the inumber plus one, so that a
+ * zeroed entry is an empty one.
+ */
+typedef struct {
+    int d_parent;
+    int d_inumber;
+    char d_name[MAX_FILE_NAME];
+} dcache_entry_t;
+
+/**
+ * Set of entries sharing a hash. d_seq is bumped by every invalidation, so
+ * that lookups racing with an invalidation do not insert stale entries.
+ */
+typedef struct {
+    uint64_t d_seq;
+    unsigned d_victim; // next way to replace
+    dcache_entry_t d_ways[DCACHE_WAYS];
+} dcache_set_t;
+
+static dcache_set_t *dcache_sets;
+static size_t dcache_set_count; // a power of two
+static pthread_mutex_t dcache_locks[DCACHE_LOCKS];
+
+// Resolved symbolic links, one per inode: the generation the resolution was
+// made in (high half) and the inumber it ended at plus one (low half, 0 if
+// nothing is cached)
+static _Atomic uint64_t *dcache_symlinks;
+static _Alignas(64) _Atomic uint32_t dcache_generation_counter;
+
+#define DCACHE_MIN_SETS (16)
+#define DCACHE_MAX_SETS (16384)
+
+/**
+ * Obtain the set a (parent inumber, name) pair maps to (FNV-1a hash).
+ */
+static size_t dcache_set_index(int parent_inumber, char const *name) {
+    uint32_t hash = 2166136261u ^ (uint32_t)parent_inumber;
+    hash *= 16777619u;
+    for (size_t i = 0; i < MAX_FILE_NAME && name[i] != '\0'; i++) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return hash & (dcache_set_count - 1);
+}
+
+static inline bool dcache_matches(dcache_entry_t const *entry,
+                                  int parent_inumber, char const *name) {
+    return entry->d_inumber != 0 && entry->d_parent == parent_inumber &&
+           strncmp(entry->d_name, name, MAX_FILE_NAME) == 0;
+}
+
+/**
+ * Initialize the dentry cache.
+ *
+ * Input:
+ *   - inode_count: number of inodes of the file system (used for sizing)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int dcache_init(size_t inode_count) {
+    dcache_set_count = DCACHE_MIN_SETS;
+    while (dcache_set_count < DCACHE_MAX_SETS &&
+           dcache_set_count * DCACHE_WAYS < inode_count) {
+        dcache_set_count *= 2;
+    }
+
+    dcache_sets = calloc(dcache_set_count, sizeof(dcache_set_t));
+    dcache_symlinks = calloc(inode_count, sizeof(*dcache_symlinks));
+    if (dcache_sets == NULL || dcache_symlinks == NULL) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < DCACHE_LOCKS; i++) {
+        pthread_mutex_init(&dcache_locks[i], NULL);
+    }
+    return 0;
+}
+
+/**
+ * Destroy the dentry cache.
+ */
+void dcache_destroy(void) {
+    for (size_t i = 0; i < DCACHE_LOCKS; i++) {
+        pthread_mutex_destroy(&dcache_locks[i]);
+    }
+    free(dcache_sets);
+    free(dcache_symlinks);
+    dcache_sets = NULL;
+    dcache_symlinks = NULL;
+}
+
+/**
+ * Look up a name in the dentry cache.
+ *
+ * Input:
+ *   - parent_inumber: inumber of the directory
+ *   - name: the name within the directory
+ *
+ * Returns the cached inumber, or -1 if the name is not cached.
+ */
+int dcache_lookup(int parent_inumber, char const *name) {
+    size_t set_index = dcache_set_index(parent_inumber, name);
+    dcache_set_t *set = &dcache_sets[set_index];
+    pthread_mutex_t *lock = &dcache_locks[set_index % DCACHE_LOCKS];
+
+    int inumber = -1;
+    pthread_mutex_lock(lock);
+    for (size_t i = 0; i < DCACHE_WAYS; i++) {
+        if (dcache_matches(&set->d_ways[i], parent_inumber, name)) {
+            inumber = set->d_ways[i].d_inumber - 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(lock);
+    return inumber;
+}
+
+/**
+ * Obtain the invalidation sequence number of the set a name maps to. Must be
+ * read before looking the name up in the directory, and passed to
+ * dcache_insert.
+ *
+ * Input:
+ *   - parent_inumber: inumber of the directory
+ *   - name: the name within the directory
+ */
+uint64_t dcache_seq(int parent_inumber, char const *name) {
+    size_t set_index = dcache_set_index(parent_inumber, name);
+    pthread_mutex_t *lock = &dcache_locks[set_index % DCACHE_LOCKS];
+
+    pthread_mutex_lock(lock);
+    uint64_t seq = dcache_sets[set_index].d_seq;
+    pthread_mutex_unlock(lock);
+    return seq;
+}
+
+/**
+ * Cache the inumber a name resolves to. Nothing is cached if the set was
+ * invalidated since seq was read.
+ *
+ * Input:
+ *   - parent_inumber: inumber of the directory
+ *   - name: the name within the directory
+ *   - inumber: the inumber the name resolves to
+ *   - seq: the value returned by dcache_seq before the directory lookup
+ */
+void dcache_insert(int parent_inumber, char const *name, int inumber,
+                   uint64_t seq) {
+    size_t set_index = dcache_set_index(parent_inumber, name);
+    dcache_set_t *set = &dcache_sets[set_index];
+    pthread_mutex_t *lock = &dcache_locks[set_index % DCACHE_LOCKS];
+
+    pthread_mutex_lock(lock);
+    if (set->d_seq == seq) {
+        dcache_entry_t *entry = NULL;
+        for (size_t i = 0; i < DCACHE_WAYS && entry == NULL; i++) {
+            if (dcache_matches(&set->d_ways[i], parent_inumber, name)) {
+                entry = &set->d_ways[i];
+            }
+        }
+        for (size_t i = 0; i < DCACHE_WAYS && entry == NULL; i++) {
+            if (set->d_ways[i].d_inumber == 0) {
+                entry = &set->d_ways[i];
+            }
+        }
+        if (entry == NULL) {
+            entry = &set->d_ways[set->d_victim];
+            set->d_victim = (set->d_victim + 1) % DCACHE_WAYS;
+        }
+
+        entry->d_parent = parent_inumber;
+        entry->d_inumber = inumber + 1;
+        strncpy(entry->d_name, name, MAX_FILE_NAME - 1);
+        entry->d_name[MAX_FILE_NAME - 1] = '\0';
+    }
+    pthread_mutex_unlock(lock);
+}
+
+/**
+ * Drop a name from the dentry cache. Must be called whenever the name is
+ * removed from its directory.
+ *
+ * Input:
+ *   - parent_inumber: inumber of the directory
+ *   - name: the name within the directory
+ */
+void dcache_invalidate(int parent_inumber, char const *name) {
+    size_t set_index = dcache_set_index(parent_inumber, name);
+    dcache_set_t *set = &dcache_sets[set_index];
+    pthread_mutex_t *lock = &dcache_locks[set_index % DCACHE_LOCKS];
+
+    pthread_mutex_lock(lock);
+    set->d_seq++;
+    for (size_t i = 0; i < DCACHE_WAYS; i++) {
+        if (dcache_matches(&set->d_ways[i], parent_inumber, name)) {
+            set->d_ways[i].d_inumber = 0;
+        }
+    }
+    pthread_mutex_unlock(lock);
+
+    // Any symbolic link may have gone through the name
+    atomic_fetch_add(&dcache_generation_counter, 1);
+}
+
+/**
+ * Obtain the current generation of the cached symbolic link resolutions. Must
+ * be read before resolving a link, and passed to dcache_symlink_insert.
+ */
+uint32_t dcache_generation(void) {
+    return atomic_load(&dcache_generation_counter);
+}
+
+/**
+ * Look up the file a symbolic link resolved to.
+ *
+ * Input:
+ *   - sym_inumber: inumber of the symbolic link
+ *
+ * Returns the cached inumber, or -1 if the link's resolution is not cached
+ * (or some name was removed since it was made).
+ */
+int dcache_symlink_lookup(int sym_inumber) {
+    uint64_t cached = atomic_load(&dcache_symlinks[sym_inumber]);
+    uint32_t inumber = (uint32_t)cached;
+    if (inumber == 0 || (uint32_t)(cached >> 32) != dcache_generation()) {
+        return -1;
+    }
+    return (int)inumber - 1;
+}
+
+/**
+ * Cache the file a symbolic link resolved to. A resolution made in an older
+ * generation is never returned by dcache_symlink_lookup.
+ *
+ * Input:
+ *   - sym_inumber: inumber of the symbolic link
+ *   - inumber: the inumber the link resolved to
+ *   - generation: the value returned by dcache_generation before the link
+ *     was resolved
+ */
+void dcache_symlink_insert(int sym_inumber, int inumber, uint32_t generation) {
+    atomic_store(&dcache_symlinks[sym_inumber],
+                 (uint64_t)generation << 32 | (uint32_t)(inumber + 1));
+}
@@ -0,0 +1,28 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Dentry cache: remembers which inode a name resolves to inside a directory,
+ * so that path walks can skip find_in_dir (and the directory's inode_get) for
+ * components resolved recently. It also remembers the file each symbolic link
+ * resolved to, for as long as no name is removed anywhere (removals bump a
+ * generation number the cached resolutions are tagged with).
+ */
+
+int dcache_init(size_t inode_count);
+void dcache_destroy(void);
+
+int dcache_lookup(int parent_inumber, char const *name);
+uint64_t dcache_seq(int parent_inumber, char const *name);
+void dcache_insert(int parent_inumber, char const *name, int inumber,
+                   uint64_t seq);
+void dcache_invalidate(int parent_inumber, char const *name);
+
+uint32_t dcache_generation(void);
+int dcache_symlink_lookup(int sym_inumber);
+void dcache_symlink_insert(int sym_inumber, int inumber, uint32_t generation);
+
+#endif // DCACHE_H
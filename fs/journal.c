@@ -0,0 +1,524 @@
+#include "journal.h"
+#include "config.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Transaction header. It is followed by t_len bytes of records, each a
+ * journal_record_t followed by the range's new contents (padded to 8 bytes).
+ */
+typedef struct {
+    uint32_t t_magic;
+    uint32_t t_len;
+    uint64_t t_lsn;
+    uint64_t t_checksum; // of the records
+} journal_txn_t;
+
+typedef struct {
+    uint64_t r_offset; // within the image
+    uint64_t r_len;
+    uint64_t r_seq; // order in which the ranges were changed
+} journal_record_t;
+
+#define JOURNAL_MAGIC (0x4a534654u) // "TFSJ"
+#define PAD8(x) (((x) + 7) / 8 * 8)
+
+/**
+ * Growable byte buffer.
+ */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} journal_buffer_t;
+
+static struct {
+    int fd;       // -1 if the journal is not open
+    int image_fd; // the image file, which only receives committed changes
+    char *base;
+    size_t size;
+
+    pthread_mutex_t lock;
+    pthread_cond_t flushed;
+    journal_buffer_t pending; // committed, but not yet written
+    uint64_t next_lsn;        // LSN of the next transaction to commit
+    uint64_t written_lsn;     // transactions below this one are written
+    uint64_t synced_lsn;      // transactions below this one are synced
+    uint64_t sync_wanted_lsn; // a committer waits for this one to be synced
+    bool flushing;            // a leader is writing to the file
+    size_t file_len;          // bytes written since the last checkpoint
+    uint64_t generation;      // bumped every time a journal is opened
+} journal = {.fd = -1,
+             .lock = PTHREAD_MUTEX_INITIALIZER,
+             .flushed = PTHREAD_COND_INITIALIZER};
+
+// Transactions are committed in any order relative to the locks held while
+// recording them, so replay orders the changes to each range by this counter,
+// taken while the lock protecting the range is held
+static atomic_uint_least64_t journal_seq;
+
+// Threads holding changes they have not committed yet: a checkpoint only
+// applies the journal when there are none, as a change committed later could
+// otherwise be older (by journal_seq) than one already applied to the image
+static atomic_size_t journal_open_txns;
+
+// Changes recorded by this thread since its last commit, to the journal
+// opened with the given generation
+static _Thread_local journal_buffer_t thread_txn;
+static _Thread_local uint64_t thread_txn_generation;
+// Set when one of those changes could not be recorded: the image file would
+// never get it, so the commit that follows fails
+static _Thread_local bool thread_txn_failed;
+static pthread_key_t thread_txn_key;
+static pthread_once_t thread_txn_key_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Free a thread's transaction buffer when the thread exits (the changes it
+ * never committed are dropped).
+ */
+static void thread_txn_free(void *data) {
+    if (thread_txn.len > 0 && thread_txn_generation == journal.generation) {
+        atomic_fetch_sub(&journal_open_txns, 1);
+    }
+    free(data);
+}
+
+static void thread_txn_key_create(void) {
+    pthread_key_create(&thread_txn_key, thread_txn_free);
+}
+
+/**
+ * Make room for len more bytes in a buffer.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int buffer_reserve(journal_buffer_t *buffer, size_t len) {
+    if (buffer->len + len <= buffer->cap) {
+        return 0;
+    }
+
+    size_t cap = buffer->cap == 0 ? 4096 : buffer->cap;
+    while (cap < buffer->len + len) {
+        cap *= 2;
+    }
+    char *data = realloc(buffer->data, cap);
+    if (data == NULL) {
+        return -1;
+    }
+    buffer->data = data;
+    buffer->cap = cap;
+    return 0;
+}
+
+/**
+ * FNV-1a hash of a byte range.
+ */
+static uint64_t journal_checksum(char const *data, size_t len) {
+    uint64_t hash = UINT64_C(14695981039346656037);
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)data[i]) * UINT64_C(1099511628211);
+    }
+    return hash;
+}
+
+/**
+ * Write a whole buffer to the journal file.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int journal_write(char const *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(journal.fd, data, len);
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int record_seq_compare(void const *a, void const *b) {
+    journal_record_t const *ra = *(journal_record_t const *const *)a;
+    journal_record_t const *rb = *(journal_record_t const *const *)b;
+    return (ra->r_seq > rb->r_seq) - (ra->r_seq < rb->r_seq);
+}
+
+/**
+ * Write a whole buffer to the image file, at a given offset.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int image_write(char const *data, size_t len, size_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(journal.image_fd, data, len, (off_t)offset);
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+        offset += (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * Apply the valid transactions of the journal file to the image file,
+ * stopping at the first torn or corrupted one, and sync it.
+ *
+ * Input:
+ *   - to_memory: whether to apply them to the mapped image too (when
+ *     attaching it; afterwards, the mapping is always ahead of the journal)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int journal_apply(bool to_memory) {
+    struct stat st;
+    if (fstat(journal.fd, &st) == -1) {
+        return -1;
+    }
+    size_t len = (size_t)st.st_size;
+    if (len == 0) {
+        return fdatasync(journal.image_fd);
+    }
+
+    char *data = malloc(len);
+    journal_record_t **records =
+        malloc(len / sizeof(journal_record_t) * sizeof(*records));
+    if (data == NULL || records == NULL ||
+        pread(journal.fd, data, len, 0) != (ssize_t)len) {
+        free(data);
+        free(records);
+        return -1;
+    }
+
+    // Collect the records of the valid transactions (the file is read with
+    // the alignment of malloc, and every record starts 8-byte aligned)
+    size_t record_count = 0;
+    size_t pos = 0;
+    uint64_t lsn = 0;
+    while (pos + sizeof(journal_txn_t) <= len) {
+        journal_txn_t const *txn = (journal_txn_t const *)(data + pos);
+        char *txn_records = data + pos + sizeof(*txn);
+        if (txn->t_magic != JOURNAL_MAGIC ||
+            txn->t_len > len - pos - sizeof(*txn) || txn->t_lsn < lsn ||
+            txn->t_checksum != journal_checksum(txn_records, txn->t_len)) {
+            break; // torn write: nothing after it was committed
+        }
+
+        for (size_t r = 0; r + sizeof(journal_record_t) <= txn->t_len;) {
+            journal_record_t *record = (journal_record_t *)(txn_records + r);
+            r += sizeof(*record);
+            if (record->r_offset <= journal.size &&
+                record->r_len <= journal.size - record->r_offset &&
+                record->r_len <= txn->t_len - r) {
+                records[record_count++] = record;
+            }
+            r += PAD8(record->r_len);
+        }
+
+        lsn = txn->t_lsn;
+        pos += sizeof(*txn) + txn->t_len;
+    }
+
+    qsort(records, record_count, sizeof(*records), record_seq_compare);
+    int result = 0;
+    for (size_t r = 0; result == 0 && r < record_count; r++) {
+        if (to_memory) {
+            memcpy(journal.base + records[r]->r_offset, records[r] + 1,
+                   records[r]->r_len);
+        }
+        result = image_write((char const *)(records[r] + 1),
+                             records[r]->r_len, records[r]->r_offset);
+    }
+
+    free(records);
+    free(data);
+    return result == 0 ? fdatasync(journal.image_fd) : -1;
+}
+
+/**
+ * Empty the journal file.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int journal_truncate(void) {
+    return ftruncate(journal.fd, 0) == -1 || fsync(journal.fd) == -1 ? -1 : 0;
+}
+
+/**
+ * Apply the journal file to the image file and empty it. Must be called
+ * either with the journal lock held or as the flushing leader, with every
+ * transaction logged so far written to the file (see journal_open_txns).
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int journal_checkpoint(void) {
+    return journal_apply(false) == -1 || journal_truncate() == -1 ? -1 : 0;
+}
+
+/**
+ * Open the journal of an image, replaying it if requested.
+ *
+ * Input:
+ *   - path: path name of the journal file (created if missing)
+ *   - image_fd: the image file (left open by journal_close)
+ *   - base: the image, mapped privately (so that only the committed changes
+ *     reach the file, through the journal)
+ *   - size: size of the image
+ *   - replay: whether to replay the journal into the image (an image that was
+ *     just created has nothing to replay)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int journal_open(char const *path, int image_fd, void *base, size_t size,
+                 bool replay) {
+    pthread_once(&thread_txn_key_once, thread_txn_key_create);
+
+    journal.fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (journal.fd == -1) {
+        return -1;
+    }
+    journal.image_fd = image_fd;
+    journal.base = base;
+    journal.size = size;
+    journal.generation++;
+    atomic_store(&journal_open_txns, 0);
+    journal.pending.len = 0;
+    journal.next_lsn = 1;
+    journal.written_lsn = 1;
+    journal.synced_lsn = 1;
+    journal.sync_wanted_lsn = 0;
+    journal.flushing = false;
+    journal.file_len = 0;
+
+    if ((replay && journal_apply(true) == -1) || journal_truncate() == -1) {
+        close(journal.fd);
+        journal.fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Write out every committed transaction, checkpoint the image and close the
+ * journal (the image file stays open). Changes other threads never committed
+ * are dropped.
+ */
+void journal_close(void) {
+    if (journal.fd == -1) {
+        return;
+    }
+
+    journal_sync(TFS_DURABILITY_WRITTEN);
+    pthread_mutex_lock(&journal.lock);
+    while (journal.flushing) {
+        pthread_cond_wait(&journal.flushed, &journal.lock);
+    }
+    journal_checkpoint();
+    journal.file_len = 0;
+    close(journal.fd);
+    journal.fd = -1;
+    free(journal.pending.data);
+    journal.pending = (journal_buffer_t){0};
+    pthread_mutex_unlock(&journal.lock);
+}
+
+/**
+ * Record the new contents of a range of the image in the calling thread's
+ * transaction. Must be called right after changing the range, with the lock
+ * protecting it still held. Does nothing if the journal is not open. If the
+ * change cannot be recorded (out of memory), the thread's next commit fails.
+ *
+ * Input:
+ *   - ptr: start of the range (within the image)
+ *   - len: length of the range
+ */
+void journal_log(void const *ptr, size_t len) {
+    if (journal.fd == -1) {
+        return;
+    }
+
+    if (thread_txn_generation != journal.generation) {
+        thread_txn.len = 0; // left over from a previous journal
+        thread_txn_generation = journal.generation;
+        thread_txn_failed = false;
+    }
+
+    char *old_data = thread_txn.data;
+    if (buffer_reserve(&thread_txn, sizeof(journal_record_t) + PAD8(len)) ==
+        -1) {
+        thread_txn_failed = true;
+        return;
+    }
+    if (thread_txn.data != old_data) {
+        pthread_setspecific(thread_txn_key, thread_txn.data);
+    }
+    if (thread_txn.len == 0) {
+        // Before taking a sequence number (see journal_open_txns)
+        atomic_fetch_add(&journal_open_txns, 1);
+    }
+
+    journal_record_t record = {
+        .r_offset = (uint64_t)((char const *)ptr - journal.base),
+        .r_len = len,
+        .r_seq = atomic_fetch_add(&journal_seq, 1)};
+    memcpy(thread_txn.data + thread_txn.len, &record, sizeof(record));
+    memcpy(thread_txn.data + thread_txn.len + sizeof(record), ptr, len);
+    memset(thread_txn.data + thread_txn.len + sizeof(record) + len, 0,
+           PAD8(len) - len);
+    thread_txn.len += sizeof(record) + PAD8(len);
+}
+
+/**
+ * Wait until every transaction below lsn reaches a durability level, becoming
+ * the leader that writes (and syncs) everything pending if no other thread is
+ * doing so. Must be called with the journal lock held.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int journal_wait(uint64_t lsn, tfs_durability_t durability) {
+    if (durability == TFS_DURABILITY_SYNCED && lsn > journal.sync_wanted_lsn) {
+        journal.sync_wanted_lsn = lsn;
+    }
+
+    int result = 0;
+    while (result == 0 &&
+           ((durability >= TFS_DURABILITY_WRITTEN &&
+             journal.written_lsn < lsn) ||
+            (durability == TFS_DURABILITY_SYNCED &&
+             journal.synced_lsn < lsn))) {
+        if (journal.flushing) {
+            pthread_cond_wait(&journal.flushed, &journal.lock);
+            continue;
+        }
+
+        // Become the leader: write every transaction committed so far (ours
+        // and those of the threads waiting behind us) in one go
+        journal_buffer_t batch = journal.pending;
+        journal.pending = (journal_buffer_t){0};
+        uint64_t end_lsn = journal.next_lsn;
+        bool sync = journal.sync_wanted_lsn > journal.synced_lsn;
+        // Once the batch is written, the file holds every change logged so
+        // far if no thread has uncommitted ones
+        bool checkpoint =
+            journal.file_len + batch.len > JOURNAL_CHECKPOINT_SIZE &&
+            atomic_load(&journal_open_txns) == 0;
+        journal.flushing = true;
+        pthread_mutex_unlock(&journal.lock);
+
+        // The file is only touched by the leader, so the image is brought up
+        // to date without holding back the threads committing meanwhile
+        result = journal_write(batch.data, batch.len);
+        if (result == 0 && sync) {
+            result = fdatasync(journal.fd);
+        }
+        int checkpoint_result = 0;
+        if (result == 0 && checkpoint) {
+            checkpoint_result = journal_checkpoint();
+        }
+
+        pthread_mutex_lock(&journal.lock);
+        if (result == 0) {
+            journal.written_lsn = end_lsn;
+            if (sync) {
+                journal.synced_lsn = end_lsn;
+            }
+            journal.file_len = checkpoint && checkpoint_result == 0
+                                   ? 0
+                                   : journal.file_len + batch.len;
+            result = checkpoint_result;
+        }
+        // Keep the larger buffer around for the next batch
+        if (journal.pending.data == NULL) {
+            batch.len = 0;
+            journal.pending = batch;
+        } else {
+            free(batch.data);
+        }
+        journal.flushing = false;
+        pthread_cond_broadcast(&journal.flushed);
+    }
+    return result;
+}
+
+/**
+ * Commit the changes recorded by the calling thread as one transaction.
+ *
+ * Input:
+ *   - durability: how far the transaction must go before returning
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - A change could not be recorded (see journal_log); the others are still
+ *     committed.
+ *   - The journal file cannot be written or synced.
+ */
+int journal_commit(tfs_durability_t durability) {
+    bool failed =
+        thread_txn_failed && thread_txn_generation == journal.generation;
+    thread_txn_failed = false;
+    if (journal.fd == -1 || thread_txn.len == 0 ||
+        thread_txn_generation != journal.generation) {
+        int result = journal_sync(durability);
+        return failed ? -1 : result;
+    }
+
+    pthread_mutex_lock(&journal.lock);
+    if (buffer_reserve(&journal.pending,
+                       sizeof(journal_txn_t) + thread_txn.len) == -1) {
+        pthread_mutex_unlock(&journal.lock);
+        thread_txn_failed = failed; // reported again by the next commit
+        return -1;
+    }
+
+    journal_txn_t txn = {.t_magic = JOURNAL_MAGIC,
+                         .t_len = (uint32_t)thread_txn.len,
+                         .t_lsn = journal.next_lsn++,
+                         .t_checksum =
+                             journal_checksum(thread_txn.data, thread_txn.len)};
+    memcpy(journal.pending.data + journal.pending.len, &txn, sizeof(txn));
+    memcpy(journal.pending.data + journal.pending.len + sizeof(txn),
+           thread_txn.data, thread_txn.len);
+    journal.pending.len += sizeof(txn) + thread_txn.len;
+    thread_txn.len = 0;
+    atomic_fetch_sub(&journal_open_txns, 1);
+
+    // Transactions left in memory are still written once enough pile up
+    if (durability == TFS_DURABILITY_NONE &&
+        journal.pending.len >= JOURNAL_BUFFER_SIZE) {
+        durability = TFS_DURABILITY_WRITTEN;
+    }
+    int result = journal_wait(txn.t_lsn + 1, durability);
+    pthread_mutex_unlock(&journal.lock);
+    return failed ? -1 : result;
+}
+
+/**
+ * Bring every transaction committed so far (by any thread) to a durability
+ * level.
+ *
+ * Input:
+ *   - durability: the durability level
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int journal_sync(tfs_durability_t durability) {
+    if (journal.fd == -1) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&journal.lock);
+    int result = journal_wait(journal.next_lsn, durability);
+    pthread_mutex_unlock(&journal.lock);
+    return result;
+}
@@ -0,0 +1,34 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "operations.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Metadata journal: a physical redo log of the image ranges changed by each
+ * operation, kept in a host file next to the image. Threads record changes as
+ * they make them, and commit them as one transaction per operation;
+ * concurrent commits are written (and synced) together. Attaching an image
+ * replays the transactions committed since its last checkpoint.
+ *
+ * The image is mapped privately, so the metadata only reaches the image file
+ * through the journal: a checkpoint copies the committed changes from the
+ * journal file to the image file (no-steal), and uncommitted ones never get
+ * there.
+ *
+ * The journal is only active when the state is kept in an image (see
+ * tfs_params.image_path); otherwise journal_log and journal_commit do
+ * nothing.
+ */
+
+int journal_open(char const *path, int image_fd, void *base, size_t size,
+                 bool replay);
+void journal_close(void);
+
+void journal_log(void const *ptr, size_t len);
+int journal_commit(tfs_durability_t durability);
+int journal_sync(tfs_durability_t durability);
+
+#endif // JOURNAL_H
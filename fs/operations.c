@@ -1,13 +1,25 @@
+#define _DEFAULT_SOURCE // pwritev
 #include "operations.h"
+#include "block_cache.h"
 #include "config.h"
+#include "dcache.h"
+#include "journal.h"
 #include "state.h"
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 
+#include <dirent.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "betterassert.h"
 
 //Sc - mexer com inodes e mexer com ficheiros abertos
@@ -25,13 +37,36 @@ tfs_params tfs_default_params() {
     tfs_params params = {
         .max_inode_count = 64,
         .max_block_count = 1024,
-        .max_open_files_count = 16,
+        .max_open_files_count = 1 << 20,
         .block_size = 1024,
-        
+        .image_path = NULL,
+        .durability = TFS_DURABILITY_WRITTEN,
+        .device_path = NULL,
+        .device_queue_depth = BLOCK_DEVICE_QUEUE_DEPTH,
+        .cache_size = BLOCK_CACHE_SIZE,
+        .readahead_max_blocks = READAHEAD_MAX_BLOCKS,
+        .writeback_size = WRITEBACK_BUFFER_SIZE,
+        .huge_pages = false,
+        .prefault = false,
+        .numa_nodes = 1,
     };
     return params;
 }
 
+// Durability of the metadata changes made by each operation
+static tfs_durability_t tfs_durability;
+
+// Whether tfs_init got as far as taking a reference to the root directory
+static bool root_acquired;
+
+/**
+ * Commit the metadata changes made by the calling thread's current operation
+ * (see journal_commit).
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int tfs_commit(void) { return journal_commit(tfs_durability); }
+
 int tfs_init(tfs_params const *params_ptr) {
     tfs_params params;
 
@@ -44,66 +79,197 @@ int tfs_init(tfs_params const *params_ptr) {
     if (state_init(params) != 0) {
         return -1;
     }
+    tfs_durability = params.durability;
 
-    // create root inode
-    int root = inode_create(T_DIRECTORY);
-    if (root != ROOT_DIR_INUM) {
-        return -1;
+    // create root inode (unless an existing image was attached)
+    if (isFreeInode(ROOT_DIR_INUM)) {
+        int root = inode_create(T_DIRECTORY);
+        if (root != ROOT_DIR_INUM) {
+            state_destroy();
+            return -1;
+        }
     }
+    // Every path lookup starts at the root, so it is kept in memory
+    inode_acquire(ROOT_DIR_INUM);
+    root_acquired = true;
 
-    return 0;
+    return tfs_commit();
 }
 
 int tfs_destroy() {
+    if (root_acquired) {
+        inode_release(ROOT_DIR_INUM);
+        root_acquired = false;
+    }
+    if (inode_writeback_flush_all() == -1 || tfs_commit() == -1) {
+        state_destroy();
+        return -1;
+    }
     if (state_destroy() != 0) {
         return -1;
     }
     return 0;
 }
 
+int tfs_sync(tfs_durability_t durability) {
+    if (inode_writeback_flush_all() == -1) {
+        return -1;
+    }
+    // Also commits whatever the calling thread left uncommitted
+    return journal_commit(durability);
+}
+
+void tfs_cache_stats(tfs_cache_stats_t *stats) {
+    block_cache_stats(&stats->cs_hits, &stats->cs_misses,
+                      &stats->cs_evictions);
+}
+
+void tfs_alloc_stats(tfs_alloc_stats_t *stats) {
+    data_block_stats(&stats->as_nodes, &stats->as_local, &stats->as_remote);
+}
+
+void tfs_lock_stats(tfs_lock_stats_t *stats) {
+    allocator_lock_stats(&stats->ls_acquired, &stats->ls_contended);
+}
+
+int tfs_readahead_stats(int fhandle, tfs_readahead_stats_t *stats) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL || stats == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&file->of_lock);
+    *stats = file->of_readahead.ra_stats;
+    stats->rs_window = file->of_readahead.ra_window;
+    pthread_mutex_unlock(&file->of_lock);
+    return 0;
+}
+
 static bool valid_pathname(char const *name) {
     return name != NULL && strlen(name) > 1 && name[0] == '/';
 }
 
 /**
- * Looks for a file.
+ * Looks for a name inside a directory, going through the dentry cache first.
  *
- * Note: as a simplification, only a plain directory space (root directory only)
- * is supported.
+ * Input:
+ *   - dir_inum: inumber of the directory
+ *   - sub_name: name within the directory
+ * Returns the inumber of the file, -1 if unsuccessful.
+ */
+static int tfs_lookup_in(int dir_inum, char const *sub_name) {
+    int inum = dcache_lookup(dir_inum, sub_name);
+    if (inum != -1) {
+        return inum;
+    }
+
+    uint64_t seq = dcache_seq(dir_inum, sub_name);
+    inum = find_in_dir(inode_get(dir_inum), sub_name);
+    if (inum != -1) {
+        dcache_insert(dir_inum, sub_name, inum, seq);
+    }
+    return inum;
+}
+
+/**
+ * Resolves the directory holding the last component of a path.
  *
  * Input:
  *   - name: absolute path name
- *   - root_inode: the root directory inode
- * Returns the inumber of the file, -1 if unsuccessful.
+ *   - base: where to store the last component (MAX_FILE_NAME bytes)
+ * Returns the inumber of the directory, -1 if unsuccessful.
  */
-static int tfs_lookup(char const *name, inode_t const *root_inode) {
-    // TODO: assert that root_inode is the root directory
+static int tfs_lookup_parent(char const *name, char *base) {
     if (!valid_pathname(name)) {
         return -1;
     }
 
-    // skip the initial '/' character
-    name++;
-    return find_in_dir(root_inode, name);
+    int dir_inum = ROOT_DIR_INUM;
+    while (true) {
+        while (*name == '/') {
+            name++;
+        }
+        size_t len = strcspn(name, "/");
+        if (len == 0 || len > MAX_FILE_NAME - 1) {
+            return -1;
+        }
+        memcpy(base, name, len);
+        base[len] = '\0';
+
+        name += len;
+        while (*name == '/') {
+            name++;
+        }
+        if (*name == '\0') {
+            return dir_inum; // base is the last component
+        }
+
+        dir_inum = tfs_lookup_in(dir_inum, base);
+        if (dir_inum == -1) {
+            return -1;
+        }
+    }
 }
 
-// New
+/**
+ * Looks for a file, walking the directories of its path.
+ *
+ * Input:
+ *   - name: absolute path name
+ * Returns the inumber of the file, -1 if unsuccessful.
+ */
+static int tfs_lookup(char const *name) {
+    char base[MAX_FILE_NAME];
+    int dir_inum = tfs_lookup_parent(name, base);
+    if (dir_inum == -1) {
+        return -1;
+    }
+    return tfs_lookup_in(dir_inum, base);
+}
+
+/**
+ * Follows a chain of symbolic links, going through the cached resolutions
+ * first.
+ *
+ * Input:
+ *   - inum: inumber of the first link of the chain
+ * Returns the inumber of the file the chain ends at, -1 if a link is dangling
+ * or the chain is longer than MAX_SYMLINK_HOPS links (e.g., a cycle).
+ */
 int get_hard_link_inum(int inum) {
-    inode_t *inode = inode_get(inum);
-    inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
+    int resolved = dcache_symlink_lookup(inum);
+    if (resolved != -1) {
+        return resolved;
+    }
 
-    pthread_rwlock_rdlock(&inode -> trinco);
-    while (inode -> i_node_type == SYM_LINK){
-        inum = tfs_lookup(inode -> sym_path, root_dir_inode);
-        if (inum < 0){
-            pthread_rwlock_unlock(&inode -> trinco);
-            return -1;
+    uint32_t generation = dcache_generation();
+    int first = inum;
+    for (int hops = 0;; hops++) {
+        inode_t *inode = inode_get(inum);
+        char target[MAX_SYMLINK_TARGET];
+
+        // Each link's target is read under its own lock
+        pthread_rwlock_rdlock(inode_lock(inode));
+        bool is_link = inode -> i_node_type == SYM_LINK;
+        if (is_link) {
+            inode_symlink_get(inode, target);
+        }
+        pthread_rwlock_unlock(inode_lock(inode));
+        if (!is_link) {
+            break;
+        }
+        if (hops == MAX_SYMLINK_HOPS) {
+            return -1; // too many links (ELOOP)
         }
-        inode = inode_get(inum);
 
+        int next = tfs_lookup(target);
+        if (next < 0){
+            return -1;
+        }
+        inum = next;
     }
 
-    pthread_rwlock_unlock(&inode -> trinco);
+    dcache_symlink_insert(first, inum, generation);
     return inum;
 }
 
@@ -119,73 +285,95 @@ int tfs_open(char const *name, tfs_file_mode_t mode) {
         return -1;
     }
 
-    inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
-    ALWAYS_ASSERT(root_dir_inode != NULL,
-                  "tfs_open: root dir inode must exist");
-    int inum = tfs_lookup(name, root_dir_inode);
+    int inum = tfs_lookup(name);
 
     size_t offset;
 
     if (inum >= 0) {
 
         // The file already exists
-        inode_t *inode = inode_get(inum);
-        pthread_rwlock_rdlock(&inode -> trinco);
-
-        // If inode is a symbolic link
-        if (inode -> i_node_type == SYM_LINK){
+        // If inode is a symbolic link (checked under its lock, as the link
+        // may be being removed)
+        inode_t *found = inode_get(inum);
+        pthread_rwlock_rdlock(inode_lock(found));
+        bool is_link = found -> i_node_type == SYM_LINK;
+        pthread_rwlock_unlock(inode_lock(found));
+        if (is_link){
             inum = get_hard_link_inum(inum);
             if (inum == -1){
-                pthread_rwlock_unlock(&inode -> trinco);
                 return -1;
             }
         }
 
+        // The open file holds a reference to its inode until it is closed,
+        // so that the operations on it never wait for the inode to be read
+        inode_t *inode = inode_acquire(inum);
         ALWAYS_ASSERT(inode != NULL,
                       "tfs_open: directory files must have an inode");
+        if (inode->i_node_type == T_DIRECTORY) {
+            inode_release(inum);
+            return -1; // directories cannot be opened as files
+        }
+        pthread_rwlock_wrlock(inode_lock(inode));
 
         // Truncate (if requested)
         if (mode & TFS_O_TRUNC) {
-            if (inode->i_size > 0) {
-                data_block_free(inode->i_data_block);
-                inode->i_size = 0;
+            if (inode_pinned(inode)) {
+                pthread_rwlock_unlock(inode_lock(inode));
+                inode_release(inum);
+                return -1; // its blocks are borrowed
             }
+            inode_truncate(inode);
         }
         // Determine initial offset
         if (mode & TFS_O_APPEND) {
-            offset = inode->i_size;
+            offset = inode_size(inode);
         } else {
             offset = 0;
         }
-        pthread_rwlock_unlock(&inode -> trinco);
+        pthread_rwlock_unlock(inode_lock(inode));
 
     } else if (mode & TFS_O_CREAT) {
         // The file does not exist; the mode specified that it should be created
         // Create inode
-        inum = inode_create(T_FILE);
-        inode_t *inode = inode_get(inum);
-        pthread_rwlock_rdlock(&inode -> trinco);
+        char base[MAX_FILE_NAME];
+        int dir_inum = tfs_lookup_parent(name, base);
+        if (dir_inum == -1) {
+            return -1; // the parent directory does not exist
+        }
 
+        inum = inode_create(T_FILE);
         if (inum == -1) {
-            pthread_rwlock_unlock(&inode -> trinco);
             return -1; // no space in inode table
         }
+        inode_t *inode = inode_acquire(inum);
+        pthread_rwlock_rdlock(inode_lock(inode));
 
-        // Add entry in the root directory
-        if (add_dir_entry(root_dir_inode, name + 1, inum) == -1) {
+        // Add entry in the parent directory
+        if (add_dir_entry(inode_get(dir_inum), base, inum) == -1) {
             inode_delete(inum);
-            pthread_rwlock_unlock(&inode -> trinco);
+            pthread_rwlock_unlock(inode_lock(inode));
+            inode_release(inum);
             return -1; // no space in directory
         }
-        pthread_rwlock_unlock(&inode -> trinco);
+        pthread_rwlock_unlock(inode_lock(inode));
         offset = 0;
     } else {
         return -1;
 }
 
+    if ((mode & (TFS_O_CREAT | TFS_O_TRUNC)) && tfs_commit() == -1) {
+        inode_release(inum);
+        return -1;
+    }
+
     // Finally, add entry to the open file table and return the corresponding
     // handle
-    return add_to_open_file_table(inum, offset);
+    int fhandle = add_to_open_file_table(inum, offset);
+    if (fhandle == -1) {
+        inode_release(inum);
+    }
+    return fhandle;
 
     // Note: for simplification, if file was created with TFS_O_CREAT and there
     // is an error adding an entry to the open file table, the file is not
@@ -195,38 +383,45 @@ int tfs_open(char const *name, tfs_file_mode_t mode) {
 int tfs_sym_link(char const *target, char const *link_name) {
 
     // Link must have a valid name
-    if (!valid_pathname(link_name))
+    char base[MAX_FILE_NAME];
+    int dir_inum = tfs_lookup_parent(link_name, base);
+    if (dir_inum == -1)
         return -1;
 
-    inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
-
     // Create inode for the symbolic link 
     int sym_inumber = inode_create(SYM_LINK);
+    if (sym_inumber == -1)
+        return -1; // no space in inode table
 
-    // Add entry in the root directory
     inode_t *sym_inode = inode_get(sym_inumber);
 
-    pthread_rwlock_trywrlock(&sym_inode -> trinco);
-    if (add_dir_entry(root_dir_inode, link_name + 1, sym_inumber) == -1) {
+    // Short targets are kept in the inode, long ones in a data block
+    pthread_rwlock_wrlock(inode_lock(sym_inode));
+    int stored = inode_symlink_set(sym_inode, target);
+    pthread_rwlock_unlock(inode_lock(sym_inode));
+    if (stored == -1) {
+        inode_delete(sym_inumber);
+        return -1; // target too long, or no free data blocks
+    }
+
+    // Add entry in the parent directory
+    if (add_dir_entry(inode_get(dir_inum), base, sym_inumber) == -1) {
         inode_delete(sym_inumber);
         return -1; // no space in directory
     }
-    
-    sym_inode -> i_node_type = SYM_LINK;
-    strcpy(sym_inode -> sym_path, target); 
 
-    pthread_rwlock_unlock(&sym_inode -> trinco);
-    return 0;
+    return tfs_commit();
 }
 
 int tfs_link(char const *target, char const *link_name) {
 
     // Link must have a valid name
-    if (!valid_pathname(link_name) || !valid_pathname(target))
+    char base[MAX_FILE_NAME];
+    int dir_inum = tfs_lookup_parent(link_name, base);
+    if (dir_inum == -1)
         return -1;
 
-    inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);  
-    int target_inum = tfs_lookup(target, root_dir_inode);
+    int target_inum = tfs_lookup(target);
 
     // If target is not a valid entry
     if (target_inum == -1)
@@ -234,123 +429,319 @@ int tfs_link(char const *target, char const *link_name) {
 
     inode_t *target_inode = inode_get(target_inum);
 
-    pthread_rwlock_rdlock(&target_inode -> trinco);
-    // If target is a sym link
-    if (target_inode -> i_node_type == SYM_LINK){
-        pthread_rwlock_unlock(&target_inode -> trinco);
+    pthread_rwlock_wrlock(inode_lock(target_inode));
+    // If target is a sym link or a directory
+    if (target_inode -> i_node_type != T_FILE){
+        pthread_rwlock_unlock(inode_lock(target_inode));
         return -1;      
     }
 
     // If target has no hard links
     if (target_inode -> hl_count == 0){
-        pthread_rwlock_unlock(&target_inode -> trinco);
+        pthread_rwlock_unlock(inode_lock(target_inode));
         return -1;
     }
 
-    // Add entry in the root directory
-    if (add_dir_entry(root_dir_inode, link_name + 1, target_inum) == -1) {
-        inode_delete(target_inum);
-        pthread_rwlock_unlock(&target_inode -> trinco);
-        return -1; // no space in directory
+    // Add entry in the parent directory
+    if (add_dir_entry(inode_get(dir_inum), base, target_inum) == -1) {
+        pthread_rwlock_unlock(inode_lock(target_inode));
+        return -1; // no space in directory, or name already taken
     }
 
     // Updating hard link counter
     target_inode -> hl_count = target_inode -> hl_count + 1;
+    inode_journal(target_inode);
 
-    pthread_rwlock_unlock(&target_inode -> trinco);
-    return 0;
+    pthread_rwlock_unlock(inode_lock(target_inode));
+    return tfs_commit();
 } 
 
 int tfs_unlink(char const *target) {
 
-    inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
-    int link_inum = tfs_lookup(target, root_dir_inode);
+    char base[MAX_FILE_NAME];
+    int dir_inum = tfs_lookup_parent(target, base);
+    if (dir_inum == -1)
+        return -1;
+
+    int link_inum = tfs_lookup_in(dir_inum, base);
+    if (link_inum == -1)
+        return -1;
+
+    inode_t *dir_inode = inode_get(dir_inum);
     inode_t *link_inode = inode_get(link_inum);
 
-    // If inode is soft
+    // The type is only read under the lock, as the inode may have been
+    // deleted and reused (as a directory, even) since it was looked up
+    pthread_rwlock_wrlock(inode_lock(link_inode));
+
+    // Directories are removed with tfs_rmdir
+    if (link_inode -> i_node_type == T_DIRECTORY){
+        pthread_rwlock_unlock(inode_lock(link_inode));
+        return -1;
+    }
+
+    // The entry is only removed if it still names the inode looked up, so
+    // that concurrent unlinks of the same name delete it once
+    if (clear_dir_entry(dir_inode, base, link_inum) == -1){
+        pthread_rwlock_unlock(inode_lock(link_inode));
+        return -1;
+    }
+
+    // If inode is soft (locked until deleted, as a resolution that found it
+    // may still be reading its target)
     if (link_inode -> i_node_type == SYM_LINK){
-        clear_dir_entry(root_dir_inode, target + 1);
         inode_delete(link_inum);
     }
 
-
     // If inode is hard
     else {
-        pthread_rwlock_trywrlock(&link_inode -> trinco);
-        clear_dir_entry(root_dir_inode, target + 1);
         link_inode -> hl_count = link_inode -> hl_count - 1;
+        inode_journal(link_inode);
 
         if (link_inode -> hl_count == 0){
             // TODO: Chek if any processes have the file open
-            inode_delete(link_inum);
+            // (borrowed files are only deleted once released)
+            inode_orphan(link_inum);
         }
-        pthread_rwlock_unlock(&link_inode -> trinco);
     }
+    pthread_rwlock_unlock(inode_lock(link_inode));
 
-    return 0;
+    return tfs_commit();
 }
 
-int tfs_close(int fhandle) {
+int tfs_mkdir(char const *path) {
 
-    open_file_entry_t *file = get_open_file_entry(fhandle);
-    if (file == NULL) {
-        return -1; // invalid fd
+    char base[MAX_FILE_NAME];
+    int dir_inum = tfs_lookup_parent(path, base);
+    if (dir_inum == -1)
+        return -1;
+
+    int inum = inode_create(T_DIRECTORY);
+    if (inum == -1)
+        return -1; // no space in inode table or no free data blocks
+
+    // Add entry in the parent directory
+    if (add_dir_entry(inode_get(dir_inum), base, inum) == -1) {
+        inode_delete(inum);
+        return -1; // no space in directory, or name already taken
     }
 
-    remove_from_open_file_table(fhandle);
+    return tfs_commit();
+}
 
-    return 0;
+int tfs_rmdir(char const *path) {
+
+    char base[MAX_FILE_NAME];
+    int dir_inum = tfs_lookup_parent(path, base);
+    if (dir_inum == -1)
+        return -1;
+
+    int inum = tfs_lookup_in(dir_inum, base);
+    if (inum == -1)
+        return -1;
+
+    inode_t *inode = inode_get(inum);
+
+    // Only empty directories can be removed. The directory stays locked from
+    // the emptiness check until it is deleted, and is marked as dying, so
+    // that entries added meanwhile (or by threads that found it before) are
+    // refused
+    pthread_rwlock_wrlock(inode_lock(inode));
+    if (dir_set_dying(inode, true) == -1) {
+        pthread_rwlock_unlock(inode_lock(inode));
+        return -1;
+    }
+    if (clear_dir_entry(inode_get(dir_inum), base, inum) == -1) {
+        dir_set_dying(inode, false);
+        pthread_rwlock_unlock(inode_lock(inode));
+        return -1;
+    }
+
+    inode_delete(inum);
+    pthread_rwlock_unlock(inode_lock(inode));
+    return tfs_commit();
 }
 
-ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
+/**
+ * Flush the write-back buffer of an open file's inode (see
+ * inode_writeback_flush), committing the blocks it got and freeing the
+ * buffer's memory. A file with nothing buffered (e.g., one only read) costs
+ * neither its lock nor a commit.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int tfs_flush(open_file_entry_t const *file) {
+    inode_t *inode = inode_get(file->of_inumber);
+    if (!inode_writeback_dirty(inode)) {
+        return 0;
+    }
 
-    open_file_entry_t *file = get_open_file_entry(fhandle);
+    pthread_rwlock_wrlock(inode_lock(inode));
+    int result = inode_writeback_flush(inode, true);
+    pthread_rwlock_unlock(inode_lock(inode));
+
+    if (tfs_commit() == -1) {
+        result = -1;
+    }
+    return result;
+}
 
+int tfs_close(int fhandle) {
+    // Blocks for the data appended through the handle are allocated now
+    open_file_entry_t *file = get_open_file_entry(fhandle);
     if (file == NULL) {
         return -1;
     }
+    int result = tfs_flush(file);
+
+    int inumber = file->of_inumber;
+    if (remove_from_open_file_table(fhandle) == -1) {
+        return -1;
+    }
+    inode_release(inumber); // taken when the file was opened
+    return result;
+}
+
+int tfs_fsync(int fhandle, tfs_durability_t durability) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL || tfs_flush(file) == -1 ||
+        journal_commit(durability) == -1) {
+        return -1;
+    }
+    if (durability != TFS_DURABILITY_SYNCED) {
+        return 0;
+    }
 
-    //  From the open file table entry, we get the inode
     inode_t *inode = inode_get(file->of_inumber);
-    ALWAYS_ASSERT(inode != NULL, "tfs_write: inode of open file deleted");
+    pthread_rwlock_rdlock(inode_lock(inode));
+    int result = inode_data_sync(inode);
+    pthread_rwlock_unlock(inode_lock(inode));
+    return result;
+}
 
+/**
+ * Write to an inode at a given offset, gathering the data from a list of
+ * buffers and filling any hole between the end of the file and the offset with
+ * zeros. The caller must hold the inode's write lock.
+ *
+ * Returns the number of bytes written, or -1 if no space was left.
+ */
+static ssize_t inode_write_at(inode_t *inode, struct iovec const *iov,
+                              size_t iovcnt, size_t offset) {
+    size_t to_write = 0;
+    for (size_t i = 0; i < iovcnt; i++) {
+        to_write += iov[i].iov_len;
+    }
+    if (to_write == 0) {
+        return 0;
+    }
 
-    // Determine how many bytes to write
-    size_t block_size = state_block_size();
-    if (to_write + file->of_offset > block_size) {
-        to_write = block_size - file->of_offset;
+    // Appends only fill the write-back buffer: their blocks are allocated
+    // when it is flushed. Anything else writes the buffer out first.
+    if (offset == inode_size(inode) &&
+        inode_writeback_append(inode, iov, iovcnt, to_write) == 0) {
+        return (ssize_t)to_write;
+    }
+    if (inode_writeback_flush(inode, false) == -1) {
+        return -1;
     }
 
-    pthread_rwlock_trywrlock(&inode -> trinco);
+    // Make sure the file has blocks for the whole write, writing only what
+    // fits if the data blocks run out
+    size_t capacity = inode_grow(inode, offset + to_write);
+    if (capacity <= offset) {
+        return -1; // no space
+    }
+    if (offset + to_write > capacity) {
+        to_write = capacity - offset;
+    }
 
-    if (to_write > 0) {
-        if (inode->i_size == 0) {
-            // If empty file, allocate new block
-            int bnum = data_block_alloc();
-            if (bnum == -1) {
-                pthread_rwlock_unlock(&inode -> trinco);
-                return -1; // no space
-            }
+    if (offset > inode->i_size) {
+        inode_data_zero(inode, offset - inode->i_size, inode->i_size);
+    }
+
+    // Perform the actual write
+    inode_data_writev(inode, iov, iovcnt, to_write, offset);
+    if (offset + to_write > inode->i_size) {
+        inode->i_size = offset + to_write;
+        inode_journal(inode);
+    }
+
+    return (ssize_t)to_write;
+}
+
+/**
+ * Read from an inode at a given offset, scattering the data across a list of
+ * buffers. The caller must hold the inode's lock (for reading, at least).
+ *
+ * Returns the number of bytes read.
+ */
+static size_t inode_read_at(inode_t const *inode, struct iovec const *iov,
+                            size_t iovcnt, size_t offset) {
+    // Determine how many bytes to read
+    size_t size = inode_size(inode);
+    if (offset >= size) {
+        return 0;
+    }
+
+    // Perform the actual read, from the data blocks up to i_size and from
+    // the write-back buffer past it
+    size_t read = 0;
+    if (offset < inode->i_size) {
+        read = inode_data_readv(inode, iov, iovcnt, inode->i_size - offset,
+                                offset);
+    }
+    if (offset + read >= inode->i_size) {
+        read += inode_writeback_read(inode, iov, iovcnt, read,
+                                     size - offset - read, offset + read);
+    }
+    return read;
+}
+
+/**
+ * Check that a list of buffers is valid and its total length fits the
+ * return value of a read or write.
+ */
+static bool valid_iovec(struct iovec const *iov, int iovcnt) {
+    if (iovcnt < 0 || (iov == NULL && iovcnt > 0)) {
+        return false;
+    }
 
-            inode->i_data_block = bnum;
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > (size_t)SSIZE_MAX - total) {
+            return false;
         }
+        total += iov[i].iov_len;
+    }
+    return true;
+}
 
-        void *block = data_block_get(inode->i_data_block);
-        ALWAYS_ASSERT(block != NULL, "tfs_write: data block deleted mid-write");
+ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
 
-        // Perform the actual write
-        memcpy(block + file->of_offset, buffer, to_write);
-    
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+
+    if (file == NULL) {
+        return -1;
+    }
+
+    //  From the open file table entry, we get the inode
+    inode_t *inode = inode_get(file->of_inumber);
+    ALWAYS_ASSERT(inode != NULL, "tfs_write: inode of open file deleted");
+
+    pthread_rwlock_wrlock(inode_lock(inode));
+    struct iovec iov = {.iov_base = (void *)buffer, .iov_len = to_write};
+    ssize_t written = inode_write_at(inode, &iov, 1, file->of_offset);
+    if (written > 0) {
         // The offset associated with the file handle is incremented accordingly
-        file->of_offset += to_write;
-        if (file->of_offset > inode->i_size) {
-            inode->i_size = file->of_offset;
-        }
-        pthread_rwlock_unlock(&inode -> trinco);
+        file->of_offset += (size_t)written;
     }
-    else pthread_rwlock_unlock(&inode -> trinco);
+    pthread_rwlock_unlock(inode_lock(inode));
 
-    return (ssize_t)to_write;
+    if (written > 0 && tfs_commit() == -1) {
+        return -1;
+    }
+    return written;
 }
 
 //////////
@@ -364,65 +755,782 @@ ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
     // From the open file table entry, we get the inode
     inode_t *inode = inode_get(file->of_inumber);
     ALWAYS_ASSERT(inode != NULL, "tfs_read: inode of open file deleted");
-    pthread_rwlock_rdlock(&inode -> trinco);
+    pthread_rwlock_rdlock(inode_lock(inode));
+    pthread_mutex_lock(&file->of_lock);
+
+    inode_readahead(inode, &file->of_readahead, file->of_offset, len);
+    struct iovec iov = {.iov_base = buffer, .iov_len = len};
+    size_t read = inode_read_at(inode, &iov, 1, file->of_offset);
+    // The offset associated with the file handle is incremented accordingly
+    file->of_offset += read;
+
+    pthread_mutex_unlock(&file->of_lock);
+    pthread_rwlock_unlock(inode_lock(inode));
+    return (ssize_t)read;
+}
 
-    // Determine how many bytes to read
-    size_t to_read = inode->i_size - file->of_offset;
-    if (to_read > len) {
-        to_read = len;
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len,
+                   size_t offset) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
     }
 
-    if (to_read > 0) {
-        void *block = data_block_get(inode->i_data_block);
-        ALWAYS_ASSERT(block != NULL, "tfs_read: data block deleted mid-read");
+    inode_t *inode = inode_get(file->of_inumber);
+    ALWAYS_ASSERT(inode != NULL, "tfs_pwrite: inode of open file deleted");
 
-        // Perform the actual read
-        memcpy(buffer, block + file->of_offset, to_read);
-        // The offset associated with the file handle is incremented accordingly
-        file->of_offset += to_read;
+    pthread_rwlock_wrlock(inode_lock(inode));
+    struct iovec iov = {.iov_base = (void *)buffer, .iov_len = len};
+    ssize_t written = inode_write_at(inode, &iov, 1, offset);
+    pthread_rwlock_unlock(inode_lock(inode));
+
+    if (written > 0 && tfs_commit() == -1) {
+        return -1;
     }
+    return written;
+}
 
-    pthread_rwlock_rdlock(&inode -> trinco);
-    return (ssize_t)to_read;
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
+    }
+
+    inode_t *inode = inode_get(file->of_inumber);
+    ALWAYS_ASSERT(inode != NULL, "tfs_pread: inode of open file deleted");
+
+    // The handle's offset is left alone, so readers never write shared state
+    pthread_rwlock_rdlock(inode_lock(inode));
+    struct iovec iov = {.iov_base = buffer, .iov_len = len};
+    size_t read = inode_read_at(inode, &iov, 1, offset);
+    pthread_rwlock_unlock(inode_lock(inode));
+
+    return (ssize_t)read;
 }
 
-int tfs_copy_from_external_fs(char const *source_path, char const *dest_path) {
-    /** TODO: Limit the dimension to 1 block
-     * if dest_path doesn't exist, this should be created
-     * if dest_path already exists, the new contents should replace, not append, the old contents
-     */
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt) {
+    if (!valid_iovec(iov, iovcnt)) {
+        return -1;
+    }
 
-    FILE *myfile;
-    char buffer[128];
-    inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
-    int dest_fhandle;
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
+    }
 
+    inode_t *inode = inode_get(file->of_inumber);
+    ALWAYS_ASSERT(inode != NULL, "tfs_writev: inode of open file deleted");
+
+    // One lock round-trip and one pass over the extents for all the buffers,
+    // so other handles never see a partial record
+    pthread_rwlock_wrlock(inode_lock(inode));
+    ssize_t written =
+        inode_write_at(inode, iov, (size_t)iovcnt, file->of_offset);
+    if (written > 0) {
+        file->of_offset += (size_t)written;
+    }
+    pthread_rwlock_unlock(inode_lock(inode));
+
+    if (written > 0 && tfs_commit() == -1) {
+        return -1;
+    }
+    return written;
+}
+
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt) {
+    if (!valid_iovec(iov, iovcnt)) {
+        return -1;
+    }
+
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
+    }
+
+    inode_t *inode = inode_get(file->of_inumber);
+    ALWAYS_ASSERT(inode != NULL, "tfs_readv: inode of open file deleted");
+
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+
+    pthread_rwlock_rdlock(inode_lock(inode));
+    pthread_mutex_lock(&file->of_lock);
+    inode_readahead(inode, &file->of_readahead, file->of_offset, len);
+    size_t read = inode_read_at(inode, iov, (size_t)iovcnt, file->of_offset);
+    file->of_offset += read;
+    pthread_mutex_unlock(&file->of_lock);
+    pthread_rwlock_unlock(inode_lock(inode));
+
+    return (ssize_t)read;
+}
+
+ssize_t tfs_borrow(int fhandle, size_t len, size_t offset,
+                   tfs_borrow_t *borrow) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL || borrow == NULL || !data_blocks_mapped()) {
+        return -1;
+    }
+
+    // Only data in blocks can be borrowed
+    if (tfs_flush(file) == -1) {
+        return -1;
+    }
+
+    inode_t *inode = inode_get(file->of_inumber);
+    ALWAYS_ASSERT(inode != NULL, "tfs_borrow: inode of open file deleted");
+
+    pthread_rwlock_rdlock(inode_lock(inode));
+    size_t to_borrow = 0;
+    if (offset < inode->i_size) {
+        to_borrow = inode->i_size - offset;
+        if (to_borrow > len) {
+            to_borrow = len;
+        }
+    }
+
+    struct iovec spans[TFS_BORROW_MAX_SPANS];
+    size_t span_count = TFS_BORROW_MAX_SPANS;
+    size_t borrowed =
+        inode_data_spans(inode, spans, &span_count, to_borrow, offset);
+    inode_pin(inode);
+    pthread_rwlock_unlock(inode_lock(inode));
+
+    borrow->b_inumber = file->of_inumber;
+    borrow->b_span_count = span_count;
+    for (size_t i = 0; i < span_count; i++) {
+        borrow->b_spans[i].s_data = spans[i].iov_base;
+        borrow->b_spans[i].s_len = spans[i].iov_len;
+    }
+
+    return (ssize_t)borrowed;
+}
+
+int tfs_borrow_release(tfs_borrow_t *borrow) {
+    if (borrow == NULL || borrow->b_inumber == -1) {
+        return -1;
+    }
+
+    inode_unpin(borrow->b_inumber);
+    borrow->b_inumber = -1;
+    borrow->b_span_count = 0;
+    return tfs_commit(); // the last unpin may have deleted the inode
+}
+
+/**
+ * Write a whole buffer to an open file, in strides of TFS_COPY_STRIDE_BLOCKS
+ * blocks, so that other threads can use the file in between.
+ *
+ * Returns 0 if successful, -1 otherwise (e.g., the file system is full).
+ */
+static int tfs_write_all(int fhandle, char const *buffer, size_t len) {
+    size_t stride = TFS_COPY_STRIDE_BLOCKS * state_block_size();
+
+    while (len > 0) {
+        size_t n = len < stride ? len : stride;
+        if (tfs_write(fhandle, buffer, n) != (ssize_t)n) {
+            return -1;
+        }
+        buffer += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Copy the contents of a host file descriptor into an open file.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int tfs_copy_fd(int source, int dest_fhandle) {
+    struct stat st;
+    if (fstat(source, &st) == -1) {
+        return -1;
+    }
+
+    int result = 0;
+    void *mapped = MAP_FAILED;
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        mapped = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, source,
+                      0);
+    }
+
+    if (mapped != MAP_FAILED) {
+        // Regular files are copied straight from the page cache
+        posix_madvise(mapped, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+        result = tfs_write_all(dest_fhandle, mapped, (size_t)st.st_size);
+        munmap(mapped, (size_t)st.st_size);
+    } else {
+        // Anything that cannot be mapped (e.g., a pipe) is read in large
+        // chunks instead
+        size_t chunk = TFS_COPY_STRIDE_BLOCKS * state_block_size();
+        char *buffer = malloc(chunk);
+        ssize_t n = buffer == NULL ? -1 : 0;
+        while (buffer != NULL && (n = read(source, buffer, chunk)) > 0) {
+            if (tfs_write_all(dest_fhandle, buffer, (size_t)n) == -1) {
+                break;
+            }
+        }
+        result = n == 0 ? 0 : -1;
+        free(buffer);
+    }
+
+    return result;
+}
+
+int tfs_copy_from_external_fs(char const *source_path, char const *dest_path) {
     // Source path doesn't exist
-    myfile = fopen(source_path, "r");
-    if (myfile == NULL){
+    int source = open(source_path, O_RDONLY);
+    if (source == -1) {
         return -1;
     }
 
-    // Destination path already exists    
-    if (find_in_dir(root_dir_inode, dest_path + 1) != -1){
-        dest_fhandle = tfs_open(dest_path, TFS_O_TRUNC);
-        dest_fhandle = tfs_open(dest_path, TFS_O_APPEND);
+    // Whether or not the destination path already exists, a single open
+    // creates it or replaces its contents
+    int dest_fhandle = tfs_open(dest_path, TFS_O_CREAT | TFS_O_TRUNC);
+    if (dest_fhandle == -1) {
+        close(source);
+        return -1;
     }
-    
-    // Destination path doesn't exist
-    else dest_fhandle = tfs_open(dest_path, TFS_O_CREAT);
-    
-    int inum = tfs_lookup(dest_path, root_dir_inode);
-    inode_t *inode = inode_get(inum);
-    pthread_rwlock_trywrlock(&inode -> trinco);
 
-    size_t aux = 1;
-    while (aux > 0  ){
-        aux = fread(buffer, sizeof(char), sizeof(buffer) - 1, myfile);
-        tfs_write(dest_fhandle, buffer, aux);
-        memset(buffer, 0, sizeof(buffer));
+    int result = tfs_copy_fd(source, dest_fhandle);
+
+    close(source);
+    // Closing flushes what the handle buffered, which may still fail
+    if (tfs_close(dest_fhandle) == -1) {
+        result = -1;
+    }
+    return result;
+}
+
+/**
+ * Files found by a tree import, whose contents are copied by the workers
+ * while the walk goes on.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t queued; // files were added, or the walk is over
+    char **host_paths;
+    int *inumbers;
+    size_t count;
+    size_t capacity;
+    size_t next;    // next file to be copied
+    bool walked;    // no more files will be added
+    bool failed;    // the workers stop once set
+    size_t skipped; // host entries whose names are too long (walk only)
+} import_job_t;
+
+/**
+ * Add a file to the ones to be copied by a tree import, waking up a worker.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int import_job_add(import_job_t *job, char const *host_path,
+                          int inumber) {
+    char *path = strdup(host_path);
+    if (path == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&job->lock);
+    if (job->count == job->capacity) {
+        size_t capacity = job->capacity == 0 ? 64 : 2 * job->capacity;
+        char **host_paths =
+            realloc(job->host_paths, capacity * sizeof(char *));
+        if (host_paths != NULL) {
+            job->host_paths = host_paths;
+        }
+        int *inumbers = realloc(job->inumbers, capacity * sizeof(int));
+        if (inumbers != NULL) {
+            job->inumbers = inumbers;
+        }
+        if (host_paths == NULL || inumbers == NULL) {
+            pthread_mutex_unlock(&job->lock);
+            free(path);
+            return -1;
+        }
+        job->capacity = capacity;
+    }
+
+    job->host_paths[job->count] = path;
+    job->inumbers[job->count++] = inumber;
+    pthread_cond_signal(&job->queued);
+    pthread_mutex_unlock(&job->lock);
+    return 0;
+}
+
+/**
+ * Join a host directory path and an entry name.
+ *
+ * Returns the new path (to be freed by the caller), or NULL on failure.
+ */
+static char *import_path_join(char const *dir, char const *name) {
+    size_t len = strlen(dir) + 1 + strlen(name) + 1;
+    char *path = malloc(len);
+    if (path != NULL) {
+        snprintf(path, len, "%s/%s", dir, name);
+    }
+    return path;
+}
+
+/**
+ * Append a copy of a name to a growing list of names.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int import_names_add(char ***names, size_t *count, size_t *capacity,
+                            char const *name) {
+    if (*count == *capacity) {
+        size_t grown = *capacity == 0 ? 16 : 2 * *capacity;
+        char **list = realloc(*names, grown * sizeof(char *));
+        if (list == NULL) {
+            return -1;
+        }
+        *names = list;
+        *capacity = grown;
+    }
+
+    (*names)[*count] = strdup(name);
+    if ((*names)[*count] == NULL) {
+        return -1;
+    }
+    (*count)++;
+    return 0;
+}
+
+static void import_names_free(char **names, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(names[i]);
+    }
+}
+
+/**
+ * Obtain the type of an inode found by a lookup, reading it under the inode's
+ * lock.
+ */
+static inode_type import_node_type(int inumber) {
+    inode_t const *inode = inode_get(inumber);
+    pthread_rwlock_rdlock(inode_lock(inode));
+    inode_type type = inode->i_node_type;
+    pthread_rwlock_unlock(inode_lock(inode));
+    return type;
+}
+
+/**
+ * Create entries of a TécnicoFS directory in a single batch: their inodes are
+ * allocated together, and added to the directory under one lock.
+ *
+ * Input:
+ *   - dir_inum: the directory's inumber
+ *   - i_type: the type of the new inodes
+ *   - names: the names of the new entries
+ *   - inumbers: where to store the inumbers of the new inodes
+ *   - count: number of entries
+ *
+ * Returns 0 if successful, -1 otherwise (in which case some of the entries
+ * may have been created).
+ */
+static int import_create_entries(int dir_inum, inode_type i_type,
+                                 char **names, int *inumbers, size_t count) {
+    if (inode_create_many(i_type, inumbers, count) == -1) {
+        return -1;
+    }
+
+    size_t added = add_dir_entries(inode_get(dir_inum),
+                                   (char const *const *)names, inumbers, count);
+    for (size_t i = added; i < count; i++) {
+        inode_delete(inumbers[i]);
+    }
+    return added == count ? 0 : -1;
+}
+
+/**
+ * Create files of a host directory in a TécnicoFS directory, in a single
+ * batch, and queue their contents for copying.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int import_create_files(import_job_t *job, int dir_inum,
+                               char const *host_dir, char **names,
+                               size_t count) {
+    int *inumbers = malloc(count * sizeof(int));
+    if (inumbers == NULL) {
+        return -1;
+    }
+
+    int result =
+        import_create_entries(dir_inum, T_FILE, names, inumbers, count);
+    for (size_t i = 0; i < count && result == 0; i++) {
+        char *host_path = import_path_join(host_dir, names[i]);
+        if (host_path == NULL ||
+            import_job_add(job, host_path, inumbers[i]) == -1) {
+            result = -1;
+        }
+        free(host_path);
+    }
+
+    free(inumbers);
+    return result;
+}
+
+/**
+ * Walk a host directory, recreating its directories and files in a TécnicoFS
+ * directory, and queueing the files' contents in the job as they are created.
+ * Entries whose names are too long for TécnicoFS are skipped, and counted in
+ * the job. Symbolic links are neither followed nor imported.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int import_walk(import_job_t *job, char const *host_dir,
+                       int dir_inum) {
+    DIR *dir = opendir(host_dir);
+    if (dir == NULL) {
+        return -1;
+    }
+
+    // New files are created in batches as they are found, so that the
+    // workers can start on them early; directories are created in a single
+    // batch, and walked once the directory stream is closed
+    char **new_files = NULL;
+    char **subdirs = NULL;
+    size_t new_count = 0, new_capacity = 0;
+    size_t subdir_count = 0, subdir_capacity = 0;
+    int result = 0;
+
+    struct dirent *de;
+    while (result == 0 && (de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        if (strlen(de->d_name) >= MAX_FILE_NAME) {
+            job->skipped++; // name too long for TécnicoFS
+            continue;
+        }
+
+        char *host_path = import_path_join(host_dir, de->d_name);
+        // Symbolic links are not followed (a link to an ancestor would make
+        // the walk endless), and skipped like devices
+        struct stat st;
+        if (host_path == NULL || lstat(host_path, &st) == -1) {
+            result = -1;
+        } else if (S_ISREG(st.st_mode)) {
+            int inum = tfs_lookup_in(dir_inum, de->d_name);
+            if (inum != -1) {
+                // an existing file, whose contents are replaced
+                if (import_node_type(inum) != T_FILE ||
+                    import_job_add(job, host_path, inum) == -1) {
+                    result = -1;
+                }
+            } else if (import_names_add(&new_files, &new_count,
+                                        &new_capacity, de->d_name) == -1) {
+                result = -1;
+            } else if (new_count == IMPORT_BATCH) {
+                result = import_create_files(job, dir_inum, host_dir,
+                                             new_files, new_count);
+                import_names_free(new_files, new_count);
+                new_count = 0;
+            }
+        } else if (S_ISDIR(st.st_mode)) {
+            result = import_names_add(&subdirs, &subdir_count,
+                                      &subdir_capacity, de->d_name);
+        } // symbolic links, devices, sockets, etc. are skipped
+        free(host_path);
+    }
+    closedir(dir);
+
+    if (result == 0 && new_count > 0) {
+        result = import_create_files(job, dir_inum, host_dir, new_files,
+                                     new_count);
+    }
+
+    int *subdir_inums = NULL;
+    if (result == 0 && subdir_count > 0) {
+        subdir_inums = malloc(subdir_count * sizeof(int));
+        if (subdir_inums == NULL) {
+            result = -1;
+        }
+    }
+
+    // Existing directories are merged; the others are moved to the front,
+    // and created together
+    size_t missing = 0;
+    for (size_t i = 0; i < subdir_count && result == 0; i++) {
+        subdir_inums[i] = tfs_lookup_in(dir_inum, subdirs[i]);
+        if (subdir_inums[i] == -1) {
+            char *name = subdirs[i];
+            subdirs[i] = subdirs[missing];
+            subdir_inums[i] = subdir_inums[missing];
+            subdirs[missing] = name;
+            subdir_inums[missing++] = -1;
+        } else if (import_node_type(subdir_inums[i]) != T_DIRECTORY) {
+            result = -1;
+        }
+    }
+    if (result == 0 && missing > 0) {
+        result = import_create_entries(dir_inum, T_DIRECTORY, subdirs,
+                                       subdir_inums, missing);
+    }
+
+    for (size_t i = 0; i < subdir_count && result == 0; i++) {
+        char *host_path = import_path_join(host_dir, subdirs[i]);
+        if (host_path == NULL ||
+            import_walk(job, host_path, subdir_inums[i]) == -1) {
+            result = -1;
+        }
+        free(host_path);
+    }
+
+    import_names_free(new_files, new_count);
+    import_names_free(subdirs, subdir_count);
+    free(new_files);
+    free(subdirs);
+    free(subdir_inums);
+    return result;
+}
+
+/**
+ * Replace the contents of a TécnicoFS file with those of a host file.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int import_file(char const *host_path, int inumber) {
+    // (the walk found a regular file there, not a link)
+    int source = open(host_path, O_RDONLY | O_NOFOLLOW);
+    if (source == -1) {
+        return -1;
+    }
+
+    // Held by the handle, as with tfs_open
+    inode_t *inode = inode_acquire(inumber);
+    pthread_rwlock_wrlock(inode_lock(inode));
+    bool pinned = inode_pinned(inode);
+    if (!pinned) {
+        inode_truncate(inode);
+    }
+    pthread_rwlock_unlock(inode_lock(inode));
+
+    int fhandle = pinned ? -1 : add_to_open_file_table(inumber, 0);
+    if (fhandle == -1) {
+        inode_release(inumber);
+    }
+    int result = fhandle == -1 ? -1 : tfs_copy_fd(source, fhandle);
+
+    if (fhandle != -1 && tfs_close(fhandle) == -1) {
+        result = -1;
+    }
+    close(source);
+    if (tfs_commit() == -1) {
+        result = -1;
+    }
+    return result;
+}
+
+/**
+ * Copy the contents of queued files as they are added, until the walk is
+ * over and none are left (or a copy fails).
+ */
+static void *import_worker(void *arg) {
+    import_job_t *job = arg;
+
+    pthread_mutex_lock(&job->lock);
+    while (true) {
+        while (job->next == job->count && !job->walked && !job->failed) {
+            pthread_cond_wait(&job->queued, &job->lock);
+        }
+        if (job->next == job->count || job->failed) {
+            break;
+        }
+        char const *host_path = job->host_paths[job->next];
+        int inumber = job->inumbers[job->next++];
+        pthread_mutex_unlock(&job->lock);
+
+        int result = import_file(host_path, inumber);
+
+        pthread_mutex_lock(&job->lock);
+        if (result == -1) {
+            job->failed = true;
+            pthread_cond_broadcast(&job->queued);
+        }
+    }
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+int tfs_import_tree(char const *source_dir, char const *dest_dir,
+                    size_t workers) {
+    int dir_inum = strcmp(dest_dir, "/") == 0 ? ROOT_DIR_INUM
+                                              : tfs_lookup(dest_dir);
+    if (dir_inum == -1 || import_node_type(dir_inum) != T_DIRECTORY) {
+        return -1;
+    }
+
+    if (workers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cpus > 0 ? (size_t)cpus : 1;
+    }
+
+    // The workers copy the files' contents while this thread walks the tree,
+    // creating its directories and files
+    import_job_t job = {.count = 0};
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.queued, NULL);
+    pthread_t *threads = malloc(workers * sizeof(pthread_t));
+    size_t started = 0;
+    while (threads != NULL && started < workers &&
+           pthread_create(&threads[started], NULL, import_worker, &job) == 0) {
+        started++;
+    }
+
+    int result = import_walk(&job, source_dir, dir_inum);
+
+    pthread_mutex_lock(&job.lock);
+    job.walked = true;
+    if (result == -1) {
+        job.failed = true;
+    }
+    pthread_cond_broadcast(&job.queued);
+    pthread_mutex_unlock(&job.lock);
+
+    // Whatever is left (e.g., if no thread could be started) is copied here
+    import_worker(&job);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    if (job.failed) {
+        result = -1;
+    }
+
+    for (size_t i = 0; i < job.count; i++) {
+        free(job.host_paths[i]);
+    }
+    free(job.host_paths);
+    free(job.inumbers);
+    pthread_cond_destroy(&job.queued);
+    pthread_mutex_destroy(&job.lock);
+    if (tfs_commit() == -1) {
+        result = -1;
+    }
+    if (result == -1) {
+        return -1;
+    }
+    return job.skipped > INT_MAX ? INT_MAX : (int)job.skipped;
+}
+
+/**
+ * Write a list of buffers to a host file descriptor at a given offset,
+ * retrying until everything is written.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int pwritev_all(int fd, struct iovec *iov, int iovcnt, off_t offset) {
+    while (iovcnt > 0) {
+        ssize_t n = pwritev(fd, iov, iovcnt, offset);
+        if (n == -1 && errno == EINTR) {
+            continue;
         }
-    pthread_rwlock_unlock(&inode -> trinco);
+        if (n <= 0) {
+            return -1;
+        }
+        offset += n;
 
-   return 0;
+        // Skip what was written
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Copy the contents of an open file to a host file through a staging buffer,
+ * for when the data blocks cannot be borrowed.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int tfs_copy_to_fd(int source_fhandle, int dest) {
+    size_t stride = TFS_COPY_STRIDE_BLOCKS * state_block_size();
+    char *buffer = malloc(stride);
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    int result = 0;
+    size_t offset = 0;
+    ssize_t n;
+    while ((n = tfs_pread(source_fhandle, buffer, stride, offset)) > 0) {
+        struct iovec iov = {.iov_base = buffer, .iov_len = (size_t)n};
+        if (pwritev_all(dest, &iov, 1, (off_t)offset) == -1) {
+            result = -1;
+            break;
+        }
+        offset += (size_t)n;
+    }
+    if (n == -1) {
+        result = -1;
+    }
+
+    free(buffer);
+    return result;
+}
+
+int tfs_copy_to_external_fs(char const *source_path, char const *dest_path) {
+    int source = tfs_open(source_path, 0);
+    if (source == -1) {
+        return -1;
+    }
+
+    int dest = open(dest_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (dest == -1) {
+        tfs_close(source);
+        return -1;
+    }
+
+    if (!data_blocks_mapped()) {
+        int result = tfs_copy_to_fd(source, dest);
+        if (close(dest) == -1) {
+            result = -1;
+        }
+        tfs_close(source);
+        return result;
+    }
+
+    // Borrow the file's blocks (no copy into a staging buffer) and hand each
+    // batch of spans to the host in a single system call
+    int result = 0;
+    size_t offset = 0;
+    tfs_borrow_t borrow;
+    ssize_t borrowed;
+    while ((borrowed = tfs_borrow(source, SIZE_MAX, offset, &borrow)) > 0) {
+        struct iovec iov[TFS_BORROW_MAX_SPANS];
+        for (size_t i = 0; i < borrow.b_span_count; i++) {
+            iov[i].iov_base = (void *)borrow.b_spans[i].s_data;
+            iov[i].iov_len = borrow.b_spans[i].s_len;
+        }
+        result = pwritev_all(dest, iov, (int)borrow.b_span_count,
+                             (off_t)offset);
+        tfs_borrow_release(&borrow);
+        if (result == -1) {
+            break;
+        }
+        offset += (size_t)borrowed;
+    }
+    if (borrowed == 0) {
+        tfs_borrow_release(&borrow);
+    } else {
+        result = -1;
+    }
+
+    if (close(dest) == -1) {
+        result = -1;
+    }
+    tfs_close(source);
+    return result;
 }
@@ -2,7 +2,23 @@
 #define OPERATIONS_H
 
 #include "config.h"
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * How durable a change to TécnicoFS' metadata is when an operation returns
+ * (only meaningful when the state is kept in an image file).
+ */
+typedef enum {
+    // recorded in memory; written to the journal along with later changes
+    TFS_DURABILITY_NONE,
+    // written to the journal file (survives a crash of the process)
+    TFS_DURABILITY_WRITTEN,
+    // synced to storage (survives a crash of the machine)
+    TFS_DURABILITY_SYNCED,
+} tfs_durability_t;
 
 /**
  * TécnicoFS parameters.
@@ -13,8 +29,83 @@ typedef struct {
     size_t max_open_files_count;
 
     size_t block_size;
+
+    // File holding the persistent state (NULL to keep it in memory only): it
+    // is created if missing, and attached otherwise. Metadata changes are
+    // only journaled (in a file named after it, with ".journal" appended)
+    // when an image is used
+    char const *image_path;
+    // Durability of the metadata changes made by each operation; changes
+    // made concurrently by several threads are written (and synced) together
+    // (ignored without an image, as nothing is journaled then)
+    tfs_durability_t durability;
+
+    // Host file holding the data blocks (NULL to keep them in memory, or in
+    // the image); it cannot be combined with an image
+    char const *device_path;
+    // Transfers each thread keeps in flight on the device file through
+    // io_uring (0 to use preadv/pwritev instead)
+    unsigned device_queue_depth;
+
+    // Inodes, data blocks and bitmap blocks kept in the buffer cache; only
+    // accesses missing it pay the storage latency (0 disables the cache)
+    size_t cache_size;
+    // Largest number of blocks prefetched at a time for sequential readers
+    // (0 disables read-ahead)
+    size_t readahead_max_blocks;
+    // Size of the per-file buffer appends are gathered in before they get
+    // data blocks (0 writes them through)
+    size_t writeback_size;
+
+    // Back the data blocks kept in memory with huge pages (falling back to
+    // transparent huge pages), and fault them in (and lock them in memory)
+    // up front
+    bool huge_pages;
+    bool prefault;
+    // Sub-pools the free data blocks are split over, one per NUMA node, each
+    // with its blocks in its node's memory: threads allocate from their own
+    // node's first (0 for as many as the host has nodes; at most
+    // MAX_NUMA_NODES, past which nodes share sub-pools)
+    size_t numa_nodes;
 } tfs_params;
 
+/**
+ * Buffer cache counters (see tfs_cache_stats).
+ */
+typedef struct {
+    uint64_t cs_hits;
+    uint64_t cs_misses;
+    uint64_t cs_evictions;
+} tfs_cache_stats_t;
+
+/**
+ * Block allocator counters (see tfs_alloc_stats).
+ */
+typedef struct {
+    size_t as_nodes;    // block sub-pools (see tfs_params.numa_nodes)
+    uint64_t as_local;  // blocks allocated from the allocating thread's node
+    uint64_t as_remote; // blocks allocated from other nodes
+} tfs_alloc_stats_t;
+
+/**
+ * Counters of the locks shared by all threads allocating inodes or blocks
+ * (see tfs_lock_stats).
+ */
+typedef struct {
+    uint64_t ls_acquired;  // acquisitions
+    uint64_t ls_contended; // acquisitions that waited for another thread
+} tfs_lock_stats_t;
+
+/**
+ * Read-ahead counters of an open file (see tfs_readahead_stats).
+ */
+typedef struct {
+    uint64_t rs_hits;       // reads entirely covered by earlier prefetches
+    uint64_t rs_misses;     // other reads
+    uint64_t rs_prefetched; // blocks prefetched
+    size_t rs_window;       // current window, in blocks (0 if not sequential)
+} tfs_readahead_stats_t;
+
 /**
  * Return a sane default set of parameters for tecnicofs.
  */
@@ -32,6 +123,57 @@ int tfs_init(tfs_params const *params);
  */
 int tfs_destroy();
 
+/**
+ * Make every metadata change made so far (by any thread) reach a given
+ * durability level.
+ *
+ * Input:
+ *   - durability: the durability level
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_sync(tfs_durability_t durability);
+
+/**
+ * Obtain the read-ahead counters of an open file. Reads through tfs_read and
+ * tfs_readv that continue where the previous one ended are sequential, and
+ * prefetch the blocks that follow in the background.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - stats: where to store the counters
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_readahead_stats(int fhandle, tfs_readahead_stats_t *stats);
+
+/**
+ * Obtain the buffer cache's counters since tfs_init.
+ *
+ * Input:
+ *   - stats: where to store the counters
+ */
+void tfs_cache_stats(tfs_cache_stats_t *stats);
+
+/**
+ * Obtain the block allocator's counters since tfs_init: blocks are counted as
+ * they leave the sub-pools for an allocating thread (or its cache of free
+ * blocks).
+ *
+ * Input:
+ *   - stats: where to store the counters
+ */
+void tfs_alloc_stats(tfs_alloc_stats_t *stats);
+
+/**
+ * Obtain the counters of the inode bitmap and block sub-pool locks since
+ * tfs_init.
+ *
+ * Input:
+ *   - stats: where to store the counters
+ */
+void tfs_lock_stats(tfs_lock_stats_t *stats);
+
 /**
  * TécnicoFS file opening modes.
  */
@@ -45,7 +187,7 @@ typedef enum {
  * Open a file.
  *
  * Input:
- *   - name: absolute path name
+ *   - name: absolute path name (every directory in the path must exist)
  *   - mode: can be a combination (with bitwise or) of the following flags:
  *     - append mode (TFS_O_APPEND)
  *     - truncate file contents (TFS_O_TRUNC)
@@ -59,7 +201,8 @@ int tfs_open(char const *name, tfs_file_mode_t mode);
  * Create a symbolic link to a file.
  *
  * Input:
- *   - target: absolute path name of the link target
+ *   - target: absolute path name of the link target (shorter than
+ *     MAX_SYMLINK_TARGET bytes and than a data block)
  *   - link_name: absolute path name of the link to be created
  *
  * Returns 0 if successful, -1 otherwise.
@@ -78,7 +221,28 @@ int tfs_sym_link(char const *target, char const *link_name);
 int tfs_link(char const *target_file, char const *link_name);
 
 /**
- * Close a file.
+ * Create a directory.
+ *
+ * Input:
+ *   - path: absolute path name of the directory to be created (its parent
+ *     directory must exist)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_mkdir(char const *path);
+
+/**
+ * Remove an empty directory.
+ *
+ * Input:
+ *   - path: absolute path name of the directory
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_rmdir(char const *path);
+
+/**
+ * Close a file, flushing its write-back buffer.
  *
  * Input:
  *   - fhandle: file handle (obtained from a previous call to tfs_open)
@@ -88,7 +252,21 @@ int tfs_link(char const *target_file, char const *link_name);
 int tfs_close(int fhandle);
 
 /**
- * Write to an open file, starting at the current offset.
+ * Make every metadata change made so far reach a given durability level, and
+ * with TFS_DURABILITY_SYNCED, the contents of an open file as well.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - durability: the durability level
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_fsync(int fhandle, tfs_durability_t durability);
+
+/**
+ * Write to an open file, starting at the current offset. Appends are gathered
+ * in the file's write-back buffer, and only get data blocks (in contiguous
+ * runs) once it fills up, or when the file is closed or synced.
  *
  * Input:
  *   - fhandle: file handle (obtained from a previous call to tfs_open)
@@ -113,6 +291,122 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/**
+ * Write to an open file at a given offset, without using or changing the
+ * handle's current offset. Writing past the end of the file fills the gap
+ * with zeros.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - buffer: buffer containing the contents to write
+ *   - len: length of the buffer contents (in bytes)
+ *   - offset: offset within the file where the write starts
+ *
+ * Returns the number of bytes that were written (can be lower than 'len' if the
+ * maximum file size is exceeded), or -1 in case of error.
+ */
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len, size_t offset);
+
+/**
+ * Read from an open file at a given offset, without using or changing the
+ * handle's current offset. Several threads may read through the same handle
+ * in parallel.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - buffer: destination buffer
+ *   - len: length of the buffer
+ *   - offset: offset within the file where the read starts
+ *
+ * Returns the number of bytes that were copied from the file to the buffer (can
+ * be lower than 'len' if the file size was reached), or -1 in case of error.
+ */
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset);
+
+/**
+ * Write to an open file, starting at the current offset, gathering the
+ * contents from several buffers. All the buffers are written as a single
+ * write: no other operation on the file sees only part of them.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - iov: buffers containing the contents to write, in order
+ *   - iovcnt: number of buffers
+ *
+ * Returns the number of bytes that were written (can be lower than the total
+ * length of the buffers if the maximum file size is exceeded), or -1 in case
+ * of error.
+ */
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt);
+
+/**
+ * Read from an open file, starting at the current offset, scattering the
+ * contents across several buffers (each one is filled before the next).
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - iov: destination buffers
+ *   - iovcnt: number of buffers
+ *
+ * Returns the number of bytes that were copied from the file to the buffers
+ * (can be lower than their total length if the file size was reached), or -1
+ * in case of error.
+ */
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt);
+
+/**
+ * Contiguous piece of a file's contents, borrowed straight from TécnicoFS'
+ * memory.
+ */
+typedef struct {
+    void const *s_data;
+    size_t s_len;
+} tfs_span_t;
+
+/**
+ * Borrowed range of a file (see tfs_borrow).
+ */
+typedef struct {
+    int b_inumber; // file the spans belong to (-1 when not borrowing)
+    size_t b_span_count;
+    tfs_span_t b_spans[TFS_BORROW_MAX_SPANS];
+} tfs_borrow_t;
+
+/**
+ * Borrow a range of an open file without copying it: its contents are
+ * described as a list of spans pointing into TécnicoFS' memory, in file
+ * order. The handle's offset is not used or changed.
+ *
+ * Until the borrow is released, the file's blocks are pinned: they stay valid
+ * even if the file is unlinked, and truncating the file fails. Writes to the
+ * borrowed range are visible through the spans.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - len: number of bytes to borrow
+ *   - offset: offset within the file where the range starts
+ *   - borrow: where to store the spans
+ *
+ * Returns the number of bytes borrowed (can be lower than 'len' if the file
+ * size was reached or the file is too fragmented to fit in
+ * TFS_BORROW_MAX_SPANS spans), or -1 in case of error (including when the
+ * data blocks are kept in a device file, so they are not in memory). Unless -1
+ * is returned, the borrow must be released with tfs_borrow_release.
+ */
+ssize_t tfs_borrow(int fhandle, size_t len, size_t offset,
+                   tfs_borrow_t *borrow);
+
+/**
+ * Release a borrowed range (see tfs_borrow). Its spans must not be used
+ * afterwards.
+ *
+ * Input:
+ *   - borrow: the borrow to release
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_borrow_release(tfs_borrow_t *borrow);
+
 /**
  * Delete a link, or a file if the number of hard links reaches 0, that
  * exists in TécnicoFS.
@@ -137,4 +431,40 @@ int tfs_unlink(char const *target);
  */
 int tfs_copy_from_external_fs(char const *source_path, char const *dest_path);
 
+/**
+ * Copy a directory tree that exists in the OS' file system (outside
+ * TécnicoFS) into a TécnicoFS directory. Directories and files are created
+ * in batches by the calling thread, while a pool of worker threads copies the
+ * contents of the files already created. Entries whose names are too long
+ * for TécnicoFS are skipped, and so are symbolic links (which are not
+ * followed either) and anything else that is not a directory or regular file.
+ *
+ * Input:
+ *   - source_dir: path name of the source directory (from the OS' file
+ *     system)
+ *   - dest_dir: absolute path name of an existing directory (in TécnicoFS);
+ *     existing files in it are overwritten, and existing directories merged
+ *   - workers: number of worker threads (0 for one per online CPU)
+ *
+ * Returns the number of entries skipped because of their names (0 if none),
+ * or -1 if the import failed (in which case part of the tree may have been
+ * copied).
+ */
+int tfs_import_tree(char const *source_dir, char const *dest_dir,
+                    size_t workers);
+
+/**
+ * Copy the contents of a file that exists in TécnicoFS to the OS' file system
+ * tree (outside TécnicoFS). The file's blocks are written straight to the
+ * destination, without intermediate copies.
+ *
+ * Input:
+ *   - source_path: absolute path name of the source file (in TécnicoFS)
+ *   - dest_path: path name of the destination file (in the OS' file system),
+ *    which is created if needed, and overwritten if it already exists.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_copy_to_external_fs(char const *source_path, char const *dest_path);
+
 #endif // OPERATIONS_H
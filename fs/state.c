@@ -1,44 +1,259 @@
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS, madvise, syscall
 #include "state.h"
 #include "betterassert.h"
+#include "block_cache.h"
+#include "block_device.h"
+#include "dcache.h"
+#include "journal.h"
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 
 /*
  * Persistent FS state
- * (in reality, it should be maintained in secondary memory;
- * for simplicity, this project maintains it in primary memory).
+ * (kept in primary memory, unless an image file is given in the parameters,
+ * in which case it is mapped from that file; see image_open).
  */
 static tfs_params fs_params;
 
 // Inode table
 static inode_t *inode_table;
-static allocation_state_t *freeinode_ts;
+static uint64_t *inode_bitmap;     // bit set = inode taken
+static uint64_t *inode_full_words; // bit set = inode_bitmap word is full
+static size_t inode_search_hint;   // first inode_full_words word with room
+static int *inode_free_stack;      // recently freed inodes (LIFO)
+static size_t inode_free_stack_top;
+// References to each inode (see inode_acquire): inodes with references are
+// pinned in the buffer cache, so inode_get serves them without any delay
+static atomic_uint *inode_refs;
 
-// Lock
-pthread_mutex_t trinco = PTHREAD_MUTEX_INITIALIZER;
+/*
+ * Each shared structure has its own lock, kept in a cache line of its own so
+ * that threads working on unrelated structures never contend. Directories are
+ * protected by their inode's lock. See state.h for the lock ordering.
+ */
+typedef struct {
+    uint64_t lc_acquired;  // acquisitions
+    uint64_t lc_contended; // acquisitions that waited for another thread
+} lock_counters_t;
+
+typedef struct {
+    _Alignas(64) pthread_mutex_t mutex;
+    lock_counters_t counters; // see allocator_lock
+} padded_mutex_t;
+
+typedef struct {
+    _Alignas(64) pthread_rwlock_t rwlock;
+    bool dying; // directory being removed (see dir_set_dying)
+} padded_rwlock_t;
+
+static padded_mutex_t inode_bitmap_lock = {PTHREAD_MUTEX_INITIALIZER, {0, 0}};
+// One per inode (see inode_lock), apart from the inode table: an inode and
+// its lock are written by different threads, and neither should share a
+// cache line with its neighbours'
+static padded_rwlock_t *inode_locks;
+static bool inode_locks_zeroed; // zero-filled, standing for initialized
 
 
 // Data blocks
-static char *fs_data; // # blocks * block size
-static allocation_state_t *free_blocks;
+static char *fs_data;          // # blocks * block size (NULL if in a file)
+static size_t fs_data_size;    // bytes mapped for fs_data (0 if in an image)
+static size_t fs_data_page;    // size of the pages backing it
+static uint64_t *block_bitmap; // bit set = block taken (or in a magazine)
+static block_device_t *block_device;
+
+// Blocks of a device file that were accessed through data_block_get
+// (directories and overflow extents), kept in memory until freed
+static char *_Atomic *resident_blocks;
+
+// Runs of data blocks queued for the read-ahead thread to bring in
+typedef struct {
+    int rr_block;
+    size_t rr_count;
+} readahead_run_t;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    readahead_run_t runs[READAHEAD_QUEUE_SIZE]; // ring buffer
+    size_t head;
+    size_t count;
+    bool stop;
+    bool started;
+    pthread_t thread;
+} readahead = {.lock = PTHREAD_MUTEX_INITIALIZER,
+               .cond = PTHREAD_COND_INITIALIZER};
+
+// Global pool of free blocks, behind the per-thread magazines: one sub-pool
+// per NUMA node (see tfs_params.numa_nodes), each owning a range of
+// block_bitmap words, whose blocks are kept in that node's memory
+typedef struct {
+    _Alignas(64) pthread_mutex_t lock;
+    lock_counters_t counters; // see allocator_lock
+    size_t first; // first block_bitmap word of the sub-pool
+    size_t end;   // first word past the sub-pool
+    size_t hint;  // every word of the sub-pool before this one is full
+} block_pool_t;
+
+static block_pool_t *block_pools;
+static size_t block_pool_count;
+// Words per sub-pool: the first block_pool_longer sub-pools have one more
+static size_t block_pool_words;
+static size_t block_pool_longer;
+
+// Blocks handed out by the sub-pool of the allocating thread's node, and by
+// the other sub-pools
+static _Alignas(64) atomic_uint_fast64_t block_pool_local;
+static atomic_uint_fast64_t block_pool_remote;
+
+// Data blocks neither allocated nor reserved for a write-back buffer
+static _Alignas(64) atomic_size_t data_blocks_available;
+
+/*
+ * Write-back buffers: data appended to a file is kept here, right after the
+ * file's i_size, and only gets data blocks once flushed (see
+ * inode_writeback_flush). The blocks it will need are reserved up front, so
+ * that flushing never runs out of space.
+ */
+typedef struct {
+    char *wb_data;        // tfs_params.writeback_size bytes (NULL if unused)
+    size_t wb_len;        // bytes buffered
+    size_t wb_reserved;   // data blocks reserved for them
+    atomic_bool wb_dirty; // wb_len > 0 (read without the inode's lock)
+} write_buffer_t;
+
+static write_buffer_t *write_buffers; // one per inode (NULL if disabled)
+
+/*
+ * Per-thread cache of reserved block numbers, so that most allocations and
+ * frees touch neither the pool lock nor the bitmap. Magazines are refilled
+ * from and drained to the pool in batches.
+ */
+typedef struct block_magazine {
+    _Alignas(64) pthread_mutex_t lock; // only contended while reclaiming
+    size_t count;
+    int blocks[BLOCK_MAGAZINE_SIZE]; // top of the stack is the next to go
+    struct block_magazine *next;
+} block_magazine_t;
+
+static block_magazine_t *magazines; // every live thread's magazine
+static pthread_mutex_t magazines_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t magazine_key;
+static pthread_once_t magazine_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local block_magazine_t *thread_magazine;
+
+/*
+ * Image file layout: a superblock, then the persistent tables (each starting
+ * at a cache line) and the data blocks (starting at a page boundary). Any
+ * change to the layout or to inode_t must bump IMAGE_VERSION.
+ */
+#define IMAGE_MAGIC UINT64_C(0x4547414d49534654) // "TFSIMAGE"
+#define IMAGE_VERSION (3)
+
+_Static_assert(sizeof(inode_t) == 64, "inodes must fill one cache line each");
+
+typedef struct {
+    uint64_t sb_magic;
+    uint32_t sb_version;
+    uint32_t sb_inode_size; // sizeof(inode_t)
+    uint64_t sb_inode_count;
+    uint64_t sb_block_count;
+    uint64_t sb_block_size;
+    uint64_t sb_inode_table; // offset of each table within the image
+    uint64_t sb_inode_bitmap;
+    uint64_t sb_inode_full_words;
+    uint64_t sb_block_bitmap;
+    uint64_t sb_fs_data;
+    uint64_t sb_size; // size of the whole image
+} superblock_t;
+
+static superblock_t *image; // NULL if the state is not backed by an image
+static int image_fd = -1;   // the image file (kept open while attached)
 
 /*
  * Volatile FS state
  */
-static open_file_entry_t *open_file_table;
-static allocation_state_t *free_open_file_entries;
+
+/*
+ * The open file table is split into segments of OPEN_FILE_SEGMENT_SIZE slots,
+ * allocated the first time one of their slots is needed. A file handle holds
+ * the slot index in its low OPEN_FILE_INDEX_BITS bits and the slot's
+ * generation above them; the generation is bumped every time the slot is
+ * reused, so stale handles never match the slot's current handle.
+ */
+typedef struct {
+    _Atomic int of_handle;       // handle of the open file, 0 if free
+    _Atomic uint32_t of_next;    // next free slot plus one (0 ends the list)
+    unsigned of_generation;      // generation of the last handle given out
+    open_file_entry_t of_entry;
+} open_file_slot_t;
+
+#define OPEN_FILE_INDEX_BITS (20)
+#define OPEN_FILE_INDEX_MASK ((1 << OPEN_FILE_INDEX_BITS) - 1)
+#define OPEN_FILE_GENERATIONS (1u << (31 - OPEN_FILE_INDEX_BITS))
+
+static open_file_slot_t *_Atomic *open_file_segments;
+static size_t open_file_segment_count;
+static atomic_size_t open_file_unused; // slots past this one were never used
+// Lock-free stack of free slots: the top slot's index plus one in the low
+// half, and a tag bumped on every change (against ABA) in the high half
+static _Alignas(64) _Atomic uint64_t open_file_free_top;
+
+/*
+ * Directory block layout: a header, the entries in use (packed at the start
+ * of the entry array) and an open addressing hash index over their names.
+ * Index slots hold an entry's position plus one, or one of the markers below.
+ */
+typedef struct {
+    int32_t d_count; // number of entries in use
+} dir_header_t;
+
+#define DIR_SLOT_EMPTY (0)
+#define DIR_SLOT_DELETED (-1)
+
+static size_t dir_entries_max; // entries that fit in a directory block
+static size_t dir_slot_count;  // hash index slots (a power of two)
 
 // Convenience macros
 #define INODE_TABLE_SIZE (fs_params.max_inode_count)
 #define DATA_BLOCKS (fs_params.max_block_count)
 #define MAX_OPEN_FILES (fs_params.max_open_files_count)
 #define BLOCK_SIZE (fs_params.block_size)
-#define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(dir_entry_t))
+#define MAX_DIR_ENTRIES (dir_entries_max)
+#define BITMAP_WORDS(bits) (((bits) + 63) / 64)
+#define INODE_BITMAP_WORDS BITMAP_WORDS(INODE_TABLE_SIZE)
+#define INODE_FULL_WORDS BITMAP_WORDS(INODE_BITMAP_WORDS)
+#define INODE_FREE_STACK_SIZE (64)
+#define BLOCK_BITMAP_WORDS BITMAP_WORDS(DATA_BLOCKS)
+// Extents per overflow extent block (its last slot links to the next one)
+#define OVERFLOW_EXTENTS (BLOCK_SIZE / sizeof(extent_t) - 1)
+#define BITMAP_BLOCK(word) ((size_t)(word) * sizeof(uint64_t) / BLOCK_SIZE)
+
+/*
+ * The extents of an inode past the inline ones are kept in a chain of
+ * overflow extent blocks, starting at i_extent_block: each holds
+ * OVERFLOW_EXTENTS of them, followed by a slot whose e_block is the next
+ * block of the chain (-1 ends it). They are walked in order with a cursor.
+ */
+typedef struct {
+    inode_t const *inode;
+    extent_t *block; // overflow block holding the last extent returned
+    size_t next;     // index of the next extent
+} extent_cursor_t;
+
+#define EXTENT_CURSOR(inode_) ((extent_cursor_t){.inode = (inode_)})
 
 static inline bool valid_inumber(int inumber) {
     return inumber >= 0 && inumber < INODE_TABLE_SIZE;
@@ -49,11 +264,21 @@ static inline bool valid_block_number(int block_number) {
 }
 
 static inline bool valid_file_handle(int file_handle) {
-    return file_handle >= 0 && file_handle < MAX_OPEN_FILES;
+    return file_handle > 0 &&
+           (size_t)(file_handle & OPEN_FILE_INDEX_MASK) < MAX_OPEN_FILES;
 }
 
 size_t state_block_size(void) { return BLOCK_SIZE; }
 
+/**
+ * Check whether the data blocks are in memory, so that their contents can be
+ * handed out directly (see inode_data_spans). Blocks in a device file are
+ * only reached through copies.
+ */
+bool data_blocks_mapped(void) {
+    return block_device_memory(block_device) != NULL;
+}
+
 
 /**
  * Do nothing, while preventing the compiler from performing any optimizations.
@@ -87,393 +312,3191 @@ static void insert_delay(void) {
 }
 
 /**
- * Initialize FS state.
+ * Access persistent FS state through the buffer cache: the storage latency is
+ * only paid (once, as for a single request) if some of it is not cached.
  *
  * Input:
- *   - params: TécnicoFS parameters
- *
- * Returns 0 if successful, -1 otherwise.
- *
- * Possible errors:
- *   - TFS already initialized.
- *   - malloc failure when allocating TFS structures.
+ *   - kind: what is accessed
+ *   - number: number of the first piece accessed (inumber, block number...)
+ *   - count: number of consecutive pieces accessed
  */
-int state_init(tfs_params params) {
-    fs_params = params;
-
-    if (inode_table != NULL) {
-        return -1; // already initialized
+static void storage_access(cache_kind_t kind, size_t number, size_t count) {
+    if (block_cache_touch(kind, number, count) > 0) {
+        insert_delay();
     }
+}
 
-    inode_table = malloc(INODE_TABLE_SIZE * sizeof(inode_t));
-    freeinode_ts = malloc(INODE_TABLE_SIZE * sizeof(allocation_state_t));
-    fs_data = malloc(DATA_BLOCKS * BLOCK_SIZE);
-    free_blocks = malloc(DATA_BLOCKS * sizeof(allocation_state_t));
-    open_file_table = malloc(MAX_OPEN_FILES * sizeof(open_file_entry_t));
-    free_open_file_entries =
-        malloc(MAX_OPEN_FILES * sizeof(allocation_state_t));
+/**
+ * Access persistent FS state through the buffer cache, leaving the storage
+ * latency to be paid by the caller (see storage_access). Callers holding a
+ * lock pay it once they released the lock, so that other threads do not wait
+ * for it.
+ *
+ * Returns true if the latency is due (with insert_delay), false otherwise.
+ */
+static bool storage_access_deferred(cache_kind_t kind, size_t number,
+                                    size_t count) {
+    return block_cache_touch(kind, number, count) > 0;
+}
 
-    if (!inode_table || !freeinode_ts || !fs_data || !free_blocks ||
-        !open_file_table || !free_open_file_entries) {
-        return -1; // allocation failed
+/**
+ * Lock one of the allocators' mutexes (the inode bitmap's or a block
+ * sub-pool's), counting the acquisitions and those that had to wait for
+ * another thread (see tfs_lock_stats).
+ *
+ * Input:
+ *   - mutex: the mutex
+ *   - counters: its counters (only updated with the mutex held)
+ */
+static void allocator_lock(pthread_mutex_t *mutex, lock_counters_t *counters) {
+    bool contended = pthread_mutex_trylock(mutex) != 0;
+    if (contended) {
+        pthread_mutex_lock(mutex);
     }
+    counters->lc_acquired++;
+    counters->lc_contended += contended;
+}
 
-    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
-        freeinode_ts[i] = FREE;
-    }
+/**
+ * Obtain a pointer to the contents of a run of consecutive blocks in memory,
+ * accessing them through the buffer cache.
+ *
+ * Input:
+ *   - block_number: the first block's number
+ *   - count: number of blocks
+ */
+static char *data_block_range(int block_number, size_t count) {
+    storage_access(CACHE_DATA_BLOCK, (size_t)block_number, count);
+    char *data = block_device_memory(block_device);
+    return &data[(size_t)block_number * BLOCK_SIZE];
+}
 
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        free_blocks[i] = FREE;
+/**
+ * Hash a file name (FNV-1a).
+ */
+static uint32_t dir_name_hash(char const *name) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < MAX_FILE_NAME && name[i] != '\0'; i++) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
     }
+    return hash;
+}
 
-    for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
-        free_open_file_entries[i] = FREE;
-    }
+static inline dir_header_t *dir_header(void *block) { return block; }
 
-    return 0;
+static inline dir_entry_t *dir_entries(void *block) {
+    return (dir_entry_t *)((char *)block + sizeof(dir_header_t));
+}
+
+static inline int32_t *dir_slots(void *block) {
+    return (int32_t *)(dir_entries(block) + MAX_DIR_ENTRIES);
 }
 
 /**
- * Destroy FS state.
+ * Initialize an empty directory block.
  *
- * Returns 0 if succesful, -1 otherwise.
+ * Input:
+ *   - block: the directory's data block
  */
-int state_destroy(void) {
-    free(inode_table);
-    free(freeinode_ts);
-    free(fs_data);
-    free(free_blocks);
-    free(open_file_table);
-    free(free_open_file_entries);
+static void dir_init(void *block) {
+    dir_header(block)->d_count = 0;
 
-    inode_table = NULL;
-    freeinode_ts = NULL;
-    fs_data = NULL;
-    free_blocks = NULL;
-    open_file_table = NULL;
-    free_open_file_entries = NULL;
+    dir_entry_t *entries = dir_entries(block);
+    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+        entries[i].d_inumber = -1;
+    }
 
-    return 0;
+    int32_t *slots = dir_slots(block);
+    for (size_t i = 0; i < dir_slot_count; i++) {
+        slots[i] = DIR_SLOT_EMPTY;
+    }
 }
 
 /**
- * (Try to) Allocate a new inode in the inode table, without initializing its
- * data.
+ * Run the probe sequence of a name over the hash index of a directory block.
+ * Must be called with the directory's lock held.
  *
- * Returns the inumber of the newly allocated inode, or -1 in the case of error.
+ * Input:
+ *   - block: the directory's data block
+ *   - name: the name to look for
+ *   - insert_slot: if not NULL, where to store the first slot where the name
+ *     could be inserted (or -1 if there is none)
  *
- * Possible errors:
- *   - No free slots in inode table.
+ * Returns the index slot holding the name, or -1 if the name is not present.
  */
-static int inode_alloc(void) {
+static long dir_probe(void *block, char const *name, long *insert_slot) {
+    dir_entry_t const *entries = dir_entries(block);
+    int32_t const *slots = dir_slots(block);
+    size_t mask = dir_slot_count - 1;
+    size_t slot = dir_name_hash(name) & mask;
+
+    if (insert_slot != NULL) {
+        *insert_slot = -1;
+    }
 
-    pthread_mutex_lock(&trinco);
-    for (size_t inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-        if ((inumber * sizeof(allocation_state_t) % BLOCK_SIZE) == 0) {
-            insert_delay(); // simulate storage access delay (to freeinode_ts)
+    // linear probing, over at most every slot of the index
+    for (size_t i = 0; i < dir_slot_count; i++, slot = (slot + 1) & mask) {
+        int32_t s = slots[slot];
+        if (s == DIR_SLOT_EMPTY) {
+            if (insert_slot != NULL && *insert_slot == -1) {
+                *insert_slot = (long)slot;
+            }
+            return -1;
         }
-
-        // Finds first free entry in inode table
-        if (freeinode_ts[inumber] == FREE) {
-
-            //  Found a free entry, so takes it for the new inode
-            freeinode_ts[inumber] = TAKEN;
-
-            pthread_mutex_unlock(&trinco);
-            return (int)inumber;
+        if (s == DIR_SLOT_DELETED) {
+            if (insert_slot != NULL && *insert_slot == -1) {
+                *insert_slot = (long)slot;
+            }
+            continue;
+        }
+        if (strncmp(entries[s - 1].d_name, name, MAX_FILE_NAME) == 0) {
+            return (long)slot;
         }
     }
-
-    pthread_mutex_unlock(&trinco);
-    // no free inodes
     return -1;
 }
 
 /**
- * Create a new inode in the inode table.
+ * Compute the layout of an image file for the current parameters.
  *
- * Allocates and initializes a new inode.
- * Directories will have their data block allocated and initialized, with i_size
- * set to BLOCK_SIZE. Regular files will not have their data block allocated
- * (i_size will be set to 0, i_data_block to -1).
+ * Input:
+ *   - sb: where to store the layout (a superblock)
+ */
+static void image_layout(superblock_t *sb) {
+    size_t const line = 64;
+    size_t const page = 4096;
+#define ALIGN_UP(x, a) (((x) + (a)-1) / (a) * (a))
+
+    memset(sb, 0, sizeof(*sb));
+    sb->sb_magic = IMAGE_MAGIC;
+    sb->sb_version = IMAGE_VERSION;
+    sb->sb_inode_size = sizeof(inode_t);
+    sb->sb_inode_count = INODE_TABLE_SIZE;
+    sb->sb_block_count = DATA_BLOCKS;
+    sb->sb_block_size = BLOCK_SIZE;
+
+    size_t offset = ALIGN_UP(sizeof(superblock_t), line);
+    sb->sb_inode_table = offset;
+    offset = ALIGN_UP(offset + INODE_TABLE_SIZE * sizeof(inode_t), line);
+    sb->sb_inode_bitmap = offset;
+    offset = ALIGN_UP(offset + INODE_BITMAP_WORDS * sizeof(uint64_t), line);
+    sb->sb_inode_full_words = offset;
+    offset = ALIGN_UP(offset + INODE_FULL_WORDS * sizeof(uint64_t), line);
+    sb->sb_block_bitmap = offset;
+    offset = ALIGN_UP(offset + BLOCK_BITMAP_WORDS * sizeof(uint64_t), page);
+    sb->sb_fs_data = offset;
+    sb->sb_size = offset + DATA_BLOCKS * BLOCK_SIZE;
+
+#undef ALIGN_UP
+}
+
+/**
+ * Map the image file named in the parameters, creating it if it does not
+ * exist, and point the persistent tables into it.
+ *
+ * The mapping is private: the metadata changed in it only reaches the file
+ * once committed, through the journal, and file data is written through to
+ * the file (see inode_data_copy).
  *
  * Input:
- *   - i_type: the type of the node (file or directory or symbolic link)
+ *   - fresh: where to store whether the image was just created (its tables
+ *     are then zeroed) or an existing one was attached
  *
- * Returns inumber of the new inode, or -1 in the case of error.
+ * Returns 0 if successful, -1 otherwise.
  *
  * Possible errors:
- *   - No free slots in inode table.
- *   - (if creating a directory) No free data blocks.
+ *   - The image file cannot be opened, created or mapped.
+ *   - The existing file is not an image, or its version or parameters differ.
  */
-int inode_create(inode_type i_type) {
+static int image_open(bool *fresh) {
+    superblock_t layout;
+    image_layout(&layout);
 
-    int inumber = inode_alloc();
-    if (inumber == -1) {
-        return -1; // no free slots in inode table
+    int fd = open(fs_params.image_path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        return -1;
     }
-    pthread_mutex_lock(&trinco);
-
-    inode_t *inode = &inode_table[inumber];
-    insert_delay(); // simulate storage access delay (to inode)
-
-    inode->i_node_type = i_type;
-    switch (i_type) {
-    case T_DIRECTORY: {
-        // Initializes directory (filling its block with empty entries, labeled
-        // with inumber==-1)
-        int b = data_block_alloc();
-        if (b == -1) {
-            // ensure fields are initialized
-            inode->i_size = 0;
-            inode->i_data_block = -1;
-
-            // run regular deletion process
-            inode_delete(inumber);
-            pthread_mutex_unlock(&trinco);
-            return -1;
-        }
 
-        inode_table[inumber].i_size = BLOCK_SIZE;
-        inode_table[inumber].i_data_block = b;
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    *fresh = st.st_size == 0;
+    if ((*fresh && ftruncate(fd, (off_t)layout.sb_size) == -1) ||
+        (!*fresh && (uint64_t)st.st_size != layout.sb_size)) {
+        close(fd);
+        return -1; // cannot be created, or not an image of this size
+    }
 
-        dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
-        ALWAYS_ASSERT(dir_entry != NULL,
-                      "inode_create: data block freed while in use");
+    // Pages are only read from the file on first access, so images larger
+    // than memory work too (only the pages changed stay in memory for good)
+    void *map = mmap(NULL, layout.sb_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
 
-        for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-            dir_entry[i].d_inumber = -1;
-        }
-    } break;
-    case T_FILE:
-        // In case of a new file, simply sets its size to 0
-        inode_table[inumber].i_size = 0;
-        inode_table[inumber].i_data_block = -1;
-        inode_table[inumber].hl_count = 1;
-        break;
-    case SYM_LINK:
-        break;
-    default:
-        PANIC("inode_create: unknown file type");
+    // A fresh image only gets its superblock once it is fully initialized
+    // (see state_init), so a half-created one is never attached
+    if (!*fresh && memcmp(map, &layout, sizeof(layout)) != 0) {
+        munmap(map, layout.sb_size);
+        close(fd);
+        return -1; // not an image, or a different version or parameters
     }
 
-    pthread_mutex_unlock(&trinco);
-    return inumber;
+    image = map;
+    image_fd = fd;
+    inode_table = (inode_t *)((char *)map + layout.sb_inode_table);
+    inode_bitmap = (uint64_t *)((char *)map + layout.sb_inode_bitmap);
+    inode_full_words = (uint64_t *)((char *)map + layout.sb_inode_full_words);
+    block_bitmap = (uint64_t *)((char *)map + layout.sb_block_bitmap);
+    fs_data = (char *)map + layout.sb_fs_data;
+    return 0;
 }
 
 /**
- * Delete an inode.
+ * Allocate zero-filled memory for a table, which is only committed as it is
+ * touched (so that large tables cost nothing up front).
  *
  * Input:
- *   - inumber: inode's number
+ *   - size: bytes needed
+ *
+ * Returns the memory (page-aligned), or NULL if it could not be mapped.
  */
-void inode_delete(int inumber) {
-    // simulate storage access delay (to inode and freeinode_ts)
-    insert_delay();
-    insert_delay();
-
-    ALWAYS_ASSERT(valid_inumber(inumber), "inode_delete: invalid inumber");
-
-    ALWAYS_ASSERT(freeinode_ts[inumber] == TAKEN,
-                  "inode_delete: inode already freed");
-
-    if (inode_table[inumber].i_size > 0) {
-        data_block_free(inode_table[inumber].i_data_block);
-    }
-
-    freeinode_ts[inumber] = FREE;
+static void *table_alloc(size_t size) {
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return map == MAP_FAILED ? NULL : map;
 }
 
 /**
- * Obtain a pointer to an inode from its inumber.
+ * Release the memory of a table allocated with table_alloc.
  *
  * Input:
- *   - inumber: inode's number
- *
- * Returns pointer to inode.
+ *   - table: the table (or NULL)
+ *   - size: its size, in bytes
  */
-inode_t *inode_get(int inumber) {
-
-    ALWAYS_ASSERT(valid_inumber(inumber), "inode_get: invalid inumber");
+static void table_free(void *table, size_t size) {
+    if (table != NULL) {
+        munmap(table, size);
+    }
+}
 
-    insert_delay(); // simulate storage access delay to inode
-    return &inode_table[inumber];
+/**
+ * Check whether an all-zero read-write lock equals one statically
+ * initialized.
+ */
+static bool rwlock_zero_initialized(void) {
+    static pthread_rwlock_t const initializer = PTHREAD_RWLOCK_INITIALIZER;
+    static pthread_rwlock_t const zero;
+    return memcmp(&initializer, &zero, sizeof(zero)) == 0;
 }
 
 /**
- * Clear the directory entry associated with a sub file.
+ * Map the memory for the data blocks, when they are kept in memory: on huge
+ * pages if so asked (see tfs_params.huge_pages), falling back to regular
+ * pages with a hint to back them with transparent huge pages. The memory is
+ * only faulted in once bound to its nodes (see block_pools_init).
  *
  * Input:
- *   - inode: directory inode
- *   - sub_name: sub file name
- *
- * Returns 0 if successful, -1 otherwise.
+ *   - size: bytes needed
  *
- * Possible errors:
- *   - inode is not a directory inode.
- *   - Directory does not contain an entry for sub_name.
+ * Returns the memory, or NULL if it could not be mapped.
  */
-int clear_dir_entry(inode_t *inode, char const *sub_name) {
-    pthread_mutex_lock(&trinco);
-
-    insert_delay();
-    if (inode->i_node_type != T_DIRECTORY) {
-        pthread_mutex_unlock(&trinco);
-        return -1; // not a directory
+static char *data_memory_map(size_t size) {
+    void *map = MAP_FAILED;
+    if (fs_params.huge_pages) {
+        // Explicit huge pages are handed out whole, and only if the host has
+        // some reserved
+        fs_data_page = HUGE_PAGE_SIZE;
+        fs_data_size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE *
+                       HUGE_PAGE_SIZE;
+        map = mmap(NULL, fs_data_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
     }
-
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "clear_dir_entry: directory must have a data block");
-
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (!strcmp(dir_entry[i].d_name, sub_name)) {
-            dir_entry[i].d_inumber = -1;
-            memset(dir_entry[i].d_name, 0, MAX_FILE_NAME);
-            pthread_mutex_unlock(&trinco);
-            return 0;
+    if (map == MAP_FAILED) {
+        fs_data_page = (size_t)sysconf(_SC_PAGESIZE);
+        fs_data_size = size;
+        map = mmap(NULL, fs_data_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (map == MAP_FAILED) {
+            fs_data_size = 0;
+            return NULL;
+        }
+        if (fs_params.huge_pages) {
+            madvise(map, fs_data_size, MADV_HUGEPAGE);
         }
     }
-    pthread_mutex_unlock(&trinco);
-    return -1; // sub_name not found
+    return map;
 }
 
 /**
- * Store the inumber for a sub file in a directory.
+ * Count the NUMA nodes of the host.
  *
- * Input:
- *   - inode: directory inode
- *   - sub_name: sub file name
- *   - sub_inumber: inumber of the sub inode
+ * Returns the highest online node number plus one (1 if unknown).
+ */
+static size_t numa_node_count(void) {
+    FILE *online = fopen("/sys/devices/system/node/online", "r");
+    if (online == NULL) {
+        return 1;
+    }
+    // A list of ranges, such as "0-1,3"
+    size_t count = 1;
+    unsigned long node;
+    while (fscanf(online, "%lu", &node) == 1) {
+        if (node + 1 > count) {
+            count = node + 1;
+        }
+        if (fgetc(online) == EOF) {
+            break;
+        }
+    }
+    fclose(online);
+    return count;
+}
+
+/**
+ * Split the free block pool into one sub-pool per NUMA node, binding the
+ * memory of each sub-pool's blocks to its node, and fault that memory in if
+ * so asked (see tfs_params.prefault).
  *
  * Returns 0 if successful, -1 otherwise.
- *
- * Possible errors:
- *   - inode is not a directory inode.
- *   - sub_name is not a valid file name (length 0 or > MAX_FILE_NAME - 1).
- *   - Directory is already full of entries.
  */
-int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber) {
-
-    if (strlen(sub_name) == 0 || strlen(sub_name) > MAX_FILE_NAME - 1) 
-        return -1; // invalid sub_name
-
-    insert_delay(); // simulate storage access delay to inode with inumber
-    pthread_mutex_lock(&trinco);
-
-    if (inode->i_node_type != T_DIRECTORY){
-        pthread_mutex_unlock(&trinco);
-        return -1; // not a directory
+static int block_pools_init(void) {
+    size_t count = fs_params.numa_nodes;
+    if (count == 0) {
+        count = numa_node_count();
+    }
+    if (count > MAX_NUMA_NODES) {
+        count = MAX_NUMA_NODES; // nodes past these share their sub-pools
+    }
+    if (count > BLOCK_BITMAP_WORDS) {
+        count = BLOCK_BITMAP_WORDS; // every sub-pool gets a word at least
     }
 
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "add_dir_entry: directory must have a data block");
+    block_pools = aligned_alloc(_Alignof(block_pool_t),
+                                count * sizeof(block_pool_t));
+    if (block_pools == NULL) {
+        return -1;
+    }
+    block_pool_count = count;
+    block_pool_words = BLOCK_BITMAP_WORDS / count;
+    block_pool_longer = BLOCK_BITMAP_WORDS % count;
+    atomic_store(&block_pool_local, 0);
+    atomic_store(&block_pool_remote, 0);
+
+    for (size_t i = 0; i < count; i++) {
+        block_pool_t *pool = &block_pools[i];
+        pthread_mutex_init(&pool->lock, NULL);
+        pool->counters = (lock_counters_t){0, 0};
+        pool->first = i * block_pool_words +
+                      (i < block_pool_longer ? i : block_pool_longer);
+        pool->end = pool->first + block_pool_words + (i < block_pool_longer);
+        pool->hint = pool->first;
+
+        // Binding is a preference, which the kernel may not honour (and the
+        // pages shared by two sub-pools stay wherever they land)
+        if (count > 1 && fs_data_size > 0) {
+            size_t start = pool->first * 64 * BLOCK_SIZE;
+            size_t end = pool->end * 64 * BLOCK_SIZE;
+            start = (start + fs_data_page - 1) / fs_data_page * fs_data_page;
+            end = end < fs_data_size ? end / fs_data_page * fs_data_page
+                                     : fs_data_size;
+            unsigned long nodemask = 1UL << i;
+            if (start < end) {
+                syscall(SYS_mbind, fs_data + start, end - start,
+                        MPOL_PREFERRED, &nodemask, MAX_NUMA_NODES + 1, 0);
+            }
+        }
+    }
 
-    // Finds and fills the first empty entry
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (dir_entry[i].d_inumber == -1) {
-            dir_entry[i].d_inumber = sub_inumber;
-            strncpy(dir_entry[i].d_name, sub_name, MAX_FILE_NAME - 1);
-            dir_entry[i].d_name[MAX_FILE_NAME - 1] = '\0';
-            pthread_mutex_unlock(&trinco);
-            return 0;
+    if (fs_params.prefault && fs_data_size > 0 &&
+        mlock(fs_data, fs_data_size) != 0) {
+        // Locking may exceed RLIMIT_MEMLOCK: fault the pages in anyway
+        for (size_t b = 0; b < fs_data_size; b += fs_data_page) {
+            ((char volatile *)fs_data)[b] = 0;
         }
     }
-    pthread_mutex_unlock(&trinco);
-    return -1; // no space for entry
+    return 0;
+}
+
+/**
+ * Release the free block sub-pools.
+ */
+static void block_pools_destroy(void) {
+    for (size_t i = 0; block_pools != NULL && i < block_pool_count; i++) {
+        pthread_mutex_destroy(&block_pools[i].lock);
+    }
+    free(block_pools);
+    block_pools = NULL;
+    block_pool_count = 0;
 }
 
+static extent_t *extent_next(extent_cursor_t *cursor);
+static int overflow_block_next(int block);
+static size_t overflow_blocks(size_t extents);
+static int readahead_start(void);
+static bool data_blocks_claim(size_t count);
+static void data_blocks_unclaim(size_t count);
+static size_t data_block_alloc_run(size_t max, size_t *claimed, int *first);
+static void inode_writeback_discard(inode_t const *inode);
+static void open_file_segment_free(open_file_slot_t *slots);
+
 /**
- * Obtain the inumber for a sub file inside a directory.
+ * Open the journal of the image (named after it), replaying it into an
+ * attached image.
  *
  * Input:
- *   - inode: directory inode
- *   - sub_name: sub file name
- *
- * Returns inumber linked to the target name, -1 if errors occur.
+ *   - fresh: whether the image was just created
  *
- * Possible errors:
- *   - inode is not a directory inode.
- *   - Directory does not contain a file named sub_name.
+ * Returns 0 if successful, -1 otherwise.
  */
-int find_in_dir(inode_t const *inode, char const *sub_name) {
-
-    ALWAYS_ASSERT(inode != NULL, "find_in_dir: inode must be non-NULL");
-    ALWAYS_ASSERT(sub_name != NULL, "find_in_dir: sub_name must be non-NULL");
-
-    insert_delay(); // simulate storage access delay to inode with inumber
-    pthread_mutex_lock(&trinco);
-
-    if (inode->i_node_type != T_DIRECTORY){
-        pthread_mutex_unlock(&trinco); 
-        return -1; // not a directory
+static int image_journal_open(bool fresh) {
+    size_t len = strlen(fs_params.image_path) + sizeof(".journal");
+    char *path = malloc(len);
+    if (path == NULL) {
+        return -1;
     }
+    snprintf(path, len, "%s.journal", fs_params.image_path);
+
+    // A fresh image only gets its superblock at the end of state_init
+    superblock_t layout;
+    image_layout(&layout);
+    int result = journal_open(path, image_fd, image, layout.sb_size, !fresh);
+    free(path);
+    return result;
+}
 
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "find_in_dir: directory inode must have a data block");
-
-    // Iterates over the directory entries looking for one that has the target
-    // name
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++){
-        if ((dir_entry[i].d_inumber != -1) &&
-            (strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
-            int sub_inumber = dir_entry[i].d_inumber;
-            pthread_mutex_unlock(&trinco);
-            return sub_inumber;
+/**
+ * Rebuild the summary of full inode bitmap words of an attached image (it is
+ * not journaled, being derived from the bitmap).
+ */
+static void inode_full_words_rebuild(void) {
+    memset(inode_full_words, 0, INODE_FULL_WORDS * sizeof(uint64_t));
+    for (size_t word = 0; word < INODE_BITMAP_WORDS; word++) {
+        if (inode_bitmap[word] == ~UINT64_C(0)) {
+            inode_full_words[word / 64] |= UINT64_C(1) << (word % 64);
         }
     }
-    pthread_mutex_unlock(&trinco);
-    return -1; // entry not found
+    if (INODE_BITMAP_WORDS % 64 != 0) {
+        inode_full_words[INODE_FULL_WORDS - 1] |= ~UINT64_C(0)
+                                                  << (INODE_BITMAP_WORDS % 64);
+    }
 }
 
 /**
- * Allocate a new data block.
+ * Mark a block of an attached image as in use, while rebuilding its block
+ * bitmap.
  *
- * Returns block number/index if successful, -1 otherwise.
+ * Returns true if successful, false if the block number is out of range or
+ * the block is already in use.
+ */
+static bool image_block_claim(int block) {
+    if (!valid_block_number(block) ||
+        (block_bitmap[block / 64] & (UINT64_C(1) << (block % 64)))) {
+        return false;
+    }
+    block_bitmap[block / 64] |= UINT64_C(1) << (block % 64);
+    return true;
+}
+
+/**
+ * Mark the data blocks of an inode of an attached image as in use, checking
+ * its extents.
  *
- * Possible errors:
- *   - No free data blocks.
+ * Returns 0 if successful, -1 if a block is out of range or already in use,
+ * or the inode has more extents than its blocks hold.
  */
-int data_block_alloc(void) {
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        if (i * sizeof(allocation_state_t) % BLOCK_SIZE == 0) {
-            insert_delay(); // simulate storage access delay to free_blocks
+static int image_inode_claim(inode_t const *inode) {
+    // The chain is claimed first, so that a loop in it ends the walk
+    size_t chain = 0;
+    for (int b = inode->i_extent_block; b != -1;
+         b = overflow_block_next(b), chain++) {
+        if (!image_block_claim(b)) {
+            return -1;
         }
+    }
+    if (chain < overflow_blocks(inode->i_extent_count)) {
+        return -1;
+    }
 
-        if (free_blocks[i] == FREE) {
-            free_blocks[i] = TAKEN;
-            return (int)i;
+    extent_cursor_t cursor = EXTENT_CURSOR(inode);
+    extent_t const *extent;
+    while ((extent = extent_next(&cursor)) != NULL) {
+        if (!valid_block_number(extent->e_block) || extent->e_length <= 0 ||
+            (size_t)extent->e_length > DATA_BLOCKS - (size_t)extent->e_block) {
+            return -1;
+        }
+        for (int b = 0; b < extent->e_length; b++) {
+            if (!image_block_claim(extent->e_block + b)) {
+                return -1;
+            }
         }
     }
-    return -1;
+    return 0;
 }
 
 /**
- * Free a data block.
+ * Rebuild the inode and block bitmaps of an attached image from its directory
+ * tree, checking it on the way. The inodes in use are the ones reachable from
+ * the root, and the blocks in use theirs: inodes left unreachable (files
+ * unlinked while borrowed, whose last borrow never came back) and blocks
+ * cached in magazines or reserved by writers when the image was last used go
+ * back to the pool. Wrong file link counts are fixed. The fixes are
+ * journaled.
  *
- * Input:
- *   - block_number: the block number/index
+ * Returns 0 if successful, -1 if the image is inconsistent (an inumber or
+ * block number out of range, a directory linked twice or a block in use
+ * twice) or memory runs out.
  */
-void data_block_free(int block_number) {
-    pthread_mutex_lock(&trinco);
+static int image_tree_rebuild(void) {
+    uint64_t *old_bitmap = malloc(INODE_BITMAP_WORDS * sizeof(uint64_t));
+    unsigned *links = calloc(INODE_TABLE_SIZE, sizeof(unsigned));
+    int *stack = malloc(INODE_TABLE_SIZE * sizeof(int));
+    if (old_bitmap == NULL || links == NULL || stack == NULL) {
+        free(old_bitmap);
+        free(links);
+        free(stack);
+        return -1;
+    }
+    memcpy(old_bitmap, inode_bitmap, INODE_BITMAP_WORDS * sizeof(uint64_t));
+
+    memset(inode_bitmap, 0, INODE_BITMAP_WORDS * sizeof(uint64_t));
+    if (INODE_TABLE_SIZE % 64 != 0) {
+        inode_bitmap[INODE_BITMAP_WORDS - 1] = ~UINT64_C(0)
+                                               << (INODE_TABLE_SIZE % 64);
+    }
+    memset(block_bitmap, 0, BLOCK_BITMAP_WORDS * sizeof(uint64_t));
+    if (DATA_BLOCKS % 64 != 0) {
+        block_bitmap[BLOCK_BITMAP_WORDS - 1] = ~UINT64_C(0)
+                                               << (DATA_BLOCKS % 64);
+    }
+
+    // An image whose root was never committed is empty (tfs_init creates it)
+    size_t top = 0;
+    if ((old_bitmap[0] & 1) &&
+        inode_table[ROOT_DIR_INUM].i_node_type == T_DIRECTORY) {
+        inode_bitmap[0] |= 1;
+        stack[top++] = ROOT_DIR_INUM;
+    }
+
+    int result = 0;
+    while (result == 0 && top > 0) {
+        inode_t const *inode = &inode_table[stack[--top]];
+        result = image_inode_claim(inode);
+        if (result == -1 || inode->i_node_type != T_DIRECTORY) {
+            continue;
+        }
+
+        void *block = inode->i_extent_count > 0
+                          ? data_block_get(inode->i_extents[0].e_block)
+                          : NULL;
+        if (block == NULL || dir_header(block)->d_count < 0 ||
+            (size_t)dir_header(block)->d_count > MAX_DIR_ENTRIES) {
+            result = -1;
+            continue;
+        }
+        dir_entry_t const *entries = dir_entries(block);
+        for (int32_t e = 0; result == 0 && e < dir_header(block)->d_count;
+             e++) {
+            int sub = entries[e].d_inumber;
+            if (!valid_inumber(sub) || sub == ROOT_DIR_INUM ||
+                (unsigned)inode_table[sub].i_node_type > SYM_LINK) {
+                result = -1;
+                break;
+            }
+            uint64_t bit = UINT64_C(1) << (sub % 64);
+            if (links[sub]++ > 0) {
+                // Directories have a single link
+                result = inode_table[sub].i_node_type == T_DIRECTORY ? -1 : 0;
+                continue;
+            }
+            inode_bitmap[sub / 64] |= bit;
+            stack[top++] = sub;
+        }
+    }
+
+    for (size_t i = 0; result == 0 && i < INODE_TABLE_SIZE; i++) {
+        inode_t *inode = &inode_table[i];
+        if (links[i] > 0 && inode->i_node_type == T_FILE &&
+            inode->hl_count != (int)links[i]) {
+            inode->hl_count = (int)links[i];
+            inode_journal(inode);
+        }
+    }
+    for (size_t w = 0; result == 0 && w < INODE_BITMAP_WORDS; w++) {
+        if (inode_bitmap[w] != old_bitmap[w]) {
+            journal_log(&inode_bitmap[w], sizeof(uint64_t));
+        }
+    }
+
+    free(old_bitmap);
+    free(links);
+    free(stack);
+    return result;
+}
+
+/**
+ * Undo a state_init that failed part of the way through, freeing whatever it
+ * allocated so far.
+ *
+ * Returns -1.
+ */
+static int state_init_fail(void) {
+    state_destroy();
+    return -1;
+}
+
+/**
+ * Initialize FS state.
+ *
+ * If the parameters name an image file, the persistent state is mapped from
+ * it: an existing image is attached as is, and a missing one is created.
+ *
+ * Input:
+ *   - params: TécnicoFS parameters
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - TFS already initialized.
+ *   - malloc failure when allocating TFS structures.
+ *   - The image file cannot be used (see image_open).
+ */
+int state_init(tfs_params params) {
+    if (inode_table != NULL) {
+        return -1; // already initialized
+    }
+    fs_params = params;
+
+    // Parameters are checked before anything is allocated
+    if (fs_params.image_path != NULL && fs_params.device_path != NULL) {
+        return -1; // the image holds the data blocks
+    }
+    if (MAX_OPEN_FILES > (size_t)1 << OPEN_FILE_INDEX_BITS) {
+        return -1; // slot indexes must fit in a file handle
+    }
+
+    bool fresh = true;
+    if (fs_params.image_path != NULL) {
+        if (image_open(&fresh) == -1) {
+            return -1;
+        }
+        // The image is only consistent once its journal is replayed
+        if (image_journal_open(fresh) == -1) {
+            return state_init_fail();
+        }
+    } else {
+        inode_table = table_alloc(INODE_TABLE_SIZE * sizeof(inode_t));
+        inode_bitmap = calloc(INODE_BITMAP_WORDS, sizeof(uint64_t));
+        inode_full_words = calloc(INODE_FULL_WORDS, sizeof(uint64_t));
+        if (fs_params.device_path == NULL) {
+            fs_data = data_memory_map(DATA_BLOCKS * BLOCK_SIZE);
+        }
+        block_bitmap = calloc(BLOCK_BITMAP_WORDS, sizeof(uint64_t));
+    }
+    inode_free_stack = malloc(INODE_FREE_STACK_SIZE * sizeof(int));
+    open_file_segment_count =
+        (MAX_OPEN_FILES + OPEN_FILE_SEGMENT_SIZE - 1) / OPEN_FILE_SEGMENT_SIZE;
+    open_file_segments =
+        calloc(open_file_segment_count, sizeof(*open_file_segments));
+    inode_refs = calloc(INODE_TABLE_SIZE, sizeof(atomic_uint));
+    inode_locks = table_alloc(INODE_TABLE_SIZE * sizeof(padded_rwlock_t));
+    if (inode_refs == NULL || inode_locks == NULL) {
+        return state_init_fail();
+    }
+    // Zero-filled locks are ready to use where they equal the static
+    // initializer (as with glibc); elsewhere, each must be initialized
+    inode_locks_zeroed = rwlock_zero_initialized();
+    for (size_t i = 0; !inode_locks_zeroed && i < INODE_TABLE_SIZE; i++) {
+        pthread_rwlock_init(&inode_locks[i].rwlock, NULL);
+    }
+    if (fs_params.writeback_size > 0) {
+        write_buffers = calloc(INODE_TABLE_SIZE, sizeof(write_buffer_t));
+        if (write_buffers == NULL) {
+            return state_init_fail();
+        }
+    }
+
+    if (!inode_table || !inode_bitmap || !inode_full_words ||
+        !inode_free_stack || (!fs_data && !fs_params.device_path) ||
+        !block_bitmap || !open_file_segments) {
+        return state_init_fail(); // allocation failed
+    }
+
+    if (fs_params.device_path != NULL) {
+        block_device =
+            block_device_file_open(fs_params.device_path,
+                                   DATA_BLOCKS * BLOCK_SIZE,
+                                   fs_params.device_queue_depth);
+        resident_blocks = calloc(DATA_BLOCKS, sizeof(*resident_blocks));
+        if (block_device == NULL || resident_blocks == NULL) {
+            return state_init_fail();
+        }
+    } else if (image != NULL) {
+        // The image is mapped privately (see image_open), so file data is
+        // written through to it
+        block_device = block_device_mapped_open(
+            fs_data, DATA_BLOCKS * BLOCK_SIZE, image_fd,
+            (size_t)(fs_data - (char *)image));
+        if (block_device == NULL) {
+            return state_init_fail();
+        }
+    } else {
+        block_device = block_device_ram_open(fs_data, DATA_BLOCKS * BLOCK_SIZE);
+        if (block_device == NULL) {
+            return state_init_fail();
+        }
+    }
+
+    // Bits past the end of the table are marked as taken, so that searches
+    // never return them
+    if (fresh && INODE_TABLE_SIZE % 64 != 0) {
+        inode_bitmap[INODE_BITMAP_WORDS - 1] = ~UINT64_C(0)
+                                               << (INODE_TABLE_SIZE % 64);
+    }
+    if (fresh && INODE_BITMAP_WORDS % 64 != 0) {
+        inode_full_words[INODE_FULL_WORDS - 1] = ~UINT64_C(0)
+                                                 << (INODE_BITMAP_WORDS % 64);
+    }
+    inode_search_hint = 0;
+    inode_free_stack_top = 0;
+    inode_bitmap_lock.counters = (lock_counters_t){0, 0};
+
+    // Pins found in an image belong to a previous run (new tables are
+    // zero-filled, so they have none); orphans left by it are unreachable,
+    // and dropped when the bitmaps are rebuilt
+    for (size_t i = 0; !fresh && i < INODE_TABLE_SIZE; i++) {
+        atomic_init(&inode_table[i].i_pins, 0);
+    }
+
+    // Size the hash index of directory blocks to keep its load factor at or
+    // below 2/3 when the directory is full
+    size_t dir_space = BLOCK_SIZE - sizeof(dir_header_t);
+    for (dir_slot_count = 1;; dir_slot_count *= 2) {
+        size_t index_size = dir_slot_count * sizeof(int32_t);
+        dir_entries_max = index_size < dir_space
+                              ? (dir_space - index_size) / sizeof(dir_entry_t)
+                              : 0;
+        if (2 * dir_slot_count >= 3 * dir_entries_max) {
+            break;
+        }
+    }
+
+    if (dcache_init(INODE_TABLE_SIZE) != 0 ||
+        block_cache_init(fs_params.cache_size) != 0) {
+        return state_init_fail();
+    }
+    if (fs_params.readahead_max_blocks > 0 && readahead_start() != 0) {
+        return state_init_fail();
+    }
+
+    if (fresh && DATA_BLOCKS % 64 != 0) {
+        block_bitmap[BLOCK_BITMAP_WORDS - 1] = ~UINT64_C(0)
+                                               << (DATA_BLOCKS % 64);
+    } else if (!fresh) {
+        if (image_tree_rebuild() == -1) {
+            return state_init_fail();
+        }
+        inode_full_words_rebuild();
+    }
+    if (block_pools_init() != 0) {
+        return state_init_fail();
+    }
+    size_t available = DATA_BLOCKS;
+    if (!fresh) {
+        available = 0;
+        for (size_t w = 0; w < BLOCK_BITMAP_WORDS; w++) {
+            available += (size_t)__builtin_popcountll(~block_bitmap[w]);
+        }
+    }
+    atomic_store(&data_blocks_available, available);
+
+    atomic_store(&open_file_unused, 0);
+    atomic_store(&open_file_free_top, 0);
+
+    if (image != NULL && fresh) {
+        image_layout(image);
+        if (pwrite(image_fd, image, sizeof(superblock_t), 0) !=
+            (ssize_t)sizeof(superblock_t)) {
+            return state_init_fail();
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Stop the read-ahead thread, dropping the runs it has not brought in yet.
+ */
+static void readahead_stop(void) {
+    if (!readahead.started) {
+        return;
+    }
+    pthread_mutex_lock(&readahead.lock);
+    readahead.stop = true;
+    pthread_cond_signal(&readahead.cond);
+    pthread_mutex_unlock(&readahead.lock);
+    pthread_join(readahead.thread, NULL);
+    readahead.started = false;
+}
+
+/**
+ * Write the resident blocks of a device file back to it, and drop them.
+ */
+static void resident_blocks_flush(void) {
+    block_request_t requests[BLOCK_DEVICE_BATCH];
+    size_t count = 0;
+
+    for (size_t b = 0; b <= DATA_BLOCKS; b++) {
+        char *block = b < DATA_BLOCKS ? atomic_load(&resident_blocks[b]) : NULL;
+        if (block != NULL) {
+            requests[count++] = (block_request_t){.r_op = BLOCK_WRITE,
+                                                  .r_offset = b * BLOCK_SIZE,
+                                                  .r_buffer = block,
+                                                  .r_len = BLOCK_SIZE};
+        }
+        if (count == BLOCK_DEVICE_BATCH || (b == DATA_BLOCKS && count > 0)) {
+            block_device_io(block_device, requests, count);
+            for (size_t i = 0; i < count; i++) {
+                free(requests[i].r_buffer);
+            }
+            count = 0;
+        }
+    }
+}
+
+/**
+ * Destroy FS state.
+ *
+ * Returns 0 if succesful, -1 otherwise.
+ */
+int state_destroy(void) {
+    // Blocks cached by the magazines belong to this instance only
+    pthread_mutex_lock(&magazines_lock);
+    for (block_magazine_t *mag = magazines; mag != NULL; mag = mag->next) {
+        pthread_mutex_lock(&mag->lock);
+        mag->count = 0;
+        pthread_mutex_unlock(&mag->lock);
+    }
+    pthread_mutex_unlock(&magazines_lock);
+
+    readahead_stop();
+    dcache_destroy();
+    block_cache_destroy();
+    if (resident_blocks != NULL) {
+        if (block_device != NULL) {
+            resident_blocks_flush();
+        }
+        free(resident_blocks);
+        resident_blocks = NULL;
+    }
+    block_device_close(block_device);
+    block_device = NULL;
+    block_pools_destroy();
+    for (size_t i = 0; inode_locks != NULL && !inode_locks_zeroed &&
+                       i < INODE_TABLE_SIZE;
+         i++) {
+        pthread_rwlock_destroy(&inode_locks[i].rwlock);
+    }
+    if (image != NULL) {
+        // The tables live in the image, whose committed changes are written
+        // to the file before unmapping (emptying the journal); file data is
+        // already there
+        superblock_t layout;
+        image_layout(&layout);
+        journal_close();
+        munmap(image, layout.sb_size);
+        close(image_fd);
+        image = NULL;
+        image_fd = -1;
+    } else {
+        table_free(inode_table, INODE_TABLE_SIZE * sizeof(inode_t));
+        free(inode_bitmap);
+        free(inode_full_words);
+        if (fs_data != NULL) {
+            munmap(fs_data, fs_data_size);
+        }
+        free(block_bitmap);
+    }
+    free(inode_free_stack);
+    for (size_t i = 0; open_file_segments != NULL &&
+                       i < open_file_segment_count; i++) {
+        open_file_segment_free(atomic_load(&open_file_segments[i]));
+    }
+    free(open_file_segments);
+    for (size_t i = 0; write_buffers != NULL && i < INODE_TABLE_SIZE; i++) {
+        free(write_buffers[i].wb_data); // unflushed data is lost
+    }
+    free(write_buffers);
+    free(inode_refs);
+    table_free(inode_locks, INODE_TABLE_SIZE * sizeof(padded_rwlock_t));
+
+    inode_table = NULL;
+    inode_bitmap = NULL;
+    inode_full_words = NULL;
+    inode_free_stack = NULL;
+    fs_data = NULL;
+    fs_data_size = 0;
+    block_bitmap = NULL;
+    open_file_segments = NULL;
+    write_buffers = NULL;
+    inode_refs = NULL;
+    inode_locks = NULL;
+
+    return 0;
+}
+
+/**
+ * Mark an inode as taken in the inode bitmap, keeping the summary of full
+ * bitmap words up to date. Must be called with inode_bitmap_lock held.
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+static void inode_bitmap_take(int inumber) {
+    size_t word = (size_t)inumber / 64;
+
+    inode_bitmap[word] |= UINT64_C(1) << (inumber % 64);
+    journal_log(&inode_bitmap[word], sizeof(uint64_t));
+    if (inode_bitmap[word] == ~UINT64_C(0)) {
+        inode_full_words[word / 64] |= UINT64_C(1) << (word % 64);
+    }
+}
+
+/**
+ * (Try to) Allocate a new inode in the inode table, without initializing its
+ * data. Must be called with inode_bitmap_lock held.
+ *
+ * Recently freed inodes are reused first (they are likely still in cache);
+ * otherwise the first free inode is found through the bitmap, starting at the
+ * first bitmap word known to have room, so the cost does not depend on the
+ * number of live inodes.
+ *
+ * Input:
+ *   - delay: set if the storage latency is due (to be paid once the lock is
+ *     released)
+ *
+ * Returns the inumber of the newly allocated inode, or -1 in the case of error.
+ *
+ * Possible errors:
+ *   - No free slots in inode table.
+ */
+static int inode_alloc_locked(bool *delay) {
+    // simulate storage access delay (to inode_bitmap)
+    if (storage_access_deferred(CACHE_INODE_BITMAP,
+                                BITMAP_BLOCK(inode_search_hint * 64), 1)) {
+        *delay = true;
+    }
+
+    while (inode_free_stack_top > 0) {
+        int inumber = inode_free_stack[--inode_free_stack_top];
+
+        // The bitmap search may have handed it out in the meantime
+        if (!(inode_bitmap[inumber / 64] & (UINT64_C(1) << (inumber % 64)))) {
+            inode_bitmap_take(inumber);
+            return inumber;
+        }
+    }
+
+    for (size_t i = inode_search_hint; i < INODE_FULL_WORDS; i++) {
+        if (inode_full_words[i] == ~UINT64_C(0)) {
+            continue;
+        }
+
+        size_t word = i * 64 + (size_t)__builtin_ctzll(~inode_full_words[i]);
+        size_t bit = (size_t)__builtin_ctzll(~inode_bitmap[word]);
+        int inumber = (int)(word * 64 + bit);
+
+        inode_bitmap_take(inumber);
+        inode_search_hint = i;
+        return inumber;
+    }
+    inode_search_hint = INODE_FULL_WORDS;
+
+    // no free inodes
+    return -1;
+}
+
+/**
+ * (Try to) Allocate a new inode in the inode table, without initializing its
+ * data (see inode_alloc_locked).
+ *
+ * Returns the inumber of the newly allocated inode, or -1 in the case of error.
+ */
+static int inode_alloc(void) {
+    bool delay = false;
+    allocator_lock(&inode_bitmap_lock.mutex, &inode_bitmap_lock.counters);
+    int inumber = inode_alloc_locked(&delay);
+    pthread_mutex_unlock(&inode_bitmap_lock.mutex);
+    if (delay) {
+        insert_delay();
+    }
+    return inumber;
+}
+
+/**
+ * Give an inode back to the inode bitmap, remembering it for quick reuse.
+ * Must be called with inode_bitmap_lock held.
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+static void inode_dealloc_locked(int inumber) {
+    size_t word = (size_t)inumber / 64;
+
+    ALWAYS_ASSERT(inode_bitmap[word] & (UINT64_C(1) << (inumber % 64)),
+                  "inode_delete: inode already freed");
+
+    inode_bitmap[word] &= ~(UINT64_C(1) << (inumber % 64));
+    journal_log(&inode_bitmap[word], sizeof(uint64_t));
+    inode_full_words[word / 64] &= ~(UINT64_C(1) << (word % 64));
+    if (word / 64 < inode_search_hint) {
+        inode_search_hint = word / 64;
+    }
+
+    if (inode_free_stack_top < INODE_FREE_STACK_SIZE) {
+        inode_free_stack[inode_free_stack_top++] = inumber;
+    }
+}
+
+/**
+ * Give an inode back to the inode bitmap (see inode_dealloc_locked).
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+static void inode_dealloc(int inumber) {
+    allocator_lock(&inode_bitmap_lock.mutex, &inode_bitmap_lock.counters);
+    inode_dealloc_locked(inumber);
+    pthread_mutex_unlock(&inode_bitmap_lock.mutex);
+}
+
+/**
+ * Initialize a newly allocated inode (see inode_create).
+ *
+ * Input:
+ *   - inumber: inode's number
+ *   - i_type: the type of the node (file or directory or symbolic link)
+ *
+ * Returns inumber, or -1 in the case of error (in which case the inode is
+ * deleted).
+ */
+static int inode_init(int inumber, inode_type i_type) {
+    // No directory names the inode yet, but a lookup that found the inode it
+    // replaces (e.g., a directory removed since) may still reach it
+    inode_t *inode = &inode_table[inumber];
+    // simulate storage access delay (to inode)
+    storage_access(CACHE_INODE, (size_t)inumber, 1);
+    pthread_rwlock_wrlock(inode_lock(inode));
+
+    inode->i_node_type = i_type;
+    inode->i_size = 0;
+    inode->i_extent_count = 0;
+    inode->i_extent_block = -1;
+    atomic_store(&inode->i_pins, 0);
+    inode_locks[inumber].dying = false;
+    switch (i_type) {
+    case T_DIRECTORY: {
+        // Initializes directory (filling its block with empty entries, labeled
+        // with inumber==-1)
+        if (inode_grow(inode, BLOCK_SIZE) < BLOCK_SIZE) {
+            // run regular deletion process
+            inode_delete(inumber);
+            pthread_rwlock_unlock(inode_lock(inode));
+            return -1;
+        }
+
+        inode_table[inumber].i_size = BLOCK_SIZE;
+
+        void *block = data_block_get(inode->i_extents[0].e_block);
+        ALWAYS_ASSERT(block != NULL,
+                      "inode_create: data block freed while in use");
+
+        dir_init(block);
+        journal_log(block, BLOCK_SIZE);
+    } break;
+    case T_FILE:
+        // In case of a new file, simply sets its size to 0
+        inode_table[inumber].hl_count = 1;
+        break;
+    case SYM_LINK:
+        break;
+    default:
+        PANIC("inode_create: unknown file type");
+    }
+
+    inode_journal(inode);
+    pthread_rwlock_unlock(inode_lock(inode));
+    return inumber;
+}
+
+/**
+ * Create a new inode in the inode table.
+ *
+ * Allocates and initializes a new inode.
+ * Directories will have their data block allocated and initialized, with i_size
+ * set to BLOCK_SIZE. Regular files will not have any data block allocated
+ * (i_size and i_extent_count will be set to 0).
+ *
+ * Input:
+ *   - i_type: the type of the node (file or directory or symbolic link)
+ *
+ * Returns inumber of the new inode, or -1 in the case of error.
+ *
+ * Possible errors:
+ *   - No free slots in inode table.
+ *   - (if creating a directory) No free data blocks.
+ */
+int inode_create(inode_type i_type) {
+
+    int inumber = inode_alloc();
+    if (inumber == -1) {
+        return -1; // no free slots in inode table
+    }
+
+    return inode_init(inumber, i_type);
+}
+
+/**
+ * Create several inodes of the same type at once, taking the inode bitmap
+ * lock a single time.
+ *
+ * Input:
+ *   - i_type: the type of the new inodes
+ *   - inumbers: where to store the inumbers of the new inodes
+ *   - count: number of inodes to create
+ *
+ * Returns 0 if successful, -1 otherwise (in which case no inode is created).
+ *
+ * Possible errors:
+ *   - Not enough free slots in inode table.
+ *   - (if creating directories) Not enough free data blocks.
+ */
+int inode_create_many(inode_type i_type, int *inumbers, size_t count) {
+    bool delay = false;
+    allocator_lock(&inode_bitmap_lock.mutex, &inode_bitmap_lock.counters);
+    for (size_t i = 0; i < count; i++) {
+        inumbers[i] = inode_alloc_locked(&delay);
+        if (inumbers[i] == -1) {
+            while (i > 0) {
+                inode_dealloc_locked(inumbers[--i]);
+            }
+            pthread_mutex_unlock(&inode_bitmap_lock.mutex);
+            return -1; // no free slots in inode table
+        }
+    }
+    pthread_mutex_unlock(&inode_bitmap_lock.mutex);
+    if (delay) {
+        insert_delay();
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (inode_init(inumbers[i], i_type) == -1) {
+            // inode_init already deleted the one that failed; the ones before
+            // it are deleted as usual, the ones after it were never set up
+            for (size_t j = 0; j < i; j++) {
+                inode_delete(inumbers[j]);
+            }
+            for (size_t j = i + 1; j < count; j++) {
+                inode_dealloc(inumbers[j]);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Delete an inode.
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+void inode_delete(int inumber) {
+    // simulate storage access delay (to inode and inode_bitmap)
+    storage_access(CACHE_INODE, (size_t)inumber, 1);
+    storage_access(CACHE_INODE_BITMAP, BITMAP_BLOCK(inumber / 64), 1);
+
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_delete: invalid inumber");
+
+    ALWAYS_ASSERT(!isFreeInode(inumber), "inode_delete: inode already freed");
+
+    inode_truncate(&inode_table[inumber]);
+
+    inode_dealloc(inumber);
+}
+
+/**
+ * Obtain a pointer to an inode from its inumber.
+ *
+ * Input:
+ *   - inumber: inode's number
+ *
+ * Returns pointer to inode.
+ */
+inode_t *inode_get(int inumber) {
+
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_get: invalid inumber");
+
+    // simulate storage access delay to inode (unless it is pinned in memory)
+    if (atomic_load_explicit(&inode_refs[inumber], memory_order_relaxed) ==
+        0) {
+        storage_access(CACHE_INODE, (size_t)inumber, 1);
+    }
+    return &inode_table[inumber];
+}
+
+/**
+ * Obtain the read-write lock of an inode.
+ *
+ * Input:
+ *   - inode: the inode
+ *
+ * Returns pointer to the lock.
+ */
+pthread_rwlock_t *inode_lock(inode_t const *inode) {
+    return &inode_locks[inode - inode_table].rwlock;
+}
+
+/**
+ * Obtain a pointer to an inode from its inumber, taking a reference to it:
+ * until the reference is dropped (see inode_release), the inode stays in the
+ * buffer cache and inode_get serves it without any storage delay. References
+ * do not keep the inode from being deleted.
+ *
+ * Input:
+ *   - inumber: inode's number
+ *
+ * Returns pointer to inode.
+ */
+inode_t *inode_acquire(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_acquire: invalid inumber");
+
+    // Every reference pins the inode (the cache counts pins), so that a
+    // release racing with another thread's first acquire never leaves the
+    // cache entry pinned, or unpinned, for good
+    bool cached = block_cache_pin(CACHE_INODE, (size_t)inumber);
+    if (atomic_fetch_add(&inode_refs[inumber], 1) == 0 && !cached) {
+        insert_delay(); // first reference to an inode that was not cached
+    }
+    return &inode_table[inumber];
+}
+
+/**
+ * Drop a reference taken with inode_acquire.
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+void inode_release(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_release: invalid inumber");
+
+    unsigned refs = atomic_fetch_sub(&inode_refs[inumber], 1);
+    ALWAYS_ASSERT(refs > 0, "inode_release: inode not acquired");
+    block_cache_unpin(CACHE_INODE, (size_t)inumber);
+}
+
+/**
+ * Record the persistent fields of an inode in the calling thread's journal
+ * transaction (see journal_log). Must be called after changing them, with the
+ * inode still locked.
+ *
+ * Input:
+ *   - inode: the inode
+ */
+void inode_journal(inode_t const *inode) {
+    // The pins that follow are not persistent
+    journal_log(inode, offsetof(inode_t, i_pins));
+}
+
+/**
+ * Pin an inode, so that its data blocks are neither freed nor reused until it
+ * is unpinned. Unlinking a pinned inode defers its deletion to the last unpin.
+ *
+ * Input:
+ *   - inode: the inode (locked by the caller)
+ */
+void inode_pin(inode_t *inode) {
+    atomic_fetch_add_explicit(&inode->i_pins, 1, memory_order_relaxed);
+}
+
+/**
+ * Drop a pin on an inode, deleting it if it was the last pin of an inode
+ * with no links left.
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+void inode_unpin(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_unpin: invalid inumber");
+
+    unsigned pins = atomic_fetch_sub_explicit(&inode_table[inumber].i_pins, 1,
+                                              memory_order_acq_rel);
+    ALWAYS_ASSERT((pins & ~INODE_ORPHAN) != 0,
+                  "inode_unpin: inode is not pinned");
+    if (pins == (INODE_ORPHAN | 1)) {
+        inode_delete(inumber);
+    }
+}
+
+/**
+ * Check whether an inode is pinned.
+ *
+ * Input:
+ *   - inode: the inode (locked by the caller)
+ */
+bool inode_pinned(inode_t const *inode) {
+    return (atomic_load(&inode->i_pins) & ~INODE_ORPHAN) != 0;
+}
+
+/**
+ * Delete an inode whose last link is gone, or, if it is pinned, leave it to
+ * be deleted by its last unpin.
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+void inode_orphan(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_orphan: invalid inumber");
+
+    unsigned pins = atomic_fetch_or_explicit(&inode_table[inumber].i_pins,
+                                             INODE_ORPHAN,
+                                             memory_order_acq_rel);
+    if (pins == 0) {
+        inode_delete(inumber);
+    }
+}
+
+/**
+ * Store the target of a symbolic link: in the inode itself, in place of its
+ * extents, if it fits there, or in a data block otherwise.
+ *
+ * Input:
+ *   - inode: the symbolic link's inode (write-locked by the caller, and
+ *     holding no target yet)
+ *   - target: the path the link points to
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - target is empty, or longer than MAX_SYMLINK_TARGET - 1 bytes or than a
+ *     data block.
+ *   - No free data blocks.
+ */
+int inode_symlink_set(inode_t *inode, char const *target) {
+    ALWAYS_ASSERT(inode->i_node_type == SYM_LINK && inode->i_size == 0,
+                  "inode_symlink_set: not an empty symbolic link");
+
+    size_t len = strnlen(target, MAX_SYMLINK_TARGET);
+    if (len == 0 || len == MAX_SYMLINK_TARGET || len > BLOCK_SIZE) {
+        return -1;
+    }
+
+    if (len <= sizeof(inode->i_symlink)) {
+        memcpy(inode->i_symlink, target, len);
+    } else {
+        if (inode_grow(inode, len) < len) {
+            return -1; // no space
+        }
+        void *block = data_block_get(inode->i_extents[0].e_block);
+        memcpy(block, target, len);
+        journal_log(block, len);
+    }
+    inode->i_size = len;
+    inode_journal(inode);
+    return 0;
+}
+
+/**
+ * Obtain the target of a symbolic link.
+ *
+ * Input:
+ *   - inode: the symbolic link's inode (locked by the caller)
+ *   - target: where to store the target, null-terminated (MAX_SYMLINK_TARGET
+ *     bytes)
+ *
+ * Returns the length of the target.
+ */
+size_t inode_symlink_get(inode_t const *inode, char *target) {
+    ALWAYS_ASSERT(inode->i_node_type == SYM_LINK,
+                  "inode_symlink_get: not a symbolic link");
+
+    size_t len = inode->i_size;
+    if (inode->i_extent_count == 0) {
+        memcpy(target, inode->i_symlink, len);
+    } else {
+        void const *block = data_block_get(inode->i_extents[0].e_block);
+        memcpy(target, block, len);
+    }
+    target[len] = '\0';
+    return len;
+}
+
+/**
+ * Check whether an inode is a directory whose entries can be used: neither
+ * being removed (see dir_set_dying) nor deleted. Must be called with the
+ * directory's lock held.
+ *
+ * Input:
+ *   - inode: the inode
+ */
+static bool dir_usable(inode_t const *inode) {
+    return inode->i_node_type == T_DIRECTORY && inode->i_extent_count > 0 &&
+           !inode_locks[inode - inode_table].dying;
+}
+
+/**
+ * Clear the directory entry associated with a sub file.
+ *
+ * The last entry of the directory is moved into the freed position, so that
+ * entries stay packed.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - sub_name: sub file name
+ *   - sub_inumber: inumber the entry is expected to hold
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode.
+ *   - Directory does not contain an entry for sub_name.
+ *   - The entry holds another inumber (the name was removed and reused since
+ *     it was looked up).
+ */
+int clear_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber) {
+    storage_access(CACHE_INODE, (size_t)(inode - inode_table), 1);
+
+    // The directory's block is only looked up once it is locked (a directory
+    // removed meanwhile has none)
+    pthread_rwlock_wrlock(inode_lock(inode));
+    if (!dir_usable(inode)) {
+        pthread_rwlock_unlock(inode_lock(inode));
+        return -1; // not a directory (any longer)
+    }
+
+    // Locates the block containing the entries of the directory
+    void *block = data_block_get(inode->i_extents[0].e_block);
+    ALWAYS_ASSERT(block != NULL,
+                  "clear_dir_entry: directory must have a data block");
+    dir_entry_t *entries = dir_entries(block);
+    int32_t *slots = dir_slots(block);
+
+    long slot = dir_probe(block, sub_name, NULL);
+    if (slot == -1 || entries[slots[slot] - 1].d_inumber != sub_inumber) {
+        pthread_rwlock_unlock(inode_lock(inode));
+        return -1; // sub_name not found (or no longer the same file)
+    }
+
+    int32_t victim = slots[slot] - 1;
+    int32_t last = dir_header(block)->d_count - 1;
+    slots[slot] = DIR_SLOT_DELETED;
+    dcache_invalidate((int)(inode - inode_table), sub_name);
+
+    if (victim != last) {
+        long moved = dir_probe(block, entries[last].d_name, NULL);
+        ALWAYS_ASSERT(moved != -1, "clear_dir_entry: corrupted directory index");
+        entries[victim] = entries[last];
+        slots[moved] = victim + 1;
+    }
+    entries[last].d_inumber = -1;
+    memset(entries[last].d_name, 0, MAX_FILE_NAME);
+
+    if (--dir_header(block)->d_count == 0) {
+        // nothing left to find, so tombstones can go
+        for (size_t i = 0; i < dir_slot_count; i++) {
+            slots[i] = DIR_SLOT_EMPTY;
+        }
+    }
+    journal_log(block, BLOCK_SIZE);
+    pthread_rwlock_unlock(inode_lock(inode));
+    return 0;
+}
+
+/**
+ * Store the inumber for a sub file in a directory.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - sub_name: sub file name
+ *   - sub_inumber: inumber of the sub inode
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode.
+ *   - sub_name is not a valid file name (length 0 or > MAX_FILE_NAME - 1).
+ *   - Directory already has an entry named sub_name.
+ *   - Directory is already full of entries.
+ */
+int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber) {
+    return add_dir_entries(inode, &sub_name, &sub_inumber, 1) == 1 ? 0 : -1;
+}
+
+/**
+ * Store the inumbers of several sub files in a directory, taking the
+ * directory's lock a single time.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - sub_names: sub file names
+ *   - sub_inumbers: inumbers of the sub inodes
+ *   - count: number of entries to store
+ *
+ * Returns the number of entries stored: entries are stored in order, stopping
+ * at the first one that cannot be (see add_dir_entry for the possible
+ * errors).
+ */
+size_t add_dir_entries(inode_t *inode, char const *const *sub_names,
+                       int const *sub_inumbers, size_t count) {
+    // simulate storage access delay to inode with inumber
+    storage_access(CACHE_INODE, (size_t)(inode - inode_table), 1);
+
+    // A directory being removed takes no new entries (nor does one removed
+    // while waiting for the lock, whose blocks are gone)
+    pthread_rwlock_wrlock(inode_lock(inode));
+    if (!dir_usable(inode)) {
+        pthread_rwlock_unlock(inode_lock(inode));
+        return 0; // not a directory (any longer)
+    }
+
+    // Locates the block containing the entries of the directory
+    void *block = data_block_get(inode->i_extents[0].e_block);
+    ALWAYS_ASSERT(block != NULL,
+                  "add_dir_entries: directory must have a data block");
+
+    size_t added = 0;
+    for (; added < count; added++) {
+        char const *sub_name = sub_names[added];
+        if (strlen(sub_name) == 0 || strlen(sub_name) > MAX_FILE_NAME - 1) {
+            break; // invalid sub_name
+        }
+
+        long slot;
+        if (dir_probe(block, sub_name, &slot) != -1) {
+            break; // name already taken
+        }
+        if (slot == -1 || dir_header(block)->d_count == MAX_DIR_ENTRIES) {
+            break; // no space for entry
+        }
+
+        // Fills the first unused entry
+        int32_t i = dir_header(block)->d_count++;
+        dir_entry_t *entry = &dir_entries(block)[i];
+        entry->d_inumber = sub_inumbers[added];
+        strncpy(entry->d_name, sub_name, MAX_FILE_NAME - 1);
+        entry->d_name[MAX_FILE_NAME - 1] = '\0';
+        dir_slots(block)[slot] = i + 1;
+
+        journal_log(entry, sizeof(*entry));
+        journal_log(&dir_slots(block)[slot], sizeof(int32_t));
+    }
+    if (added > 0) {
+        journal_log(dir_header(block), sizeof(dir_header_t));
+    }
+
+    pthread_rwlock_unlock(inode_lock(inode));
+    return added;
+}
+
+/**
+ * Mark a directory as dying (being removed), so that no entries can be added
+ * to it from then on, or clear that mark. Must be called with the directory's
+ * write lock held, which should be kept until the directory is deleted.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - dying: true to mark the directory, false to clear the mark
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode.
+ *   - Marking a directory that is not empty (or already dying).
+ */
+int dir_set_dying(inode_t *inode, bool dying) {
+    if (inode->i_node_type != T_DIRECTORY) {
+        return -1;
+    }
+
+    bool *flag = &inode_locks[inode - inode_table].dying;
+    if (dying) {
+        void *block = data_block_get(inode->i_extents[0].e_block);
+        ALWAYS_ASSERT(block != NULL,
+                      "dir_set_dying: directory must have a data block");
+        if (*flag || dir_header(block)->d_count != 0) {
+            return -1;
+        }
+    }
+    *flag = dying;
+    return 0;
+}
+
+/**
+ * Obtain the inumber for a sub file inside a directory.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - sub_name: sub file name
+ *
+ * Returns inumber linked to the target name, -1 if errors occur.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode.
+ *   - Directory does not contain a file named sub_name.
+ */
+int find_in_dir(inode_t const *inode, char const *sub_name) {
+
+    ALWAYS_ASSERT(inode != NULL, "find_in_dir: inode must be non-NULL");
+    ALWAYS_ASSERT(sub_name != NULL, "find_in_dir: sub_name must be non-NULL");
+
+    // simulate storage access delay to inode with inumber
+    storage_access(CACHE_INODE, (size_t)(inode - inode_table), 1);
+
+    // The directory's block is only looked up once it is locked: the inumber
+    // may come from a lookup made before the directory was removed
+    pthread_rwlock_rdlock(inode_lock(inode));
+    if (!dir_usable(inode)) {
+        pthread_rwlock_unlock(inode_lock(inode));
+        return -1; // not a directory (any longer)
+    }
+
+    // Locates the block containing the entries of the directory
+    void *block = data_block_get(inode->i_extents[0].e_block);
+    ALWAYS_ASSERT(block != NULL,
+                  "find_in_dir: directory inode must have a data block");
+
+    int sub_inumber = -1; // entry not found
+    long slot = dir_probe(block, sub_name, NULL);
+    if (slot != -1) {
+        sub_inumber = dir_entries(block)[dir_slots(block)[slot] - 1].d_inumber;
+    }
+    pthread_rwlock_unlock(inode_lock(inode));
+    return sub_inumber;
+}
+
+/**
+ * Obtain the next extent of an inode.
+ *
+ * Input:
+ *   - cursor: the position in the inode's extents (see EXTENT_CURSOR)
+ *
+ * Returns a pointer to the extent, or NULL past the last one.
+ */
+static extent_t *extent_next(extent_cursor_t *cursor) {
+    inode_t const *inode = cursor->inode;
+    size_t i = cursor->next;
+    if (i == inode->i_extent_count) {
+        return NULL;
+    }
+    cursor->next++;
+    if (i < INODE_INLINE_EXTENTS) {
+        return (extent_t *)&inode->i_extents[i];
+    }
+
+    size_t k = (i - INODE_INLINE_EXTENTS) % OVERFLOW_EXTENTS;
+    if (k == 0) {
+        int block = i == INODE_INLINE_EXTENTS
+                        ? inode->i_extent_block
+                        : cursor->block[OVERFLOW_EXTENTS].e_block;
+        cursor->block = data_block_get(block);
+    }
+    return &cursor->block[k];
+}
+
+/**
+ * Find the block that follows an overflow extent block in its chain.
+ *
+ * Input:
+ *   - block: the overflow extent block
+ *
+ * Returns the next block, or -1 if it is the last one.
+ */
+static int overflow_block_next(int block) {
+    extent_t const *extents = data_block_get(block);
+    return extents[OVERFLOW_EXTENTS].e_block;
+}
+
+/**
+ * Count the overflow extent blocks needed to hold a number of extents.
+ */
+static size_t overflow_blocks(size_t extents) {
+    if (extents <= INODE_INLINE_EXTENTS) {
+        return 0;
+    }
+    return (extents - INODE_INLINE_EXTENTS + OVERFLOW_EXTENTS - 1) /
+           OVERFLOW_EXTENTS;
+}
+
+/**
+ * Make sure an inode holds enough data blocks for a given size.
+ *
+ * New blocks extend the last extent whenever they are physically adjacent to
+ * it (magazines hand out ascending runs of blocks, so this is the common case);
+ * otherwise a new extent is started (in the overflow extent blocks once the
+ * inline extents are exhausted, chaining another one whenever the last is
+ * full).
+ *
+ * Input:
+ *   - inode: the inode (write-locked by the caller)
+ *   - size: the size (in bytes) the inode must be able to hold
+ *   - claimed: blocks claimed by the caller, allocated in contiguous runs and
+ *     decremented accordingly (NULL to allocate blocks one at a time)
+ *
+ * Returns the number of bytes the inode can hold afterwards, which is lower
+ * than size if the data blocks ran out.
+ */
+static size_t inode_grow_claimed(inode_t *inode, size_t size,
+                                 size_t *claimed) {
+    size_t want = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t have = 0;
+    extent_cursor_t cursor = EXTENT_CURSOR(inode);
+    extent_t *last = NULL;
+    for (extent_t *e; (e = extent_next(&cursor)) != NULL; last = e) {
+        have += (size_t)e->e_length;
+    }
+    extent_t *tail = cursor.block; // overflow block holding the last extent
+    bool grown = false;
+
+    while (have < want) {
+        int b;
+        size_t n = 1;
+        if (claimed != NULL && *claimed > 0) {
+            n = data_block_alloc_run(want - have, claimed, &b);
+        } else {
+            b = data_block_alloc();
+        }
+        if (n == 0 || b == -1) {
+            break; // no space
+        }
+
+        if (last != NULL && b == last->e_block + last->e_length) {
+            last->e_length += (int)n;
+        } else {
+            size_t i = inode->i_extent_count;
+            if (i >= INODE_INLINE_EXTENTS &&
+                (i - INODE_INLINE_EXTENTS) % OVERFLOW_EXTENTS == 0) {
+                // The last overflow block (if any) is full: chain another
+                int eb = -1;
+                if (claimed != NULL && *claimed > 0) {
+                    data_block_alloc_run(1, claimed, &eb);
+                } else {
+                    eb = data_block_alloc();
+                }
+                if (eb == -1) {
+                    for (size_t k = 0; k < n; k++) {
+                        data_block_free(b + (int)k);
+                    }
+                    break; // no space for the overflow block
+                }
+                extent_t *fresh = data_block_get(eb);
+                fresh[OVERFLOW_EXTENTS].e_block = -1;
+                if (tail == NULL) {
+                    inode->i_extent_block = eb;
+                } else {
+                    tail[OVERFLOW_EXTENTS].e_block = eb;
+                    journal_log(tail, BLOCK_SIZE);
+                }
+                tail = fresh;
+            }
+
+            last = i < INODE_INLINE_EXTENTS
+                       ? &inode->i_extents[i]
+                       : &tail[(i - INODE_INLINE_EXTENTS) % OVERFLOW_EXTENTS];
+            last->e_block = b;
+            last->e_length = (int)n;
+            inode->i_extent_count++;
+        }
+        have += n;
+        grown = true;
+    }
+
+    if (grown) {
+        inode_journal(inode);
+        if (tail != NULL) {
+            journal_log(tail, BLOCK_SIZE);
+        }
+    }
+    return have * BLOCK_SIZE;
+}
+
+/**
+ * Make sure an inode holds enough data blocks for a given size (see
+ * inode_grow_claimed).
+ *
+ * Input:
+ *   - inode: the inode (write-locked by the caller)
+ *   - size: the size (in bytes) the inode must be able to hold
+ *
+ * Returns the number of bytes the inode can hold afterwards.
+ */
+size_t inode_grow(inode_t *inode, size_t size) {
+    return inode_grow_claimed(inode, size, NULL);
+}
+
+/**
+ * Release every data block of an inode (including its overflow extent blocks)
+ * and set its size to 0.
+ *
+ * Input:
+ *   - inode: the inode (write-locked by the caller)
+ */
+void inode_truncate(inode_t *inode) {
+    inode_writeback_discard(inode);
+
+    extent_cursor_t cursor = EXTENT_CURSOR(inode);
+    extent_t const *e;
+    while ((e = extent_next(&cursor)) != NULL) {
+        for (int b = 0; b < e->e_length; b++) {
+            data_block_free(e->e_block + b);
+        }
+    }
+    for (int b = inode->i_extent_block; b != -1;) {
+        int next = overflow_block_next(b);
+        data_block_free(b);
+        b = next;
+    }
+
+    inode->i_extent_count = 0;
+    inode->i_extent_block = -1;
+    inode->i_size = 0;
+    inode_journal(inode);
+}
+
+/**
+ * Obtain the size of a file, including the data still in its write-back
+ * buffer.
+ *
+ * Input:
+ *   - inode: the inode (locked by the caller)
+ */
+size_t inode_size(inode_t const *inode) {
+    if (write_buffers == NULL) {
+        return inode->i_size;
+    }
+    return inode->i_size + write_buffers[inode - inode_table].wb_len;
+}
+
+/**
+ * Count the data blocks a file needs to grow past its i_size by a given
+ * number of bytes.
+ *
+ * Input:
+ *   - inode: the inode (locked by the caller)
+ *   - len: number of bytes past i_size
+ */
+static size_t writeback_blocks(inode_t const *inode, size_t len) {
+    size_t end = inode->i_size + len;
+    return (end + BLOCK_SIZE - 1) / BLOCK_SIZE -
+           (inode->i_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+/**
+ * Append data to the write-back buffer of an inode, flushing the buffer first
+ * if the data does not fit. The data must start at the end of the file.
+ *
+ * Input:
+ *   - inode: the inode (write-locked by the caller)
+ *   - iov: the buffers to append
+ *   - iovcnt: number of buffers
+ *   - len: total length of the buffers
+ *
+ * Returns 0 if the data was buffered, -1 if it must be written through
+ * (write-back disabled, data larger than the buffer, or not enough free data
+ * blocks to reserve).
+ */
+int inode_writeback_append(inode_t *inode, struct iovec const *iov,
+                           size_t iovcnt, size_t len) {
+    if (write_buffers == NULL || len > fs_params.writeback_size) {
+        return -1;
+    }
+    write_buffer_t *wb = &write_buffers[inode - inode_table];
+    if (wb->wb_len + len > fs_params.writeback_size &&
+        inode_writeback_flush(inode, false) == -1) {
+        return -1;
+    }
+
+    // Reserve every block the flush will allocate: in the worst case, every
+    // new block starts an extent of its own, and the overflow extent blocks
+    // those extents need come on top
+    size_t blocks = writeback_blocks(inode, wb->wb_len + len);
+    size_t needed = blocks + overflow_blocks(inode->i_extent_count + blocks) -
+                    overflow_blocks(inode->i_extent_count);
+    if (needed > wb->wb_reserved) {
+        if (!data_blocks_claim(needed - wb->wb_reserved)) {
+            return -1;
+        }
+        wb->wb_reserved = needed;
+    }
+
+    if (wb->wb_data == NULL) {
+        wb->wb_data = malloc(fs_params.writeback_size);
+        if (wb->wb_data == NULL) {
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_base == NULL) {
+            memset(wb->wb_data + wb->wb_len, 0, iov[i].iov_len);
+        } else {
+            memcpy(wb->wb_data + wb->wb_len, iov[i].iov_base, iov[i].iov_len);
+        }
+        wb->wb_len += iov[i].iov_len;
+    }
+    atomic_store(&wb->wb_dirty, true);
+    return 0;
+}
+
+/**
+ * Move the contents of the write-back buffer of an inode into its data
+ * blocks, allocating them in as few contiguous runs as possible.
+ *
+ * Input:
+ *   - inode: the inode (write-locked by the caller)
+ *   - release: true to also free the buffer's memory (e.g., once the file is
+ *     closed)
+ *
+ * Returns 0 if successful, -1 if the data blocks ran out (which the
+ * reservations made by inode_writeback_append rule out; the data
+ * that did not fit then stays in the buffer, even if asked to release it).
+ */
+int inode_writeback_flush(inode_t *inode, bool release) {
+    if (write_buffers == NULL) {
+        return 0;
+    }
+    write_buffer_t *wb = &write_buffers[inode - inode_table];
+
+    if (wb->wb_len > 0) {
+        size_t end = inode->i_size + wb->wb_len;
+        size_t capacity = inode_grow_claimed(inode, end, &wb->wb_reserved);
+        size_t n = capacity < end ? capacity - inode->i_size : wb->wb_len;
+        inode_data_write(inode, wb->wb_data, n, inode->i_size);
+        inode->i_size += n;
+        inode_journal(inode);
+        wb->wb_len -= n;
+        if (wb->wb_len > 0) {
+            // Keep what did not fit, and its reservation, for another try
+            memmove(wb->wb_data, wb->wb_data + n, wb->wb_len);
+            return -1;
+        }
+        atomic_store(&wb->wb_dirty, false);
+    }
+
+    data_blocks_unclaim(wb->wb_reserved);
+    wb->wb_reserved = 0;
+    if (release) {
+        free(wb->wb_data);
+        wb->wb_data = NULL;
+    }
+    return 0;
+}
+
+/**
+ * Check whether the write-back buffer of an inode holds data, without taking
+ * the inode's lock (an append racing with the check may not be seen).
+ *
+ * Input:
+ *   - inode: the inode
+ */
+bool inode_writeback_dirty(inode_t const *inode) {
+    return write_buffers != NULL &&
+           atomic_load(&write_buffers[inode - inode_table].wb_dirty);
+}
+
+/**
+ * Drop the contents of the write-back buffer of an inode (e.g., when the file
+ * is truncated).
+ *
+ * Input:
+ *   - inode: the inode (write-locked by the caller)
+ */
+static void inode_writeback_discard(inode_t const *inode) {
+    if (write_buffers == NULL) {
+        return;
+    }
+    write_buffer_t *wb = &write_buffers[inode - inode_table];
+    data_blocks_unclaim(wb->wb_reserved);
+    free(wb->wb_data);
+    wb->wb_data = NULL;
+    wb->wb_len = 0;
+    wb->wb_reserved = 0;
+    atomic_store(&wb->wb_dirty, false);
+}
+
+/**
+ * Flush the write-back buffer of every inode.
+ *
+ * Returns 0 if successful, -1 if some data did not fit in its file.
+ */
+int inode_writeback_flush_all(void) {
+    int result = 0;
+    for (size_t i = 0; write_buffers != NULL && i < INODE_TABLE_SIZE; i++) {
+        inode_t *inode = &inode_table[i];
+        if (!inode_writeback_dirty(inode)) {
+            continue;
+        }
+        pthread_rwlock_wrlock(inode_lock(inode));
+        if (inode_writeback_flush(inode, true) == -1) {
+            result = -1;
+        }
+        pthread_rwlock_unlock(inode_lock(inode));
+    }
+    return result;
+}
+
+/**
+ * Read data from the write-back buffer of an inode.
+ *
+ * Input:
+ *   - inode: the inode (locked by the caller)
+ *   - iov: the buffers to read into
+ *   - iovcnt: number of buffers
+ *   - skip: bytes at the start of the buffers to leave alone
+ *   - len: maximum number of bytes to read
+ *   - offset: offset within the file (at least i_size)
+ *
+ * Returns the number of bytes read.
+ */
+size_t inode_writeback_read(inode_t const *inode, struct iovec const *iov,
+                            size_t iovcnt, size_t skip, size_t len,
+                            size_t offset) {
+    if (write_buffers == NULL || offset >= inode_size(inode)) {
+        return 0;
+    }
+    write_buffer_t const *wb = &write_buffers[inode - inode_table];
+    char const *data = wb->wb_data + (offset - inode->i_size);
+    if (len > inode_size(inode) - offset) {
+        len = inode_size(inode) - offset;
+    }
+
+    size_t done = 0;
+    for (size_t i = 0; i < iovcnt && done < len; i++) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        size_t n = iov[i].iov_len - skip;
+        if (n > len - done) {
+            n = len - done;
+        }
+        memcpy((char *)iov[i].iov_base + skip, data + done, n);
+        done += n;
+        skip = 0;
+    }
+    return done;
+}
+
+/**
+ * Queue the write of a block's in-memory copy (if it has one) to the device
+ * file, doing the queued writes once the batch is full.
+ *
+ * Input:
+ *   - requests: the batch
+ *   - count: number of writes queued in the batch
+ *   - block: the block number
+ *
+ * Returns 0 if successful, -1 if the writes of the batch failed.
+ */
+static int resident_block_queue(block_request_t *requests, size_t *count,
+                                int block) {
+    char *copy = atomic_load(&resident_blocks[block]);
+    if (copy != NULL) {
+        requests[(*count)++] =
+            (block_request_t){.r_op = BLOCK_WRITE,
+                              .r_offset = (size_t)block * BLOCK_SIZE,
+                              .r_buffer = copy,
+                              .r_len = BLOCK_SIZE};
+    }
+    if (*count < BLOCK_DEVICE_BATCH) {
+        return 0;
+    }
+    *count = 0;
+    return block_device_io(block_device, requests, BLOCK_DEVICE_BATCH) == -1
+               ? -1
+               : 0;
+}
+
+/**
+ * Write the in-memory copies of an inode's blocks (its overflow extent
+ * blocks, and the blocks of a directory) to the device file.
+ *
+ * Input:
+ *   - inode: the inode (locked by the caller)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int inode_resident_write(inode_t const *inode) {
+    block_request_t requests[BLOCK_DEVICE_BATCH];
+    size_t count = 0;
+    int result = 0;
+
+    extent_cursor_t cursor = EXTENT_CURSOR(inode);
+    extent_t const *e;
+    while ((e = extent_next(&cursor)) != NULL) {
+        for (int b = e->e_block; b < e->e_block + e->e_length; b++) {
+            if (resident_block_queue(requests, &count, b) == -1) {
+                result = -1;
+            }
+        }
+    }
+    for (int b = inode->i_extent_block; b != -1;
+         b = overflow_block_next(b)) {
+        if (resident_block_queue(requests, &count, b) == -1) {
+            result = -1;
+        }
+    }
+    if (count > 0 && block_device_io(block_device, requests, count) == -1) {
+        result = -1;
+    }
+    return result;
+}
+
+/**
+ * Write the data blocks of an inode back to the device file (along with the
+ * blocks kept in memory), or the image file (where they were written through
+ * already), waiting for them to reach storage. Does nothing if the state is
+ * only kept in memory.
+ *
+ * Input:
+ *   - inode: the inode (locked by the caller)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int inode_data_sync(inode_t const *inode) {
+    if (resident_blocks != NULL && inode_resident_write(inode) == -1) {
+        return -1;
+    }
+    return block_device_sync(block_device);
+}
+
+/**
+ * Read-ahead thread: brings the queued runs of blocks in, so that the
+ * sequential reads that follow find them in the buffer cache (or, with a
+ * device file, in the host's page cache).
+ *
+ * Runs of a device file are read into scratch buffers, each submitted before
+ * the one before it is waited for, so that the device always has the next
+ * run to work on.
+ */
+static void *readahead_worker(void *arg) {
+    (void)arg;
+    size_t buffer_size = fs_params.readahead_max_blocks * BLOCK_SIZE;
+    char *buffers[2] = {NULL, NULL};
+    size_t current = 0;
+    block_io_t *in_flight = NULL;
+
+    pthread_mutex_lock(&readahead.lock);
+    while (true) {
+        while (readahead.count == 0 && !readahead.stop) {
+            if (in_flight != NULL) {
+                // Nothing else to submit: complete the run in flight
+                pthread_mutex_unlock(&readahead.lock);
+                block_device_wait(in_flight);
+                in_flight = NULL;
+                pthread_mutex_lock(&readahead.lock);
+                continue;
+            }
+            pthread_cond_wait(&readahead.cond, &readahead.lock);
+        }
+        if (readahead.stop) {
+            break;
+        }
+        readahead_run_t run = readahead.runs[readahead.head];
+        readahead.head = (readahead.head + 1) % READAHEAD_QUEUE_SIZE;
+        readahead.count--;
+        pthread_mutex_unlock(&readahead.lock);
+
+        if (block_device_memory(block_device) != NULL) {
+            storage_access(CACHE_DATA_BLOCK, (size_t)run.rr_block,
+                           run.rr_count);
+        } else {
+            if (buffers[current] == NULL) {
+                buffers[current] = malloc(buffer_size);
+            }
+            if (buffers[current] != NULL) {
+                size_t run_len = run.rr_count * BLOCK_SIZE;
+                block_request_t request = {
+                    .r_op = BLOCK_READ,
+                    .r_offset = (size_t)run.rr_block * BLOCK_SIZE,
+                    .r_buffer = buffers[current],
+                    .r_len = run_len < buffer_size ? run_len : buffer_size};
+                block_io_t *io = block_device_submit(block_device, &request, 1);
+                if (in_flight != NULL) {
+                    block_device_wait(in_flight);
+                }
+                in_flight = io;
+                current = 1 - current;
+            }
+        }
+
+        pthread_mutex_lock(&readahead.lock);
+    }
+    pthread_mutex_unlock(&readahead.lock);
+
+    if (in_flight != NULL) {
+        block_device_wait(in_flight);
+    }
+    free(buffers[0]);
+    free(buffers[1]);
+    return NULL;
+}
+
+/**
+ * Start the read-ahead thread.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int readahead_start(void) {
+    readahead.head = 0;
+    readahead.count = 0;
+    readahead.stop = false;
+    if (pthread_create(&readahead.thread, NULL, readahead_worker, NULL) != 0) {
+        return -1;
+    }
+    readahead.started = true;
+    return 0;
+}
+
+/**
+ * Queue the blocks of an inode that hold a range of the file for the
+ * read-ahead thread. Runs that do not fit in the queue are dropped: read-ahead
+ * is only a hint.
+ *
+ * Input:
+ *   - inode: the inode (locked by the caller)
+ *   - start: offset of the range within the file
+ *   - end: end of the range (at most the file's size)
+ *
+ * Returns the number of blocks queued.
+ */
+static size_t readahead_queue(inode_t const *inode, size_t start, size_t end) {
+    // The runs are found without the queue's lock, as walking the extents
+    // may read overflow extent blocks
+    readahead_run_t runs[READAHEAD_QUEUE_SIZE];
+    size_t run_count = 0;
+    extent_cursor_t cursor = EXTENT_CURSOR(inode);
+    size_t extent_start = 0; // file offset of the current extent
+    extent_t const *e;
+    while (extent_start < end && run_count < READAHEAD_QUEUE_SIZE &&
+           (e = extent_next(&cursor)) != NULL) {
+        size_t extent_end = extent_start + (size_t)e->e_length * BLOCK_SIZE;
+        if (extent_end > start) {
+            size_t from = start > extent_start ? start : extent_start;
+            size_t to = end < extent_end ? end : extent_end;
+            size_t first = (from - extent_start) / BLOCK_SIZE;
+            size_t last = (to - extent_start - 1) / BLOCK_SIZE;
+            runs[run_count++] = (readahead_run_t){
+                .rr_block = e->e_block + (int)first,
+                .rr_count = last - first + 1};
+        }
+        extent_start = extent_end;
+    }
+
+    size_t queued = 0;
+    pthread_mutex_lock(&readahead.lock);
+    for (size_t r = 0;
+         r < run_count && readahead.count < READAHEAD_QUEUE_SIZE; r++) {
+        readahead.runs[(readahead.head + readahead.count++) %
+                       READAHEAD_QUEUE_SIZE] = runs[r];
+        queued += runs[r].rr_count;
+    }
+    if (queued > 0) {
+        pthread_cond_signal(&readahead.cond);
+    }
+    pthread_mutex_unlock(&readahead.lock);
+    return queued;
+}
+
+/**
+ * Account for a read of an open file and, if the file is being read
+ * sequentially, prefetch the blocks that follow it in the background.
+ *
+ * The first sequential read prefetches READAHEAD_MIN_BLOCKS blocks past its
+ * end; from then on, once a read gets within half a window of the end of
+ * what was prefetched, the next window is prefetched and the window doubles,
+ * up to tfs_params.readahead_max_blocks. A read elsewhere starts over.
+ *
+ * Input:
+ *   - inode: the file's inode (read-locked by the caller)
+ *   - ra: the open file's read-ahead state (its handle locked by the caller)
+ *   - offset: offset of the read within the file
+ *   - len: length of the read
+ */
+void inode_readahead(inode_t const *inode, readahead_t *ra, size_t offset,
+                     size_t len) {
+    if (!readahead.started || len == 0) {
+        return;
+    }
+
+    size_t end = offset + len;
+    if (offset != ra->ra_next) {
+        // Not sequential: nothing was prefetched for this read
+        ra->ra_stats.rs_misses++;
+        ra->ra_next = end;
+        ra->ra_end = end;
+        ra->ra_window = 0;
+        return;
+    }
+
+    if (ra->ra_window > 0 && end <= ra->ra_end) {
+        ra->ra_stats.rs_hits++;
+    } else {
+        ra->ra_stats.rs_misses++;
+    }
+    ra->ra_next = end;
+    if (ra->ra_window == 0) {
+        ra->ra_window = READAHEAD_MIN_BLOCKS < fs_params.readahead_max_blocks
+                            ? READAHEAD_MIN_BLOCKS
+                            : fs_params.readahead_max_blocks;
+    }
+
+    size_t window_len = ra->ra_window * BLOCK_SIZE;
+    if (end + window_len / 2 < ra->ra_end) {
+        return; // enough already prefetched
+    }
+    size_t start = ra->ra_end > end ? ra->ra_end : end;
+    size_t stop = start + window_len;
+    if (stop > inode->i_size) {
+        stop = inode->i_size;
+    }
+    if (start >= stop) {
+        return;
+    }
+
+    ra->ra_stats.rs_prefetched += readahead_queue(inode, start, stop);
+    ra->ra_end = stop;
+    if (ra->ra_window * 2 <= fs_params.readahead_max_blocks) {
+        ra->ra_window *= 2;
+    } else {
+        ra->ra_window = fs_params.readahead_max_blocks;
+    }
+}
+
+// Source of the writes that zero the blocks of a device file
+static char const zero_buffer[65536];
+
+/**
+ * Submit a batch of transfers of inode_data_copy, then wait for the batch
+ * submitted before it, so that one batch is in flight while the next one is
+ * gathered.
+ *
+ * Input:
+ *   - requests: the transfers
+ *   - count: number of transfers
+ *   - in_flight: the batch in flight (NULL if none), replaced by this one
+ *   - in_flight_end: bytes copied once it completes, replaced by end
+ *   - end: bytes copied once this batch completes
+ *   - transferred: set to the bytes known to have been transferred
+ *
+ * Returns 0 if successful, -1 if a transfer failed (leaving nothing in
+ * flight).
+ */
+static int data_batch_submit(block_request_t const *requests, size_t count,
+                             block_io_t **in_flight, size_t *in_flight_end,
+                             size_t end, size_t *transferred) {
+    block_io_t *io = block_device_submit(block_device, requests, count);
+    if (*in_flight != NULL) {
+        if (block_device_wait(*in_flight) == -1) {
+            if (io != NULL) {
+                block_device_wait(io);
+            }
+            *in_flight = NULL;
+            return -1;
+        }
+        *transferred = *in_flight_end;
+    }
+    *in_flight = io;
+    *in_flight_end = end;
+    return io == NULL ? -1 : 0;
+}
+
+/**
+ * Copy data between a list of buffers and the data blocks of an inode, in a
+ * single pass over the inode's extents.
+ *
+ * Blocks of the same extent are contiguous on the device, so each extent
+ * costs a single storage access, and a single transfer per buffer it
+ * overlaps, regardless of its length.
+ *
+ * Input:
+ *   - inode: the inode (locked by the caller)
+ *   - iov: the buffers to copy from/to, in file order (a NULL iov_base
+ *     writes zeros)
+ *   - iovcnt: number of buffers
+ *   - len: maximum number of bytes to copy
+ *   - offset: offset within the file
+ *   - to_file: true to copy from the buffers into the file
+ *
+ * Returns the number of bytes copied (lower than len if the buffers are
+ * shorter, or if the inode does not hold enough blocks).
+ */
+static size_t inode_data_copy(inode_t const *inode, struct iovec const *iov,
+                              size_t iovcnt, size_t len, size_t offset,
+                              bool to_file) {
+    extent_cursor_t cursor = EXTENT_CURSOR(inode);
+    size_t done = 0;
+    size_t extent_start = 0; // file offset of the current extent
+    size_t v = 0;            // current buffer
+    size_t v_done = 0;       // bytes of the current buffer already copied
+
+    // Never copy past the end of the buffers, so that the part of each extent
+    // copied is known before going through the buffers
+    size_t room = 0;
+    for (size_t i = 0; i < iovcnt; i++) {
+        room += iov[i].iov_len;
+    }
+    if (len > room) {
+        len = room;
+    }
+
+    // done counts the bytes queued, and transferred the bytes known to have
+    // been transferred (see data_batch_submit)
+    block_request_t requests[BLOCK_DEVICE_BATCH];
+    size_t request_count = 0;
+    size_t transferred = 0;
+    block_io_t *in_flight = NULL;
+    size_t in_flight_end = 0;
+    bool mapped = block_device_memory(block_device) != NULL;
+
+    extent_t const *e;
+    while (done < len && (e = extent_next(&cursor)) != NULL) {
+        size_t extent_len = (size_t)e->e_length * BLOCK_SIZE;
+        if (offset + done >= extent_start + extent_len) {
+            extent_start += extent_len;
+            continue; // before the range copied
+        }
+
+        // The extent is resolved (and only the blocks actually touched go
+        // through the cache) once, however many buffers it is copied from
+        size_t skip = offset + done - extent_start;
+        size_t end = offset + len - extent_start;
+        if (end > extent_len) {
+            end = extent_len;
+        }
+        if (mapped) {
+            storage_access(CACHE_DATA_BLOCK,
+                           (size_t)e->e_block + skip / BLOCK_SIZE,
+                           (end - 1) / BLOCK_SIZE - skip / BLOCK_SIZE + 1);
+        }
+
+        while (skip < end) {
+            while (v_done == iov[v].iov_len) {
+                v++;
+                v_done = 0;
+            }
+            size_t n = end - skip;
+            if (n > iov[v].iov_len - v_done) {
+                n = iov[v].iov_len - v_done;
+            }
+
+            char *buffer = (char *)iov[v].iov_base + v_done;
+            if (to_file && iov[v].iov_base == NULL) {
+                buffer = (char *)zero_buffer;
+                if (n > sizeof(zero_buffer)) {
+                    n = sizeof(zero_buffer);
+                }
+            }
+            requests[request_count++] = (block_request_t){
+                .r_op = to_file ? BLOCK_WRITE : BLOCK_READ,
+                .r_offset = (size_t)e->e_block * BLOCK_SIZE + skip,
+                .r_buffer = buffer,
+                .r_len = n};
+            skip += n;
+            done += n;
+            v_done += n;
+            if (request_count == BLOCK_DEVICE_BATCH) {
+                if (data_batch_submit(requests, request_count, &in_flight,
+                                      &in_flight_end, done,
+                                      &transferred) == -1) {
+                    return transferred;
+                }
+                request_count = 0;
+            }
+        }
+        extent_start += extent_len;
+    }
+
+    if (request_count > 0 &&
+        data_batch_submit(requests, request_count, &in_flight, &in_flight_end,
+                          done, &transferred) == -1) {
+        return transferred;
+    }
+    if (in_flight != NULL && block_device_wait(in_flight) == -1) {
+        return transferred;
+    }
+    return done;
+}
+
+/**
+ * Read data from the blocks of an inode.
+ *
+ * Input:
+ *   - inode: the inode (read-locked by the caller)
+ *   - buffer: destination buffer
+ *   - len: number of bytes to read
+ *   - offset: offset within the file
+ *
+ * Returns the number of bytes read.
+ */
+size_t inode_data_read(inode_t const *inode, void *buffer, size_t len,
+                       size_t offset) {
+    struct iovec iov = {.iov_base = buffer, .iov_len = len};
+    return inode_data_copy(inode, &iov, 1, len, offset, false);
+}
+
+/**
+ * Write data into the blocks of an inode. Blocks must have been reserved
+ * beforehand with inode_grow.
+ *
+ * Input:
+ *   - inode: the inode (write-locked by the caller)
+ *   - buffer: source buffer
+ *   - len: number of bytes to write
+ *   - offset: offset within the file
+ *
+ * Returns the number of bytes written.
+ */
+size_t inode_data_write(inode_t const *inode, void const *buffer, size_t len,
+                        size_t offset) {
+    struct iovec iov = {.iov_base = (void *)buffer, .iov_len = len};
+    return inode_data_copy(inode, &iov, 1, len, offset, true);
+}
+
+/**
+ * Read data from the blocks of an inode, scattering it across several
+ * buffers.
+ *
+ * Input:
+ *   - inode: the inode (read-locked by the caller)
+ *   - iov: destination buffers, filled in order
+ *   - iovcnt: number of buffers
+ *   - len: maximum number of bytes to read
+ *   - offset: offset within the file
+ *
+ * Returns the number of bytes read.
+ */
+size_t inode_data_readv(inode_t const *inode, struct iovec const *iov,
+                        size_t iovcnt, size_t len, size_t offset) {
+    return inode_data_copy(inode, iov, iovcnt, len, offset, false);
+}
+
+/**
+ * Write data into the blocks of an inode, gathering it from several buffers.
+ * Blocks must have been reserved beforehand with inode_grow.
+ *
+ * Input:
+ *   - inode: the inode (write-locked by the caller)
+ *   - iov: source buffers, written in order
+ *   - iovcnt: number of buffers
+ *   - len: maximum number of bytes to write
+ *   - offset: offset within the file
+ *
+ * Returns the number of bytes written.
+ */
+size_t inode_data_writev(inode_t const *inode, struct iovec const *iov,
+                         size_t iovcnt, size_t len, size_t offset) {
+    return inode_data_copy(inode, iov, iovcnt, len, offset, true);
+}
+
+/**
+ * Describe a range of an inode's data as spans of contiguous memory, one per
+ * extent it overlaps. Only possible if the data blocks are in memory (see
+ * data_blocks_mapped).
+ *
+ * Input:
+ *   - inode: the inode (locked by the caller)
+ *   - spans: where to store the spans
+ *   - span_count: on input, the room in spans; on output, the spans stored
+ *   - len: number of bytes to describe
+ *   - offset: offset within the file
+ *
+ * Returns the number of bytes covered by the spans (lower than len if they
+ * ran out, or if the inode does not hold enough blocks).
+ */
+size_t inode_data_spans(inode_t const *inode, struct iovec *spans,
+                        size_t *span_count, size_t len, size_t offset) {
+    extent_cursor_t cursor = EXTENT_CURSOR(inode);
+    size_t max = *span_count;
+    size_t done = 0;
+    size_t extent_start = 0; // file offset of the current extent
+
+    ALWAYS_ASSERT(data_blocks_mapped(),
+                  "inode_data_spans: data blocks are not in memory");
+
+    *span_count = 0;
+    extent_t const *e;
+    while (done < len && (e = extent_next(&cursor)) != NULL) {
+        size_t extent_len = (size_t)e->e_length * BLOCK_SIZE;
+        size_t pos = offset + done;
+
+        if (pos < extent_start + extent_len) {
+            if (*span_count == max) {
+                break; // no room for more spans
+            }
+
+            size_t skip = pos - extent_start;
+            size_t n = extent_len - skip;
+            if (n > len - done) {
+                n = len - done;
+            }
+
+            spans[*span_count].iov_base =
+                data_block_range(e->e_block + (int)(skip / BLOCK_SIZE),
+                                 (skip % BLOCK_SIZE + n - 1) / BLOCK_SIZE +
+                                     1) +
+                skip % BLOCK_SIZE;
+            spans[*span_count].iov_len = n;
+            (*span_count)++;
+            done += n;
+        }
+        extent_start += extent_len;
+    }
+
+    return done;
+}
+
+/**
+ * Fill a range of an inode's blocks with zeros (e.g., a hole left by a write
+ * past the end of the file). Blocks must have been reserved beforehand with
+ * inode_grow.
+ *
+ * Input:
+ *   - inode: the inode (write-locked by the caller)
+ *   - len: number of bytes to zero
+ *   - offset: offset within the file
+ *
+ * Returns the number of bytes zeroed.
+ */
+size_t inode_data_zero(inode_t const *inode, size_t len, size_t offset) {
+    struct iovec iov = {.iov_base = NULL, .iov_len = len};
+    return inode_data_copy(inode, &iov, 1, len, offset, true);
+}
+
+/**
+ * Take free blocks from a sub-pool of the global pool. Must be called with
+ * the sub-pool's lock held.
+ *
+ * Input:
+ *   - pool: the sub-pool
+ *   - blocks: where to store the block numbers (in ascending order)
+ *   - max: maximum number of blocks to take
+ *   - delay: set if the storage latency is due (to be paid once the lock is
+ *     released)
+ *
+ * Returns the number of blocks taken.
+ */
+static size_t block_pool_take(block_pool_t *pool, int *blocks, size_t max,
+                              bool *delay) {
+    size_t n = 0;
+    size_t word = pool->hint;
+
+    // simulate storage access delay to block_bitmap
+    if (storage_access_deferred(CACHE_BLOCK_BITMAP, BITMAP_BLOCK(word), 1)) {
+        *delay = true;
+    }
+    while (n < max && word < pool->end) {
+        if (block_bitmap[word] == ~UINT64_C(0)) {
+            word++;
+            continue;
+        }
+        size_t bit = (size_t)__builtin_ctzll(~block_bitmap[word]);
+        block_bitmap[word] |= UINT64_C(1) << bit;
+        blocks[n++] = (int)(word * 64 + bit);
+    }
+    pool->hint = word;
+
+    return n;
+}
+
+/**
+ * Take the first run of max free blocks from a sub-pool of the global pool,
+ * or the longest run found if none is that long. Only BLOCK_RUN_SCAN_WORDS
+ * words of the bitmap are searched, a word at a time, so that the sub-pool's
+ * lock is held for a bounded time however fragmented its free space is. Must
+ * be called with the sub-pool's lock held.
+ *
+ * Input:
+ *   - pool: the sub-pool
+ *   - max: maximum number of blocks to take
+ *   - first: where to store the number of the run's first block
+ *   - delay: set if the storage latency is due (to be paid once the lock is
+ *     released)
+ *
+ * Returns the number of blocks taken (0 if none is free in the words
+ * searched).
+ */
+static size_t block_pool_take_run(block_pool_t *pool, size_t max, int *first,
+                                  bool *delay) {
+    size_t best = 0, best_start = 0;
+    size_t run = 0, run_start = 0;
+    size_t end = pool->hint + BLOCK_RUN_SCAN_WORDS < pool->end
+                     ? pool->hint + BLOCK_RUN_SCAN_WORDS
+                     : pool->end;
+
+    // simulate storage access delay to block_bitmap
+    if (storage_access_deferred(CACHE_BLOCK_BITMAP, BITMAP_BLOCK(pool->hint),
+                                1)) {
+        *delay = true;
+    }
+    // Bits past the last block are set, so they never count as free
+    for (size_t word = pool->hint; word < end && best < max; word++) {
+        uint64_t free = ~block_bitmap[word];
+        size_t bit = 0;
+        while (bit < 64 && best < max) {
+            uint64_t rest = free >> bit;
+            if (rest == 0) {
+                run = 0; // the rest of the word is taken
+                break;
+            }
+            size_t taken = (size_t)__builtin_ctzll(rest);
+            if (taken > 0) {
+                run = 0;
+                bit += taken;
+                rest >>= taken;
+            }
+            size_t len = ~rest == 0 ? 64 : (size_t)__builtin_ctzll(~rest);
+            if (run == 0) {
+                run_start = word * 64 + bit;
+            }
+            run += len;
+            bit += len;
+            if (run > best) {
+                best = run;
+                best_start = run_start;
+            }
+        }
+    }
+    if (best > max) {
+        best = max;
+    }
+
+    for (size_t b = best_start; b < best_start + best; b++) {
+        block_bitmap[b / 64] |= UINT64_C(1) << (b % 64);
+    }
+    *first = (int)best_start;
+    return best;
+}
+
+/**
+ * Find the sub-pool owning a word of block_bitmap.
+ *
+ * Input:
+ *   - word: index of the word
+ *
+ * Returns the sub-pool.
+ */
+static block_pool_t *block_pool_of(size_t word) {
+    size_t longer_words = block_pool_longer * (block_pool_words + 1);
+    if (word < longer_words) {
+        return &block_pools[word / (block_pool_words + 1)];
+    }
+    return &block_pools[block_pool_longer +
+                        (word - longer_words) / block_pool_words];
+}
+
+/**
+ * Give blocks back to the global pool, each to the sub-pool it belongs to
+ * (taking the sub-pools' locks).
+ *
+ * Input:
+ *   - blocks: the block numbers
+ *   - n: number of blocks
+ */
+static void block_pool_give(int const *blocks, size_t n) {
+    // simulate storage access delay to block_bitmap
+    storage_access(CACHE_BLOCK_BITMAP, BITMAP_BLOCK(blocks[0] / 64), 1);
+    block_pool_t *locked = NULL;
+    for (size_t i = 0; i < n; i++) {
+        size_t word = (size_t)blocks[i] / 64;
+        block_pool_t *pool = block_pool_of(word);
+        if (pool != locked) {
+            if (locked != NULL) {
+                pthread_mutex_unlock(&locked->lock);
+            }
+            allocator_lock(&pool->lock, &pool->counters);
+            locked = pool;
+        }
+        block_bitmap[word] &= ~(UINT64_C(1) << (blocks[i] % 64));
+        if (word < pool->hint) {
+            pool->hint = word;
+        }
+    }
+    if (locked != NULL) {
+        pthread_mutex_unlock(&locked->lock);
+    }
+}
+
+/**
+ * Find the sub-pool of the NUMA node the calling thread runs on.
+ *
+ * Returns the index of the sub-pool.
+ */
+static size_t block_pool_local_index(void) {
+    if (block_pool_count == 1) {
+        return 0;
+    }
+    unsigned cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) {
+        return 0;
+    }
+    return node % block_pool_count;
+}
+
+/**
+ * Count blocks handed out by a sub-pool (see tfs_alloc_stats).
+ *
+ * Input:
+ *   - k: how far the sub-pool is from the local one (0 if it is the local
+ *     one)
+ *   - n: number of blocks
+ */
+static void block_pool_count_taken(size_t k, size_t n) {
+    if (n > 0) {
+        atomic_fetch_add_explicit(k == 0 ? &block_pool_local
+                                         : &block_pool_remote,
+                                  n, memory_order_relaxed);
+    }
+}
+
+/**
+ * Return the blocks of an exiting thread's magazine to the pool.
+ */
+static void block_magazine_release(void *arg) {
+    block_magazine_t *mag = arg;
+
+    pthread_mutex_lock(&magazines_lock);
+    for (block_magazine_t **p = &magazines; *p != NULL; p = &(*p)->next) {
+        if (*p == mag) {
+            *p = mag->next;
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&mag->lock);
+    if (block_bitmap != NULL && mag->count > 0) {
+        block_pool_give(mag->blocks, mag->count);
+    }
+    pthread_mutex_unlock(&mag->lock);
+    pthread_mutex_unlock(&magazines_lock);
+
+    pthread_mutex_destroy(&mag->lock);
+    free(mag);
+}
+
+static void block_magazine_key_create(void) {
+    ALWAYS_ASSERT(pthread_key_create(&magazine_key, block_magazine_release) ==
+                      0,
+                  "block_magazine_get: failed to create magazine key");
+}
+
+/**
+ * Obtain the calling thread's magazine, creating it on first use.
+ */
+static block_magazine_t *block_magazine_get(void) {
+    if (thread_magazine != NULL) {
+        return thread_magazine;
+    }
+
+    pthread_once(&magazine_key_once, block_magazine_key_create);
+
+    block_magazine_t *mag = aligned_alloc(_Alignof(block_magazine_t),
+                                          sizeof(block_magazine_t));
+    ALWAYS_ASSERT(mag != NULL, "block_magazine_get: out of memory");
+    pthread_mutex_init(&mag->lock, NULL);
+    mag->count = 0;
+
+    pthread_mutex_lock(&magazines_lock);
+    mag->next = magazines;
+    magazines = mag;
+    pthread_mutex_unlock(&magazines_lock);
+
+    pthread_setspecific(magazine_key, mag);
+    thread_magazine = mag;
+    return mag;
+}
+
+/**
+ * Move the blocks cached in every magazine back to the pool, so that they
+ * can be handed out again. Only used when the pool runs dry.
+ */
+static void block_pool_reclaim(void) {
+    pthread_mutex_lock(&magazines_lock);
+    for (block_magazine_t *mag = magazines; mag != NULL; mag = mag->next) {
+        pthread_mutex_lock(&mag->lock);
+        if (mag->count > 0) {
+            block_pool_give(mag->blocks, mag->count);
+            mag->count = 0;
+        }
+        pthread_mutex_unlock(&mag->lock);
+    }
+    pthread_mutex_unlock(&magazines_lock);
+}
+
+/**
+ * Refill an empty magazine with a batch of blocks from the pool, taken from
+ * the calling thread's node if it has any left. Must be called with the
+ * magazine's lock held.
+ *
+ * Input:
+ *   - mag: the magazine
+ */
+static void block_magazine_refill(block_magazine_t *mag) {
+    int batch[BLOCK_MAGAZINE_SIZE / 2];
+    size_t n = 0;
+
+    size_t local = block_pool_local_index();
+    for (size_t k = 0; k < block_pool_count && n == 0; k++) {
+        block_pool_t *pool = &block_pools[(local + k) % block_pool_count];
+        bool delay = false;
+        allocator_lock(&pool->lock, &pool->counters);
+        n = block_pool_take(pool, batch, BLOCK_MAGAZINE_SIZE / 2, &delay);
+        pthread_mutex_unlock(&pool->lock);
+        if (delay) {
+            insert_delay();
+        }
+        block_pool_count_taken(k, n);
+    }
+
+    // Lowest block on top, so that consecutive allocations are contiguous
+    for (size_t i = 0; i < n; i++) {
+        mag->blocks[i] = batch[n - 1 - i];
+    }
+    mag->count = n;
+}
+
+/**
+ * Claim data blocks, so that they can be allocated later on.
+ *
+ * Input:
+ *   - count: number of blocks
+ *
+ * Returns true if successful, false if not enough blocks are left.
+ */
+static bool data_blocks_claim(size_t count) {
+    size_t available = atomic_load(&data_blocks_available);
+    do {
+        if (available < count) {
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak(&data_blocks_available, &available,
+                                           available - count));
+    return true;
+}
+
+/**
+ * Give back claimed data blocks that were not allocated.
+ *
+ * Input:
+ *   - count: number of blocks
+ */
+static void data_blocks_unclaim(size_t count) {
+    atomic_fetch_add(&data_blocks_available, count);
+}
+
+/**
+ * Take a free block from the calling thread's magazine (refilling it if
+ * needed). The block must have been claimed.
+ *
+ * Returns block number/index if successful, -1 otherwise.
+ */
+static int data_block_take(void) {
+    block_magazine_t *mag = block_magazine_get();
+
+    pthread_mutex_lock(&mag->lock);
+    if (mag->count == 0) {
+        block_magazine_refill(mag);
+    }
+    if (mag->count == 0) {
+        // Free blocks may still be sitting in other threads' magazines
+        pthread_mutex_unlock(&mag->lock);
+        block_pool_reclaim();
+        pthread_mutex_lock(&mag->lock);
+        if (mag->count == 0) {
+            block_magazine_refill(mag);
+        }
+    }
+
+    int block_number = -1;
+    if (mag->count > 0) {
+        block_number = mag->blocks[--mag->count];
+    }
+    pthread_mutex_unlock(&mag->lock);
+
+    return block_number;
+}
+
+/**
+ * Allocate a new data block.
+ *
+ * Returns block number/index if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - No free data blocks.
+ */
+int data_block_alloc(void) {
+    if (!data_blocks_claim(1)) {
+        return -1;
+    }
+    int block_number = data_block_take();
+    if (block_number == -1) {
+        data_blocks_unclaim(1);
+    }
+    return block_number;
+}
+
+/**
+ * Allocate a run of contiguous data blocks (or a single block, if the free
+ * blocks are too fragmented), out of blocks claimed by the caller.
+ *
+ * Input:
+ *   - max: maximum number of blocks to allocate
+ *   - claimed: blocks claimed by the caller, decremented by the number of
+ *     blocks allocated
+ *   - first: where to store the number of the run's first block
+ *
+ * Returns the number of blocks allocated.
+ */
+static size_t data_block_alloc_run(size_t max, size_t *claimed, int *first) {
+    if (max > *claimed) {
+        max = *claimed;
+    }
+    if (max == 0) {
+        return 0;
+    }
+
+    size_t count = 0;
+    size_t local = block_pool_local_index();
+    for (size_t k = 0; k < block_pool_count && count == 0; k++) {
+        block_pool_t *pool = &block_pools[(local + k) % block_pool_count];
+        bool delay = false;
+        allocator_lock(&pool->lock, &pool->counters);
+        count = block_pool_take_run(pool, max, first, &delay);
+        pthread_mutex_unlock(&pool->lock);
+        if (delay) {
+            insert_delay();
+        }
+        block_pool_count_taken(k, count);
+    }
+    if (count == 0) {
+        *first = data_block_take();
+        count = *first == -1 ? 0 : 1;
+    }
+    *claimed -= count;
+    return count;
+}
+
+/**
+ * Obtain the block allocator counters (see tfs_alloc_stats).
+ *
+ * Input:
+ *   - nodes: where to store the number of sub-pools
+ *   - local: where to store the blocks handed out by the sub-pool of the
+ *     allocating thread's node
+ *   - remote: where to store the blocks handed out by other sub-pools
+ */
+void data_block_stats(size_t *nodes, uint64_t *local, uint64_t *remote) {
+    *nodes = block_pool_count;
+    *local = atomic_load_explicit(&block_pool_local, memory_order_relaxed);
+    *remote = atomic_load_explicit(&block_pool_remote, memory_order_relaxed);
+}
+
+/**
+ * Obtain the allocator lock counters, summed over the inode bitmap lock and
+ * the block sub-pool locks (see tfs_lock_stats).
+ *
+ * Input:
+ *   - acquired: where to store the number of acquisitions
+ *   - contended: where to store the number of acquisitions that waited
+ */
+void allocator_lock_stats(uint64_t *acquired, uint64_t *contended) {
+    pthread_mutex_lock(&inode_bitmap_lock.mutex);
+    *acquired = inode_bitmap_lock.counters.lc_acquired;
+    *contended = inode_bitmap_lock.counters.lc_contended;
+    pthread_mutex_unlock(&inode_bitmap_lock.mutex);
+    for (size_t i = 0; i < block_pool_count; i++) {
+        pthread_mutex_lock(&block_pools[i].lock);
+        *acquired += block_pools[i].counters.lc_acquired;
+        *contended += block_pools[i].counters.lc_contended;
+        pthread_mutex_unlock(&block_pools[i].lock);
+    }
+}
 
+/**
+ * Free a data block.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ */
+void data_block_free(int block_number) {
     ALWAYS_ASSERT(valid_block_number(block_number),
                   "data_block_free: invalid block number");
 
-    insert_delay(); // simulate storage access delay to free_blocks
+    if (resident_blocks != NULL) {
+        // Its contents are garbage from now on, so nothing is written back
+        free(atomic_exchange(&resident_blocks[block_number], NULL));
+    }
+
+    block_magazine_t *mag = block_magazine_get();
+
+    pthread_mutex_lock(&mag->lock);
+    if (mag->count == BLOCK_MAGAZINE_SIZE) {
+        // Drain the older half of the magazine back to the pool
+        size_t half = BLOCK_MAGAZINE_SIZE / 2;
+        block_pool_give(mag->blocks, half);
+
+        memmove(mag->blocks, mag->blocks + half,
+                (BLOCK_MAGAZINE_SIZE - half) * sizeof(int));
+        mag->count -= half;
+    }
+    mag->blocks[mag->count++] = block_number;
+    pthread_mutex_unlock(&mag->lock);
+
+    data_blocks_unclaim(1);
+}
 
-    free_blocks[block_number] = FREE;
+/**
+ * Obtain the in-memory copy of a block of a device file, reading it in on
+ * first use.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ */
+static void *resident_block_get(int block_number) {
+    char *block = atomic_load_explicit(&resident_blocks[block_number],
+                                       memory_order_acquire);
+    if (block != NULL) {
+        return block;
+    }
 
-    pthread_mutex_unlock(&trinco);
+    block = malloc(BLOCK_SIZE);
+    ALWAYS_ASSERT(block != NULL, "data_block_get: out of memory");
+    block_request_t request = {.r_op = BLOCK_READ,
+                               .r_offset = (size_t)block_number * BLOCK_SIZE,
+                               .r_buffer = block,
+                               .r_len = BLOCK_SIZE};
+    ALWAYS_ASSERT(block_device_io(block_device, &request, 1) ==
+                      (ssize_t)BLOCK_SIZE,
+                  "data_block_get: failed to read block");
+
+    // Readers of a directory may race to read it in: the first copy wins
+    char *expected = NULL;
+    if (!atomic_compare_exchange_strong_explicit(
+            &resident_blocks[block_number], &expected, block,
+            memory_order_acq_rel, memory_order_acquire)) {
+        free(block);
+        block = expected;
+    }
+    return block;
 }
 
 /**
- * Obtain a pointer to the contents of a given block.
+ * Obtain a pointer to the contents of a given block. Blocks of a device file
+ * stay in memory from then on, until freed; the contents of files are only
+ * reached through inode_data_read and the like, so these are the blocks of
+ * directories and overflow extents.
  *
  * Input:
  *   - block_number: the block number/index
@@ -484,8 +3507,110 @@ void *data_block_get(int block_number) {
     ALWAYS_ASSERT(valid_block_number(block_number),
                   "data_block_get: invalid block number");
 
-    insert_delay(); // simulate storage access delay to block
-    return &fs_data[(size_t)block_number * BLOCK_SIZE];
+    if (block_device_memory(block_device) == NULL) {
+        return resident_block_get(block_number);
+    }
+
+    return data_block_range(block_number, 1);
+}
+
+/**
+ * Free a segment of the open file table.
+ */
+static void open_file_segment_free(open_file_slot_t *slots) {
+    if (slots == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < OPEN_FILE_SEGMENT_SIZE; i++) {
+        pthread_mutex_destroy(&slots[i].of_entry.of_lock);
+    }
+    free(slots);
+}
+
+/**
+ * Find the open file table slot with the given index.
+ *
+ * Input:
+ *   - index: slot index
+ *   - create: whether to allocate the slot's segment if it does not exist
+ *
+ * Returns pointer to the slot, or NULL if its segment does not exist (and
+ * could not be allocated).
+ */
+static open_file_slot_t *open_file_slot(size_t index, bool create) {
+    _Atomic(open_file_slot_t *) *segment =
+        &open_file_segments[index / OPEN_FILE_SEGMENT_SIZE];
+    open_file_slot_t *slots = atomic_load_explicit(segment,
+                                                   memory_order_acquire);
+
+    if (slots == NULL && create) {
+        open_file_slot_t *fresh =
+            calloc(OPEN_FILE_SEGMENT_SIZE, sizeof(open_file_slot_t));
+        if (fresh == NULL) {
+            return NULL;
+        }
+        for (size_t i = 0; i < OPEN_FILE_SEGMENT_SIZE; i++) {
+            pthread_mutex_init(&fresh[i].of_entry.of_lock, NULL);
+        }
+        // Another thread may have allocated the segment meanwhile
+        if (atomic_compare_exchange_strong_explicit(
+                segment, &slots, fresh, memory_order_acq_rel,
+                memory_order_acquire)) {
+            slots = fresh;
+        } else {
+            open_file_segment_free(fresh);
+        }
+    }
+
+    return slots == NULL ? NULL : &slots[index % OPEN_FILE_SEGMENT_SIZE];
+}
+
+/**
+ * Take a free slot from the open file table, reusing recently closed slots
+ * before never used ones.
+ *
+ * Returns the slot's index, or -1 if the table is full.
+ */
+static int open_file_slot_take(void) {
+    uint64_t top = atomic_load_explicit(&open_file_free_top,
+                                        memory_order_acquire);
+    while ((uint32_t)top != 0) {
+        open_file_slot_t *slot = open_file_slot((uint32_t)top - 1, false);
+        uint64_t next = ((top >> 32) + 1) << 32 |
+                        atomic_load_explicit(&slot->of_next,
+                                             memory_order_relaxed);
+        if (atomic_compare_exchange_weak_explicit(
+                &open_file_free_top, &top, next, memory_order_acquire,
+                memory_order_acquire)) {
+            return (int)(uint32_t)top - 1;
+        }
+    }
+
+    size_t index = atomic_fetch_add(&open_file_unused, 1);
+    if (index >= MAX_OPEN_FILES || open_file_slot(index, true) == NULL) {
+        return -1;
+    }
+    return (int)index;
+}
+
+/**
+ * Return a slot to the stack of free open file table slots.
+ *
+ * Input:
+ *   - index: index of the slot to free
+ */
+static void open_file_slot_give(int index) {
+    open_file_slot_t *slot = open_file_slot((size_t)index, false);
+    uint64_t top = atomic_load_explicit(&open_file_free_top,
+                                        memory_order_relaxed);
+    uint64_t next;
+    do {
+        atomic_store_explicit(&slot->of_next, (uint32_t)top,
+                              memory_order_relaxed);
+        next = ((top >> 32) + 1) << 32 | (uint32_t)(index + 1);
+    } while (!atomic_compare_exchange_weak_explicit(
+        &open_file_free_top, &top, next, memory_order_release,
+        memory_order_relaxed));
 }
 
 /**
@@ -501,19 +3626,23 @@ void *data_block_get(int block_number) {
  *   - No space in open file table for a new open file.
  */
 int add_to_open_file_table(int inumber, size_t offset) {
-
-    pthread_mutex_lock(&trinco);
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (free_open_file_entries[i] == FREE) {
-            free_open_file_entries[i] = TAKEN;
-            open_file_table[i].of_inumber = inumber;
-            open_file_table[i].of_offset = offset;
-            pthread_mutex_unlock(&trinco);
-            return i;
-        }
+    int index = open_file_slot_take();
+    if (index == -1) {
+        return -1;
     }
-    pthread_mutex_unlock(&trinco);
-    return -1;
+
+    // The slot is ours alone until its handle is published, and generation
+    // 0 is skipped so that no handle is ever 0 (the free marker)
+    open_file_slot_t *slot = open_file_slot((size_t)index, false);
+    slot->of_generation = slot->of_generation % (OPEN_FILE_GENERATIONS - 1) + 1;
+    slot->of_entry.of_inumber = inumber;
+    slot->of_entry.of_offset = offset;
+    slot->of_entry.of_readahead =
+        (readahead_t){.ra_next = offset, .ra_end = offset};
+
+    int fhandle = (int)(slot->of_generation << OPEN_FILE_INDEX_BITS) | index;
+    atomic_store_explicit(&slot->of_handle, fhandle, memory_order_release);
+    return fhandle;
 }
 
 /**
@@ -521,18 +3650,25 @@ int add_to_open_file_table(int inumber, size_t offset) {
  *
  * Input:
  *   - fhandle: file handle to free/close
+ *
+ * Returns 0 if successful, -1 if the handle is invalid or already closed.
  */
-void remove_from_open_file_table(int fhandle) {
-    pthread_mutex_lock(&trinco);
-
-    ALWAYS_ASSERT(valid_file_handle(fhandle),
-                  "remove_from_open_file_table: file handle must be valid");
+int remove_from_open_file_table(int fhandle) {
+    if (!valid_file_handle(fhandle)) {
+        return -1;
+    }
 
-    ALWAYS_ASSERT(free_open_file_entries[fhandle] == TAKEN,
-                  "remove_from_open_file_table: file handle must be taken");
+    int index = fhandle & OPEN_FILE_INDEX_MASK;
+    open_file_slot_t *slot = open_file_slot((size_t)index, false);
+    // Only one of several threads closing the same handle succeeds
+    if (slot == NULL || !atomic_compare_exchange_strong_explicit(
+                            &slot->of_handle, &fhandle, 0,
+                            memory_order_acq_rel, memory_order_relaxed)) {
+        return -1;
+    }
 
-    free_open_file_entries[fhandle] = FREE;
-    pthread_mutex_unlock(&trinco);
+    open_file_slot_give(index);
+    return 0;
 }
 
 /**
@@ -545,21 +3681,25 @@ void remove_from_open_file_table(int fhandle) {
  * opened.
  */
 open_file_entry_t *get_open_file_entry(int fhandle) {
-    pthread_mutex_lock(&trinco);
-
     if (!valid_file_handle(fhandle)) {
         return NULL;
     }
 
-    if (free_open_file_entries[fhandle] != TAKEN) {
-        return NULL;
+    open_file_slot_t *slot =
+        open_file_slot((size_t)(fhandle & OPEN_FILE_INDEX_MASK), false);
+    if (slot == NULL || atomic_load_explicit(&slot->of_handle,
+                                             memory_order_acquire) != fhandle) {
+        return NULL; // closed, or the slot was reused by another open
     }
 
-    pthread_mutex_unlock(&trinco);
-    return &open_file_table[fhandle];
+    return &slot->of_entry;
 }
 
 // New
 bool isFreeInode(int inumber) {
-    return freeinode_ts[inumber] == FREE;
+    pthread_mutex_lock(&inode_bitmap_lock.mutex);
+    bool free =
+        !(inode_bitmap[inumber / 64] & (UINT64_C(1) << (inumber % 64)));
+    pthread_mutex_unlock(&inode_bitmap_lock.mutex);
+    return free;
 }
\ No newline at end of file
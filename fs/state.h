@@ -4,10 +4,33 @@
 #include "config.h"
 #include "operations.h"
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Locking
+ *
+ * Every inode has a read-write lock (inode_lock), which for directories also
+ * protects their entries. The inode bitmap and the data block pool each have a
+ * lock of their own (the open file table is lock-free, though reads through a
+ * handle take its lock). Locks are taken in this order:
+ *
+ *   1. file inode locks, and the lock of a directory being removed (taken in
+ *      operations.c)
+ *   2. open file handle locks (taken in operations.c)
+ *   3. directory inode locks (taken inside the directory functions below;
+ *      at most one at a time)
+ *   4. the dentry cache and inode bitmap locks, or the block allocator locks
+ *      (magazine registry, then a magazine, then one block sub-pool at a
+ *      time), or the read-ahead queue lock (held only to push or pop runs)
+ *   5. the buffer cache shard locks (taken on every storage access, and never
+ *      held while taking another lock)
+ */
 
 /**
  * Directory entry
@@ -20,48 +43,121 @@ typedef struct {
 typedef enum { T_FILE, T_DIRECTORY, SYM_LINK } inode_type;
 
 /**
- * Inode
+ * Extent (a run of physically contiguous data blocks)
  */
 typedef struct {
-    inode_type i_node_type;
-    size_t i_size;
-    int i_data_block;
+    int e_block;  // first block of the run
+    int e_length; // number of blocks in the run
+} extent_t;
+
+/**
+ * Inode (in a cache line of its own; its lock is kept apart, see inode_lock)
+ */
+typedef struct {
+    _Alignas(64) inode_type i_node_type;
     int hl_count;
-    char sym_path[MAX_FILE_NAME];
-    pthread_rwlock_t trinco;
+    size_t i_size;
+    size_t i_extent_count;
+    union {
+        extent_t i_extents[INODE_INLINE_EXTENTS];
+        // target of a symbolic link short enough to need no data block
+        // (i_size bytes, not null-terminated)
+        char i_symlink[INODE_INLINE_EXTENTS * sizeof(extent_t)];
+    };
+    int i_extent_block; // first block of the chain holding the extents past
+                        // the inline ones
+    // borrows in progress, plus INODE_ORPHAN once the last link is gone
+    atomic_uint i_pins;
 
     // in a more complete FS, more fields could exist here
 } inode_t;
 
-typedef enum { FREE = 0, TAKEN = 1 } allocation_state_t;
+#define INODE_ORPHAN (1u << 31)
+
+/**
+ * Read-ahead state of an open file (see inode_readahead).
+ */
+typedef struct {
+    size_t ra_next;   // offset where a sequential read would start
+    size_t ra_end;    // end of the range prefetched so far
+    size_t ra_window; // blocks to prefetch next (0 if not sequential)
+    tfs_readahead_stats_t ra_stats;
+} readahead_t;
 
 /**
  * Open file entry (in open file table)
  */
 typedef struct {
     int of_inumber;
+    // taken by reads through the handle, which only share the inode's lock,
+    // so that they update the offset and read-ahead state one at a time
+    pthread_mutex_t of_lock;
     size_t of_offset;
+    readahead_t of_readahead;
 } open_file_entry_t;
 
 int state_init(tfs_params);
 int state_destroy(void);
 
 size_t state_block_size(void);
+bool data_blocks_mapped(void);
 
 int inode_create(inode_type n_type);
+int inode_create_many(inode_type i_type, int *inumbers, size_t count);
 void inode_delete(int inumber);
 inode_t *inode_get(int inumber);
-
-int clear_dir_entry(inode_t *inode, char const *sub_name);
+pthread_rwlock_t *inode_lock(inode_t const *inode);
+inode_t *inode_acquire(int inumber);
+void inode_release(int inumber);
+void inode_journal(inode_t const *inode);
+void inode_pin(inode_t *inode);
+void inode_unpin(int inumber);
+bool inode_pinned(inode_t const *inode);
+void inode_orphan(int inumber);
+int inode_symlink_set(inode_t *inode, char const *target);
+size_t inode_symlink_get(inode_t const *inode, char *target);
+
+int clear_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber);
 int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber);
+size_t add_dir_entries(inode_t *inode, char const *const *sub_names,
+                       int const *sub_inumbers, size_t count);
 int find_in_dir(inode_t const *inode, char const *sub_name);
+int dir_set_dying(inode_t *inode, bool dying);
+
+size_t inode_grow(inode_t *inode, size_t size);
+void inode_truncate(inode_t *inode);
+size_t inode_size(inode_t const *inode);
+int inode_writeback_append(inode_t *inode, struct iovec const *iov,
+                           size_t iovcnt, size_t len);
+int inode_writeback_flush(inode_t *inode, bool release);
+bool inode_writeback_dirty(inode_t const *inode);
+int inode_writeback_flush_all(void);
+size_t inode_writeback_read(inode_t const *inode, struct iovec const *iov,
+                            size_t iovcnt, size_t skip, size_t len,
+                            size_t offset);
+size_t inode_data_read(inode_t const *inode, void *buffer, size_t len,
+                       size_t offset);
+size_t inode_data_write(inode_t const *inode, void const *buffer, size_t len,
+                        size_t offset);
+size_t inode_data_readv(inode_t const *inode, struct iovec const *iov,
+                        size_t iovcnt, size_t len, size_t offset);
+size_t inode_data_writev(inode_t const *inode, struct iovec const *iov,
+                         size_t iovcnt, size_t len, size_t offset);
+size_t inode_data_zero(inode_t const *inode, size_t len, size_t offset);
+int inode_data_sync(inode_t const *inode);
+void inode_readahead(inode_t const *inode, readahead_t *ra, size_t offset,
+                     size_t len);
+size_t inode_data_spans(inode_t const *inode, struct iovec *spans,
+                        size_t *span_count, size_t len, size_t offset);
 
 int data_block_alloc(void);
 void data_block_free(int block_number);
 void *data_block_get(int block_number);
+void data_block_stats(size_t *nodes, uint64_t *local, uint64_t *remote);
+void allocator_lock_stats(uint64_t *acquired, uint64_t *contended);
 
 int add_to_open_file_table(int inumber, size_t offset);
-void remove_from_open_file_table(int fhandle);
+int remove_from_open_file_table(int fhandle);
 open_file_entry_t *get_open_file_entry(int fhandle);
 
 // New 
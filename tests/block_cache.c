@@ -0,0 +1,93 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define BLOCK_SIZE (1024)
+#define FILE_BLOCKS (16)
+#define FILE_COUNT (8)
+#define ROUNDS (200)
+
+// Pieces of state the test accesses at most: the root directory, each file's
+// inode and blocks, and a few bitmap blocks
+#define WORKING_SET (2 + FILE_COUNT * (1 + FILE_BLOCKS) + 8)
+
+static uint8_t contents[FILE_BLOCKS * BLOCK_SIZE];
+
+/**
+ * Read a set of small hot files over and over, with a given cache size,
+ * checking every read.
+ */
+static void hot_reads(size_t cache_size, tfs_cache_stats_t *stats) {
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.cache_size = cache_size;
+    params.readahead_max_blocks = 0; // only the reads below touch the cache
+    assert(tfs_init(&params) != -1);
+
+    for (int i = 0; i < FILE_COUNT; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "/f%d", i);
+        int f = tfs_open(name, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, contents, sizeof(contents)) == sizeof(contents));
+        assert(tfs_close(f) != -1);
+    }
+
+    uint8_t buffer[BLOCK_SIZE];
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < FILE_COUNT; i++) {
+            char name[16];
+            snprintf(name, sizeof(name), "/f%d", i);
+            int f = tfs_open(name, 0);
+            assert(f != -1);
+            // One block at a time, as small reads do
+            for (size_t b = 0; b < FILE_BLOCKS; b++) {
+                assert(tfs_read(f, buffer, BLOCK_SIZE) == BLOCK_SIZE);
+                assert(memcmp(buffer, contents + b * BLOCK_SIZE,
+                              BLOCK_SIZE) == 0);
+            }
+            assert(tfs_close(f) != -1);
+        }
+    }
+
+    tfs_cache_stats(stats);
+    printf("cache of %zu: %llu hits, %llu misses, %llu evictions\n",
+           cache_size, (unsigned long long)stats->cs_hits,
+           (unsigned long long)stats->cs_misses,
+           (unsigned long long)stats->cs_evictions);
+    assert(tfs_destroy() != -1);
+}
+
+int main() {
+    for (size_t i = 0; i < sizeof(contents); i++) {
+        contents[i] = (uint8_t)(i % 253);
+    }
+
+    tfs_cache_stats_t stats;
+
+    // Without a cache, every access misses (and is not counted)
+    hot_reads(0, &stats);
+    assert(stats.cs_hits == 0 && stats.cs_misses == 0);
+
+    // With room for the whole working set, only the first access to each
+    // piece of state misses: every block read by the loop was already
+    // accessed when it was written
+    hot_reads(4096, &stats);
+    assert(stats.cs_evictions == 0);
+    assert(stats.cs_misses <= WORKING_SET);
+    assert(stats.cs_hits >= (uint64_t)ROUNDS * FILE_COUNT * FILE_BLOCKS);
+
+    // A cache smaller than the working set evicts, and misses more, but
+    // still hits
+    uint64_t misses = stats.cs_misses;
+    hot_reads(64, &stats);
+    assert(stats.cs_evictions > 0);
+    assert(stats.cs_misses > misses);
+    assert(stats.cs_hits > 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,198 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BLOCK_SIZE (1024)
+#define BLOCK_COUNT (4096)
+#define FILE_SIZE (256 * BLOCK_SIZE)
+#define THREAD_COUNT (4)
+
+static uint8_t contents[THREAD_COUNT][FILE_SIZE];
+
+static char device_path[] = "/tmp/tfs_deviceXXXXXX";
+static char external_path[] = "/tmp/tfs_device_outXXXXXX";
+static char image_path[] = "/tmp/tfs_device_imageXXXXXX";
+
+static void *write_and_check(void *arg) {
+    int id = *(int *)arg;
+    char name[16];
+    snprintf(name, sizeof(name), "/f%d", id);
+
+    // Small interleaved writes leave every file fragmented across extents
+    int f = tfs_open(name, TFS_O_CREAT);
+    assert(f != -1);
+    for (size_t done = 0; done < FILE_SIZE; done += 3 * BLOCK_SIZE) {
+        size_t n = FILE_SIZE - done < 3 * BLOCK_SIZE ? FILE_SIZE - done
+                                                     : 3 * BLOCK_SIZE;
+        assert(tfs_write(f, contents[id] + done, n) == (ssize_t)n);
+    }
+
+    static uint8_t buffer[THREAD_COUNT][FILE_SIZE];
+    assert(tfs_pread(f, buffer[id], FILE_SIZE, 0) == FILE_SIZE);
+    assert(memcmp(buffer[id], contents[id], FILE_SIZE) == 0);
+
+    // Reads spanning extents, into several buffers, at odd offsets
+    uint8_t a[1000], b[5000];
+    struct iovec iov[] = {{a, sizeof(a)}, {b, sizeof(b)}};
+    f = tfs_open(name, 0);
+    assert(f != -1);
+    assert(tfs_pread(f, a, 1, 777) == 1);
+    assert(a[0] == contents[id][777]);
+    assert(tfs_readv(f, iov, 2) == (ssize_t)(sizeof(a) + sizeof(b)));
+    assert(memcmp(a, contents[id], sizeof(a)) == 0);
+    assert(memcmp(b, contents[id] + sizeof(a), sizeof(b)) == 0);
+    assert(tfs_close(f) != -1);
+    return NULL;
+}
+
+static void check_backend(tfs_params const *params) {
+    assert(tfs_init(params) != -1);
+
+    pthread_t threads[THREAD_COUNT];
+    int ids[THREAD_COUNT];
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        ids[i] = i;
+        assert(pthread_create(&threads[i], NULL, write_and_check, &ids[i]) ==
+               0);
+    }
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+
+    // Holes are zero-filled on the device as well
+    int f = tfs_open("/holes", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_pwrite(f, "end", 3, 100 * BLOCK_SIZE) == 3);
+    uint8_t buffer[BLOCK_SIZE];
+    assert(tfs_pread(f, buffer, sizeof(buffer), 50 * BLOCK_SIZE) ==
+           sizeof(buffer));
+    for (size_t i = 0; i < sizeof(buffer); i++) {
+        assert(buffer[i] == 0);
+    }
+    assert(tfs_close(f) != -1);
+
+    // Directory blocks are freed and reused by files, and the other way round
+    for (int round = 0; round < 3; round++) {
+        assert(tfs_mkdir("/dir") != -1);
+        f = tfs_open("/dir/file", TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, contents[0], 4 * BLOCK_SIZE) == 4 * BLOCK_SIZE);
+        assert(tfs_close(f) != -1);
+        assert(tfs_unlink("/dir/file") != -1);
+        assert(tfs_rmdir("/dir") != -1);
+        f = tfs_open("/reuse", TFS_O_CREAT | TFS_O_TRUNC);
+        assert(f != -1);
+        assert(tfs_write(f, contents[1], 8 * BLOCK_SIZE) == 8 * BLOCK_SIZE);
+        assert(tfs_close(f) != -1);
+    }
+
+    // Exporting works whether or not the blocks can be borrowed
+    assert(tfs_copy_to_external_fs("/f0", external_path) != -1);
+    int fd = open(external_path, O_RDONLY);
+    assert(fd != -1);
+    static uint8_t exported[FILE_SIZE];
+    assert(read(fd, exported, FILE_SIZE) == FILE_SIZE);
+    assert(memcmp(exported, contents[0], FILE_SIZE) == 0);
+    assert(close(fd) == 0);
+
+    f = tfs_open("/f1", 0);
+    assert(f != -1);
+    assert(tfs_fsync(f, TFS_DURABILITY_SYNCED) != -1);
+    tfs_borrow_t borrow;
+    ssize_t borrowed = tfs_borrow(f, BLOCK_SIZE, 0, &borrow);
+    if (params->device_path != NULL) {
+        assert(borrowed == -1); // the blocks are not in memory
+    } else {
+        assert(borrowed == BLOCK_SIZE);
+        assert(tfs_borrow_release(&borrow) != -1);
+    }
+    assert(tfs_close(f) != -1);
+
+    // Sequential reads of the whole data set
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    static uint8_t all[FILE_SIZE];
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "/f%d", i);
+        f = tfs_open(name, 0);
+        assert(f != -1);
+        assert(tfs_read(f, all, FILE_SIZE) == FILE_SIZE);
+        assert(memcmp(all, contents[i], FILE_SIZE) == 0);
+        assert(tfs_close(f) != -1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (double)(end.tv_sec - start.tv_sec) +
+                     (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%-10s %8.1f MiB/s\n",
+           params->image_path != NULL        ? "image"
+           : params->device_path == NULL     ? "ram"
+           : params->device_queue_depth == 0 ? "pread"
+                                             : "io_uring",
+           THREAD_COUNT * FILE_SIZE / seconds / (1 << 20));
+
+    assert(tfs_destroy() != -1);
+}
+
+int main() {
+    int fd = mkstemp(device_path);
+    assert(fd != -1);
+    assert(close(fd) == 0);
+    fd = mkstemp(external_path);
+    assert(fd != -1);
+    assert(close(fd) == 0);
+    fd = mkstemp(image_path);
+    assert(fd != -1);
+    assert(close(fd) == 0);
+
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        for (size_t j = 0; j < FILE_SIZE; j++) {
+            contents[i][j] = (uint8_t)((j * 7 + (size_t)i * 13) % 251);
+        }
+    }
+
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_block_count = BLOCK_COUNT;
+
+    check_backend(&params);
+
+    params.device_path = device_path;
+    check_backend(&params);
+
+    params.device_queue_depth = 0;
+    check_backend(&params);
+
+    // The image holds the blocks itself
+    params.image_path = image_path;
+    assert(tfs_init(&params) == -1);
+    assert(tfs_destroy() != -1);
+
+    // File data written to an image's blocks goes through to the image
+    params.device_path = NULL;
+    check_backend(&params);
+    assert(tfs_init(&params) != -1);
+    static uint8_t reopened[FILE_SIZE];
+    int f = tfs_open("/f2", 0);
+    assert(f != -1);
+    assert(tfs_read(f, reopened, FILE_SIZE) == FILE_SIZE);
+    assert(memcmp(reopened, contents[2], FILE_SIZE) == 0);
+    assert(tfs_close(f) != -1);
+    assert(tfs_destroy() != -1);
+
+    assert(unlink(device_path) == 0);
+    assert(unlink(external_path) == 0);
+    assert(unlink(image_path) == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
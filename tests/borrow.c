@@ -0,0 +1,110 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define BLOCK_SIZE (1024)
+#define BLOCK_COUNT (64)
+
+static uint8_t expected(size_t pos) { return (uint8_t)(pos * 13 % 251); }
+
+// check that a borrow covers a range with the expected contents
+static void check(tfs_borrow_t const *borrow, size_t len, size_t offset) {
+    size_t pos = offset;
+    for (size_t i = 0; i < borrow->b_span_count; i++) {
+        uint8_t const *data = borrow->b_spans[i].s_data;
+        for (size_t j = 0; j < borrow->b_spans[i].s_len; j++) {
+            assert(data[j] == expected(pos + j));
+        }
+        pos += borrow->b_spans[i].s_len;
+    }
+    assert(pos == offset + len);
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_block_count = BLOCK_COUNT;
+    params.block_size = BLOCK_SIZE;
+    assert(tfs_init(&params) != -1);
+
+    uint8_t buffer[3 * BLOCK_SIZE];
+    for (size_t i = 0; i < sizeof(buffer); i++) {
+        buffer[i] = expected(i);
+    }
+    int f = tfs_open("/f", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, buffer, sizeof(buffer)) == sizeof(buffer));
+
+    // a contiguous file is borrowed as a single span, without moving the
+    // handle's offset
+    tfs_borrow_t borrow;
+    assert(tfs_borrow(f, sizeof(buffer), 0, &borrow) == sizeof(buffer));
+    assert(borrow.b_span_count == 1);
+    check(&borrow, sizeof(buffer), 0);
+    uint8_t c;
+    assert(tfs_read(f, &c, 1) == 0);
+    assert(tfs_borrow_release(&borrow) != -1);
+    assert(tfs_borrow_release(&borrow) == -1);
+
+    // ranges are clamped to the file size
+    assert(tfs_borrow(f, 100, sizeof(buffer) - 10, &borrow) == 10);
+    check(&borrow, 10, sizeof(buffer) - 10);
+    assert(tfs_borrow_release(&borrow) != -1);
+    assert(tfs_borrow(f, 100, 10 * BLOCK_SIZE, &borrow) == 0);
+    assert(borrow.b_span_count == 0);
+    assert(tfs_borrow_release(&borrow) != -1);
+    assert(tfs_close(f) != -1);
+
+    // a borrowed file cannot be truncated, and unlinking it keeps its blocks
+    // until the borrow is released
+    f = tfs_open("/f", 0);
+    assert(f != -1);
+    assert(tfs_borrow(f, sizeof(buffer), 0, &borrow) == sizeof(buffer));
+    assert(tfs_open("/f", TFS_O_TRUNC) == -1);
+    assert(tfs_unlink("/f") != -1);
+    assert(tfs_close(f) != -1);
+
+    uint8_t other[BLOCK_SIZE];
+    memset(other, 0xEE, sizeof(other));
+    int g = tfs_open("/g", TFS_O_CREAT);
+    assert(g != -1);
+    // use up every free block
+    while (tfs_write(g, other, sizeof(other)) > 0) {
+    }
+    check(&borrow, sizeof(buffer), 0);
+    assert(tfs_borrow_release(&borrow) != -1);
+
+    // released blocks go back to the file system
+    assert(tfs_write(g, other, sizeof(other)) == sizeof(other));
+    assert(tfs_close(g) != -1);
+    assert(tfs_unlink("/g") != -1);
+
+    // fragmented files take one span per extent
+    int a = tfs_open("/a", TFS_O_CREAT);
+    int b = tfs_open("/b", TFS_O_CREAT);
+    assert(a != -1 && b != -1);
+    for (size_t i = 0; i < 20; i++) {
+        for (size_t j = 0; j < BLOCK_SIZE; j++) {
+            buffer[j] = expected(i * BLOCK_SIZE + j);
+        }
+        assert(tfs_write(a, buffer, BLOCK_SIZE) == BLOCK_SIZE);
+        assert(tfs_write(b, buffer, BLOCK_SIZE) == BLOCK_SIZE);
+    }
+    ssize_t borrowed = tfs_borrow(a, 20 * BLOCK_SIZE, 0, &borrow);
+    assert(borrowed > 0 && borrowed <= 20 * BLOCK_SIZE);
+    assert(borrowed == 20 * BLOCK_SIZE ||
+           borrow.b_span_count == TFS_BORROW_MAX_SPANS);
+    check(&borrow, (size_t)borrowed, 0);
+    assert(tfs_borrow_release(&borrow) != -1);
+    assert(tfs_close(a) != -1);
+    assert(tfs_close(b) != -1);
+
+    assert(tfs_borrow(a, 1, 0, &borrow) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,119 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define THREAD_COUNT (8)
+#define BLOCK_SIZE (1024)
+#define BLOCKS_PER_FILE (40)
+#define BLOCK_COUNT (1024)
+
+static pthread_barrier_t written;
+static pthread_barrier_t checked;
+
+static void fill(uint8_t *buffer, size_t len, size_t seed) {
+    for (size_t i = 0; i < len; i++) {
+        buffer[i] = (uint8_t)((i * 7 + seed) % 253);
+    }
+}
+
+static void check(char const *path, size_t len, size_t seed) {
+    uint8_t *expected = malloc(len);
+    uint8_t *buffer = malloc(len);
+    assert(expected != NULL && buffer != NULL);
+    fill(expected, len, seed);
+
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, len) == len);
+    assert(memcmp(buffer, expected, len) == 0);
+    assert(tfs_close(f) != -1);
+
+    free(expected);
+    free(buffer);
+}
+
+static void *writer(void *arg) {
+    size_t id = (size_t)arg;
+    char path[16];
+    snprintf(path, sizeof(path), "/f%zu", id);
+
+    // write one block at a time, so every block comes from this thread's
+    // magazine
+    uint8_t buffer[BLOCKS_PER_FILE * BLOCK_SIZE];
+    fill(buffer, sizeof(buffer), id);
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    for (size_t b = 0; b < BLOCKS_PER_FILE; b++) {
+        assert(tfs_write(f, buffer + b * BLOCK_SIZE, BLOCK_SIZE) == BLOCK_SIZE);
+    }
+    assert(tfs_close(f) != -1);
+
+    // stay alive (with blocks still cached in the magazine) while the main
+    // thread uses up the rest of the file system
+    pthread_barrier_wait(&written);
+    pthread_barrier_wait(&checked);
+
+    check(path, sizeof(buffer), id);
+    return NULL;
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_block_count = BLOCK_COUNT;
+    params.block_size = BLOCK_SIZE;
+    assert(tfs_init(&params) != -1);
+
+    pthread_barrier_init(&written, NULL, THREAD_COUNT + 1);
+    pthread_barrier_init(&checked, NULL, THREAD_COUNT + 1);
+
+    pthread_t threads[THREAD_COUNT];
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_create(&threads[i], NULL, writer, (void *)i) == 0);
+    }
+    pthread_barrier_wait(&written);
+
+    // every block not in use must still be allocatable, including the ones
+    // reserved by the other threads' magazines
+    size_t free_blocks = BLOCK_COUNT - 1 - THREAD_COUNT * BLOCKS_PER_FILE;
+    size_t len = free_blocks * BLOCK_SIZE;
+    uint8_t *buffer = malloc(len + BLOCK_SIZE);
+    assert(buffer != NULL);
+    fill(buffer, len + BLOCK_SIZE, 99);
+
+    int f = tfs_open("/big", TFS_O_CREAT);
+    assert(f != -1);
+    ssize_t written_len = tfs_write(f, buffer, len + BLOCK_SIZE);
+    // the overflow extent block may take one block, if the file got
+    // fragmented
+    assert(written_len == len || written_len == len - BLOCK_SIZE);
+    assert(tfs_write(f, buffer, 1) == -1);
+    assert(tfs_close(f) != -1);
+    check("/big", (size_t)written_len, 99);
+    free(buffer);
+
+    pthread_barrier_wait(&checked);
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+
+    // blocks of exited threads and unlinked files go back to the pool
+    assert(tfs_unlink("/big") != -1);
+    f = tfs_open("/again", TFS_O_CREAT);
+    assert(f != -1);
+    uint8_t block[BLOCK_SIZE];
+    fill(block, BLOCK_SIZE, 1);
+    assert(tfs_write(f, block, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(tfs_close(f) != -1);
+
+    pthread_barrier_destroy(&written);
+    pthread_barrier_destroy(&checked);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
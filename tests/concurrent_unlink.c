@@ -0,0 +1,79 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#define THREAD_COUNT (4)
+#define ROUNDS (300)
+
+static pthread_barrier_t barrier;
+static atomic_int removed;
+
+// Every thread unlinks the same name at once
+static void *unlinker(void *arg) {
+    char const *path = arg;
+    pthread_barrier_wait(&barrier);
+    if (tfs_unlink(path) != -1) {
+        atomic_fetch_add(&removed, 1);
+    }
+    return NULL;
+}
+
+static void race(char const *path) {
+    pthread_t threads[THREAD_COUNT];
+    atomic_store(&removed, 0);
+    assert(pthread_barrier_init(&barrier, NULL, THREAD_COUNT) == 0);
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_create(&threads[i], NULL, unlinker, (void *)path) ==
+               0);
+    }
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    assert(pthread_barrier_destroy(&barrier) == 0);
+    assert(atomic_load(&removed) == 1);
+}
+
+static void check_file(char const *path) {
+    char buffer[8];
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == 4);
+    assert(memcmp(buffer, "data", 4) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    int f = tfs_open("/file", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "data", 4) == 4);
+    assert(tfs_close(f) != -1);
+
+    for (int round = 0; round < ROUNDS; round++) {
+        // A symbolic link is deleted once
+        assert(tfs_sym_link("/file", "/soft") != -1);
+        check_file("/soft");
+        race("/soft");
+        assert(tfs_open("/soft", 0) == -1);
+
+        // A hard link only drops one link of its file
+        assert(tfs_link("/file", "/hard") != -1);
+        race("/hard");
+        assert(tfs_open("/hard", 0) == -1);
+        check_file("/file");
+    }
+
+    // The file's last link still deletes it
+    race("/file");
+    assert(tfs_open("/file", 0) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -17,7 +17,15 @@ int main() {
     // Scenario 1: source file does not exist
     assert(tfs_copy_from_external_fs("./unexistent", path1) == -1);
 
-    // TODO: add more failure scenarios
+    // Scenario 2: the parent directory of the destination does not exist
+    assert(tfs_copy_from_external_fs("tests/file_to_copy.txt", "/d/f1") == -1);
+
+    // Scenario 3: the file system runs out of space
+    assert(tfs_destroy() != -1);
+    tfs_params params = tfs_default_params();
+    params.max_block_count = 1;
+    assert(tfs_init(&params) != -1);
+    assert(tfs_copy_from_external_fs("tests/file_to_copy.txt", path1) == -1);
 
     printf("Successful test.\n");
 
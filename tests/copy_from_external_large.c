@@ -1,7 +1,57 @@
 #include "fs/operations.h"
 #include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_BLOCK_SIZE (4096)
+#define BENCH_BLOCK_COUNT (2560)
+#define BENCH_FILE_SIZE (8 << 20)
+
+// Copy a multi-megabyte host file, checking its contents and reporting the
+// copy's throughput
+static void bench_large_copy(void) {
+    char path_src[] = "/tmp/tfs_copy_benchXXXXXX";
+    int fd = mkstemp(path_src);
+    assert(fd != -1);
+
+    uint8_t *contents = malloc(BENCH_FILE_SIZE);
+    uint8_t *buffer = malloc(BENCH_FILE_SIZE);
+    assert(contents != NULL && buffer != NULL);
+    for (size_t i = 0; i < BENCH_FILE_SIZE; i++) {
+        contents[i] = (uint8_t)(i * 7 % 253);
+    }
+    assert(write(fd, contents, BENCH_FILE_SIZE) == BENCH_FILE_SIZE);
+    assert(close(fd) == 0);
+
+    tfs_params params = tfs_default_params();
+    params.block_size = BENCH_BLOCK_SIZE;
+    params.max_block_count = BENCH_BLOCK_COUNT;
+    assert(tfs_init(&params) != -1);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    assert(tfs_copy_from_external_fs(path_src, "/big") != -1);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (double)(end.tv_sec - start.tv_sec) +
+                     (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("copied %d MiB at %.1f MiB/s\n", BENCH_FILE_SIZE >> 20,
+           (double)(BENCH_FILE_SIZE >> 20) / seconds);
+
+    int f = tfs_open("/big", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, BENCH_FILE_SIZE) == BENCH_FILE_SIZE);
+    assert(memcmp(buffer, contents, BENCH_FILE_SIZE) == 0);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+    assert(unlink(path_src) == 0);
+    free(contents);
+    free(buffer);
+}
 
 int main() {
 
@@ -33,6 +83,9 @@ int main() {
     r = tfs_read(f, buffer, sizeof(buffer) - 1);
     assert(r == strlen(str_ext_file));
     assert(!memcmp(buffer, str_ext_file, strlen(str_ext_file)));
+    assert(tfs_destroy() != -1);
+
+    bench_large_copy();
 
     printf("Successful test.\n");
 
@@ -0,0 +1,93 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BLOCK_SIZE (4096)
+#define BLOCK_COUNT (2560)
+#define FILE_SIZE (8 << 20)
+#define FRAGMENTED_BLOCKS (40)
+
+// check that a host file holds the given contents
+static void check_host_file(char const *path, uint8_t const *contents,
+                            size_t len) {
+    FILE *fp = fopen(path, "rb");
+    assert(fp != NULL);
+    uint8_t *buffer = malloc(len + 1);
+    assert(buffer != NULL);
+    assert(fread(buffer, 1, len + 1, fp) == len);
+    assert(memcmp(buffer, contents, len) == 0);
+    assert(fclose(fp) == 0);
+    free(buffer);
+}
+
+int main() {
+    char path_dest[] = "/tmp/tfs_export_XXXXXX";
+    int fd = mkstemp(path_dest);
+    assert(fd != -1);
+    assert(close(fd) == 0);
+
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_block_count = BLOCK_COUNT;
+    assert(tfs_init(&params) != -1);
+
+    uint8_t *contents = malloc(FILE_SIZE);
+    assert(contents != NULL);
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        contents[i] = (uint8_t)(i * 11 % 251);
+    }
+
+    // a large file, reported as a throughput benchmark
+    int f = tfs_open("/big", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, contents, FILE_SIZE) == FILE_SIZE);
+    assert(tfs_close(f) != -1);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    assert(tfs_copy_to_external_fs("/big", path_dest) != -1);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (double)(end.tv_sec - start.tv_sec) +
+                     (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("exported %d MiB at %.1f MiB/s\n", FILE_SIZE >> 20,
+           (double)(FILE_SIZE >> 20) / seconds);
+    check_host_file(path_dest, contents, FILE_SIZE);
+    assert(tfs_unlink("/big") != -1);
+
+    // a fragmented file, whose spans take more than one borrow, replaces the
+    // previous contents of the destination
+    int a = tfs_open("/a", TFS_O_CREAT);
+    int b = tfs_open("/b", TFS_O_CREAT);
+    assert(a != -1 && b != -1);
+    for (size_t i = 0; i < FRAGMENTED_BLOCKS; i++) {
+        assert(tfs_write(a, contents + i * BLOCK_SIZE, BLOCK_SIZE) ==
+               BLOCK_SIZE);
+        assert(tfs_write(b, contents, BLOCK_SIZE) == BLOCK_SIZE);
+    }
+    assert(tfs_close(a) != -1);
+    assert(tfs_close(b) != -1);
+    assert(tfs_copy_to_external_fs("/a", path_dest) != -1);
+    check_host_file(path_dest, contents, FRAGMENTED_BLOCKS * BLOCK_SIZE);
+
+    // empty files, and failures
+    f = tfs_open("/empty", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_copy_to_external_fs("/empty", path_dest) != -1);
+    check_host_file(path_dest, contents, 0);
+    assert(tfs_copy_to_external_fs("/missing", path_dest) == -1);
+    assert(tfs_copy_to_external_fs("/a", "/nonexistent/dir/file") == -1);
+
+    assert(tfs_destroy() != -1);
+    assert(unlink(path_dest) == 0);
+    free(contents);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
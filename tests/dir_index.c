@@ -0,0 +1,94 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define MAX_FILES (64)
+
+static void path_of(char *path, size_t size, int i) {
+    snprintf(path, size, "/file_%d", i);
+}
+
+static void assert_opens(int i, int expected_byte) {
+    char path[32];
+    path_of(path, sizeof(path), i);
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    char c;
+    assert(tfs_read(f, &c, 1) == 1);
+    assert(c == (char)expected_byte);
+    assert(tfs_close(f) != -1);
+}
+
+static void create(int i, int byte) {
+    char path[32];
+    path_of(path, sizeof(path), i);
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    char c = (char)byte;
+    assert(tfs_write(f, &c, 1) == 1);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    // fill the root directory
+    int count = 0;
+    for (; count < MAX_FILES; count++) {
+        char path[32];
+        path_of(path, sizeof(path), count);
+        int f = tfs_open(path, TFS_O_CREAT);
+        if (f == -1) {
+            break;
+        }
+        char c = (char)count;
+        assert(tfs_write(f, &c, 1) == 1);
+        assert(tfs_close(f) != -1);
+    }
+    assert(count > 2 && count < MAX_FILES);
+    for (int i = 0; i < count; i++) {
+        assert_opens(i, i);
+    }
+
+    // names are unique
+    assert(tfs_link("/file_0", "/file_1") == -1);
+
+    // remove every other entry and check the others are still found
+    for (int i = 0; i < count; i += 2) {
+        char path[32];
+        path_of(path, sizeof(path), i);
+        assert(tfs_unlink(path) != -1);
+        assert(tfs_open(path, 0) == -1);
+    }
+    for (int i = 1; i < count; i += 2) {
+        assert_opens(i, i);
+    }
+
+    // the freed entries can be reused
+    for (int i = 0; i < count; i += 2) {
+        create(i, i + 1);
+    }
+    for (int i = 0; i < count; i++) {
+        assert_opens(i, i % 2 == 0 ? i + 1 : i);
+    }
+
+    // empty the directory completely and fill it again
+    for (int i = 0; i < count; i++) {
+        char path[32];
+        path_of(path, sizeof(path), i);
+        assert(tfs_unlink(path) != -1);
+    }
+    for (int i = 0; i < count; i++) {
+        create(count - 1 - i, i);
+    }
+    for (int i = 0; i < count; i++) {
+        assert_opens(count - 1 - i, i);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
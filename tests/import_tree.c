@@ -0,0 +1,229 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DIR_COUNT (4)
+#define FILES_PER_DIR (50)
+#define WIDE_FILES (75) // more than a tree import creates at a time
+#define BLOCK_SIZE (4096)
+
+static char root[] = "/tmp/tfs_import_XXXXXX";
+
+static size_t file_size(size_t d, size_t f) { return (d * 7 + f * 131) % 9000; }
+
+static uint8_t file_byte(size_t d, size_t f, size_t i) {
+    return (uint8_t)((d + 3 * f + i) % 251);
+}
+
+static void host_path(char *path, size_t len, size_t d, size_t f) {
+    snprintf(path, len, "%s/d%zu/f%zu", root, d, f);
+}
+
+// names of MAX_FILE_NAME - 1 characters fit in TécnicoFS, longer ones do not
+static void long_name(char *name, char c, size_t len) {
+    memset(name, c, len);
+    name[len] = '\0';
+}
+
+static void write_host_file(char const *path, char const *contents) {
+    FILE *fp = fopen(path, "wb");
+    assert(fp != NULL);
+    assert(fputs(contents, fp) >= 0);
+    assert(fclose(fp) == 0);
+}
+
+// write the host tree: DIR_COUNT directories of FILES_PER_DIR files, one of
+// them nested in another directory, a directory of WIDE_FILES files, and
+// entries whose names are the longest allowed and too long
+static void make_tree(size_t generation) {
+    char path[128];
+    char name[MAX_FILE_NAME + 1];
+    uint8_t buffer[9000];
+
+    for (size_t d = 0; d < DIR_COUNT; d++) {
+        snprintf(path, sizeof(path), "%s/d%zu", root, d);
+        assert(mkdir(path, 0700) == 0 || generation > 0);
+        for (size_t f = 0; f < FILES_PER_DIR; f++) {
+            for (size_t i = 0; i < sizeof(buffer); i++) {
+                buffer[i] = file_byte(d + generation, f, i);
+            }
+            host_path(path, sizeof(path), d, f);
+            FILE *fp = fopen(path, "wb");
+            assert(fp != NULL);
+            assert(fwrite(buffer, 1, file_size(d, f), fp) == file_size(d, f));
+            assert(fclose(fp) == 0);
+        }
+    }
+    snprintf(path, sizeof(path), "%s/d0/nested", root);
+    assert(mkdir(path, 0700) == 0 || generation > 0);
+    snprintf(path, sizeof(path), "%s/d0/nested/leaf", root);
+    write_host_file(path, "leaf");
+    // symbolic links are not imported, even one that makes a cycle
+    snprintf(path, sizeof(path), "%s/d0/nested/loop", root);
+    assert(symlink("..", path) == 0 || generation > 0);
+    snprintf(path, sizeof(path), "%s/d0/link", root);
+    assert(symlink("nested/leaf", path) == 0 || generation > 0);
+
+    snprintf(path, sizeof(path), "%s/wide", root);
+    assert(mkdir(path, 0700) == 0 || generation > 0);
+    for (size_t f = 0; f < WIDE_FILES; f++) {
+        char contents[16];
+        snprintf(path, sizeof(path), "%s/wide/w%zu", root, f);
+        snprintf(contents, sizeof(contents), "%zu", f);
+        write_host_file(path, contents);
+    }
+
+    long_name(name, 'l', MAX_FILE_NAME - 1);
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    write_host_file(path, "longest");
+    long_name(name, 'x', MAX_FILE_NAME);
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    write_host_file(path, "too long");
+    long_name(name, 'y', MAX_FILE_NAME);
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    assert(mkdir(path, 0700) == 0 || generation > 0);
+}
+
+static void remove_tree(void) {
+    char path[128];
+    for (size_t d = 0; d < DIR_COUNT; d++) {
+        for (size_t f = 0; f < FILES_PER_DIR; f++) {
+            host_path(path, sizeof(path), d, f);
+            assert(unlink(path) == 0);
+        }
+        if (d == 0) {
+            snprintf(path, sizeof(path), "%s/d0/nested/leaf", root);
+            assert(unlink(path) == 0);
+            snprintf(path, sizeof(path), "%s/d0/nested/loop", root);
+            assert(unlink(path) == 0);
+            snprintf(path, sizeof(path), "%s/d0/link", root);
+            assert(unlink(path) == 0);
+            snprintf(path, sizeof(path), "%s/d0/nested", root);
+            assert(rmdir(path) == 0);
+        }
+        snprintf(path, sizeof(path), "%s/d%zu", root, d);
+        assert(rmdir(path) == 0);
+    }
+    for (size_t f = 0; f < WIDE_FILES; f++) {
+        snprintf(path, sizeof(path), "%s/wide/w%zu", root, f);
+        assert(unlink(path) == 0);
+    }
+    snprintf(path, sizeof(path), "%s/wide", root);
+    assert(rmdir(path) == 0);
+
+    char name[MAX_FILE_NAME + 1];
+    long_name(name, 'l', MAX_FILE_NAME - 1);
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    assert(unlink(path) == 0);
+    long_name(name, 'x', MAX_FILE_NAME);
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    assert(unlink(path) == 0);
+    long_name(name, 'y', MAX_FILE_NAME);
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    assert(rmdir(path) == 0);
+    assert(rmdir(root) == 0);
+}
+
+static void check_tree(char const *dest, size_t generation) {
+    char path[128];
+    uint8_t buffer[9001];
+
+    for (size_t d = 0; d < DIR_COUNT; d++) {
+        for (size_t f = 0; f < FILES_PER_DIR; f++) {
+            snprintf(path, sizeof(path), "%s/d%zu/f%zu", dest, d, f);
+            int fh = tfs_open(path, 0);
+            assert(fh != -1);
+            assert(tfs_read(fh, buffer, sizeof(buffer)) ==
+                   (ssize_t)file_size(d, f));
+            for (size_t i = 0; i < file_size(d, f); i++) {
+                assert(buffer[i] == file_byte(d + generation, f, i));
+            }
+            assert(tfs_close(fh) != -1);
+        }
+    }
+    snprintf(path, sizeof(path), "%s/d0/nested/leaf", dest);
+    int fh = tfs_open(path, 0);
+    assert(fh != -1);
+    assert(tfs_read(fh, buffer, sizeof(buffer)) == 4);
+    assert(memcmp(buffer, "leaf", 4) == 0);
+    assert(tfs_close(fh) != -1);
+
+    for (size_t f = 0; f < WIDE_FILES; f++) {
+        char contents[16];
+        snprintf(path, sizeof(path), "%s/wide/w%zu", dest, f);
+        snprintf(contents, sizeof(contents), "%zu", f);
+        fh = tfs_open(path, 0);
+        assert(fh != -1);
+        assert(tfs_read(fh, buffer, sizeof(buffer)) ==
+               (ssize_t)strlen(contents));
+        assert(memcmp(buffer, contents, strlen(contents)) == 0);
+        assert(tfs_close(fh) != -1);
+    }
+
+    // the longest name is imported, the ones that are too long are not
+    char name[MAX_FILE_NAME + 1];
+    long_name(name, 'l', MAX_FILE_NAME - 1);
+    snprintf(path, sizeof(path), "%s/%s", dest, name);
+    fh = tfs_open(path, 0);
+    assert(fh != -1);
+    assert(tfs_read(fh, buffer, sizeof(buffer)) == 7);
+    assert(memcmp(buffer, "longest", 7) == 0);
+    assert(tfs_close(fh) != -1);
+    long_name(name, 'x', MAX_FILE_NAME - 1);
+    snprintf(path, sizeof(path), "%s/%s", dest, name);
+    assert(tfs_open(path, 0) == -1);
+
+    snprintf(path, sizeof(path), "%s/d0/link", dest);
+    assert(tfs_open(path, 0) == -1);
+    snprintf(path, sizeof(path), "%s/d0/nested/loop/leaf", dest);
+    assert(tfs_open(path, 0) == -1);
+}
+
+int main() {
+    assert(mkdtemp(root) != NULL);
+    make_tree(0);
+
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_block_count = 2048;
+    params.max_inode_count = 2048;
+    assert(tfs_init(&params) != -1);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    assert(tfs_import_tree(root, "/", 0) == 2); // two names are skipped
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (double)(end.tv_sec - start.tv_sec) +
+                     (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("imported %d files at %.0f files/s\n",
+           DIR_COUNT * FILES_PER_DIR + WIDE_FILES,
+           (DIR_COUNT * FILES_PER_DIR + WIDE_FILES) / seconds);
+    check_tree("", 0);
+
+    // importing into a subdirectory, and again over existing files
+    assert(tfs_mkdir("/copy") != -1);
+    assert(tfs_import_tree(root, "/copy", 3) == 2);
+    check_tree("/copy", 0);
+    make_tree(1);
+    assert(tfs_import_tree(root, "/copy", 3) == 2);
+    check_tree("/copy", 1);
+    check_tree("", 0);
+
+    // failures
+    assert(tfs_import_tree("/nonexistent", "/", 1) == -1);
+    assert(tfs_import_tree(root, "/missing", 1) == -1);
+    assert(tfs_import_tree(root, "/d0/f0", 1) == -1);
+
+    assert(tfs_destroy() != -1);
+    remove_tree();
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,111 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+
+#define CHURN_ROUNDS (2000)
+#define LIVE_INODES (4000)
+#define GROUP_SIZE (100)
+#define GROUPS_COMPARED (5)
+
+static double elapsed_us(struct timespec const *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (double)(end.tv_sec - start->tv_sec) * 1e6 +
+           (double)(end.tv_nsec - start->tv_nsec) / 1e3;
+}
+
+// Creates and unlinks the same file over and over, returning the average
+// latency of a create+unlink pair
+static double churn(size_t inode_count) {
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = inode_count;
+    assert(tfs_init(&params) != -1);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < CHURN_ROUNDS; i++) {
+        int f = tfs_open("/churn", TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+        assert(tfs_unlink("/churn") != -1);
+    }
+    double us = elapsed_us(&start) / CHURN_ROUNDS;
+
+    assert(tfs_destroy() != -1);
+    return us;
+}
+
+// Creates LIVE_INODES files that stay around, timing them by groups, and
+// returns the best group time among the first ones (in *early) and among the
+// last ones (in *late)
+static void fill(double *early, double *late) {
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = LIVE_INODES + 1;
+    params.block_size = 256 << 10; // room for every entry in the root
+    params.max_block_count = 4;
+    assert(tfs_init(&params) != -1);
+
+    *early = *late = -1;
+    for (int group = 0; group < LIVE_INODES / GROUP_SIZE; group++) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = group * GROUP_SIZE; i < (group + 1) * GROUP_SIZE; i++) {
+            char name[16];
+            snprintf(name, sizeof(name), "/f%d", i);
+            int f = tfs_open(name, TFS_O_CREAT);
+            assert(f != -1);
+            assert(tfs_close(f) != -1);
+        }
+        double us = elapsed_us(&start) / GROUP_SIZE;
+
+        double *best = NULL;
+        if (group < GROUPS_COMPARED) {
+            best = early;
+        } else if (group >= LIVE_INODES / GROUP_SIZE - GROUPS_COMPARED) {
+            best = late;
+        }
+        if (best != NULL && (*best < 0 || us < *best)) {
+            *best = us;
+        }
+    }
+
+    assert(tfs_destroy() != -1);
+}
+
+int main() {
+    // A full inode table refuses new files until an inode is released
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = 3;
+    assert(tfs_init(&params) != -1);
+
+    int f1 = tfs_open("/f1", TFS_O_CREAT);
+    int f2 = tfs_open("/f2", TFS_O_CREAT);
+    assert(f1 != -1 && f2 != -1);
+    assert(tfs_open("/f3", TFS_O_CREAT) == -1);
+    assert(tfs_close(f1) != -1);
+    assert(tfs_unlink("/f1") != -1);
+    int f3 = tfs_open("/f3", TFS_O_CREAT);
+    assert(f3 != -1);
+    assert(tfs_close(f2) != -1);
+    assert(tfs_close(f3) != -1);
+    assert(tfs_destroy() != -1);
+
+    // Allocation cost should not depend on the size of the inode table
+    double small = churn(64);
+    double large = churn(4 * 1024 * 1024);
+    printf("create+unlink: %.1f us (64 inodes), %.1f us (4M inodes)\n", small,
+           large);
+    assert(large < 2 * small);
+
+    // ... nor on the number of inodes already taken
+    double early, late;
+    fill(&early, &late);
+    printf("create: %.1f us (first inodes), %.1f us (%d inodes taken)\n",
+           early, late, LIVE_INODES);
+    assert(late < 2 * early);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
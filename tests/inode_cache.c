@@ -0,0 +1,120 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define BLOCK_SIZE (1024)
+#define BIG_BLOCKS (512)
+#define OPENERS (4)
+
+static uint64_t cache_accesses(void) {
+    tfs_cache_stats_t stats;
+    tfs_cache_stats(&stats);
+    return stats.cs_hits + stats.cs_misses;
+}
+
+static uint64_t cache_misses(void) {
+    tfs_cache_stats_t stats;
+    tfs_cache_stats(&stats);
+    return stats.cs_misses;
+}
+
+// Keeps opening and closing a file that other threads open too, so that
+// first references and last releases of its inode race
+static void *opener(void *arg) {
+    (void)arg;
+    for (int i = 0; i < 2000; i++) {
+        int f = tfs_open("/d/f", 0);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+    return NULL;
+}
+
+/**
+ * Push everything out of the cache (except what is pinned), by writing and
+ * reading a file larger than it.
+ */
+static void churn(void) {
+    static uint8_t big[BIG_BLOCKS * BLOCK_SIZE];
+    memset(big, 'b', sizeof(big));
+    int h = tfs_open("/big", TFS_O_CREAT | TFS_O_TRUNC);
+    assert(h != -1);
+    assert(tfs_write(h, big, sizeof(big)) == sizeof(big));
+    assert(tfs_close(h) != -1);
+    h = tfs_open("/big", 0);
+    assert(h != -1);
+    assert(tfs_read(h, big, sizeof(big)) == sizeof(big));
+    assert(tfs_close(h) != -1);
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.cache_size = 64; // one entry per shard, so everything else churns
+    params.readahead_max_blocks = 0;
+    assert(tfs_init(&params) != -1);
+
+    assert(tfs_mkdir("/d") != -1);
+    int f = tfs_open("/d/f", TFS_O_CREAT);
+    assert(f != -1);
+    // Look the name up once, so that the dentry cache has it
+    int f2 = tfs_open("/d/f", 0);
+    assert(f2 != -1);
+    assert(tfs_close(f2) != -1);
+    int g = tfs_open("/g", TFS_O_CREAT);
+    assert(g != -1);
+    assert(tfs_close(g) != -1);
+
+    // Operations on an open file find its inode in memory
+    uint64_t before = cache_accesses();
+    char c;
+    for (int i = 0; i < 1000; i++) {
+        assert(tfs_read(f, &c, 1) == 0);
+    }
+    assert(cache_accesses() == before);
+
+    // Push everything else out of the cache
+    churn();
+    tfs_cache_stats_t stats;
+    tfs_cache_stats(&stats);
+    assert(stats.cs_evictions > 0);
+
+    // The inode of the open file stayed cached, and so does it once closed
+    // until something else needs its place; the closed file's did not
+    assert(tfs_close(f) != -1);
+    before = cache_misses();
+    f = tfs_open("/d/f", 0);
+    assert(f != -1);
+    assert(cache_misses() == before);
+    g = tfs_open("/g", 0);
+    assert(g != -1);
+    assert(cache_misses() > before);
+
+    assert(tfs_close(f) != -1);
+    assert(tfs_close(g) != -1);
+    assert(tfs_close(g) == -1); // references are only dropped once
+
+    // Once every reference taken by racing threads is dropped, the inode is
+    // no longer pinned, and goes like anything else
+    pthread_t openers[OPENERS];
+    for (int i = 0; i < OPENERS; i++) {
+        assert(pthread_create(&openers[i], NULL, opener, NULL) == 0);
+    }
+    for (int i = 0; i < OPENERS; i++) {
+        assert(pthread_join(openers[i], NULL) == 0);
+    }
+    churn();
+    before = cache_misses();
+    f = tfs_open("/d/f", 0);
+    assert(f != -1);
+    assert(cache_misses() > before);
+    assert(tfs_close(f) != -1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
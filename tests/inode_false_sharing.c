@@ -0,0 +1,127 @@
+#define _DEFAULT_SOURCE // syscall
+#include "fs/operations.h"
+#include <assert.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define THREAD_COUNT (4)
+#define WRITES_PER_THREAD (20000)
+#define RECORD_SIZE (16)
+
+static pthread_barrier_t barrier;
+
+// Each thread overwrites the start of its own file, so that the threads share
+// nothing but neighbouring inodes (created one after the other)
+static void *writer(void *arg) {
+    int f = *(int *)arg;
+    uint8_t record[RECORD_SIZE];
+    memset(record, (int)f, sizeof(record));
+
+    pthread_barrier_wait(&barrier);
+    for (int i = 0; i < WRITES_PER_THREAD; i++) {
+        assert(tfs_pwrite(f, record, sizeof(record), 0) == sizeof(record));
+    }
+    return NULL;
+}
+
+/**
+ * Open a hardware counter for the calling process and the threads it creates
+ * from then on.
+ *
+ * Returns the counter's file descriptor, or -1 if counters are not available
+ * (e.g., in a virtual machine, or not allowed by perf_event_paranoid).
+ */
+static int counter_open(uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t counter_read(int fd) {
+    uint64_t value = 0;
+    if (fd != -1) {
+        assert(read(fd, &value, sizeof(value)) == sizeof(value));
+    }
+    return value;
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.writeback_size = 0; // every write reaches the inode
+    params.readahead_max_blocks = 0;
+    assert(tfs_init(&params) != -1);
+
+    int f[THREAD_COUNT];
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "/f%d", i);
+        f[i] = tfs_open(name, TFS_O_CREAT);
+        assert(f[i] != -1);
+    }
+
+    int misses = counter_open(PERF_COUNT_HW_CACHE_MISSES);
+    int references = counter_open(PERF_COUNT_HW_CACHE_REFERENCES);
+    pthread_t threads[THREAD_COUNT];
+    assert(pthread_barrier_init(&barrier, NULL, THREAD_COUNT + 1) == 0);
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_create(&threads[i], NULL, writer, &f[i]) == 0);
+    }
+
+    struct timespec start, end;
+    if (misses != -1 && references != -1) {
+        ioctl(misses, PERF_EVENT_IOC_ENABLE, 0);
+        ioctl(references, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_barrier_wait(&barrier);
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    assert(pthread_barrier_destroy(&barrier) == 0);
+
+    // The counts are only reported: they depend on the cores available to
+    // the test (and on the hardware exposing counters at all)
+    double seconds = (double)(end.tv_sec - start.tv_sec) +
+                     (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%d threads: %.0f writes/s\n", THREAD_COUNT,
+           THREAD_COUNT * WRITES_PER_THREAD / seconds);
+    if (misses != -1 && references != -1) {
+        uint64_t m = counter_read(misses);
+        uint64_t r = counter_read(references);
+        printf("cache misses %llu of %llu references (%.2f per write)\n",
+               (unsigned long long)m, (unsigned long long)r,
+               (double)m / (THREAD_COUNT * WRITES_PER_THREAD));
+        close(misses);
+        close(references);
+    } else {
+        printf("hardware counters not available\n");
+    }
+
+    uint8_t record[RECORD_SIZE];
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        assert(tfs_pread(f[i], record, sizeof(record), 0) == sizeof(record));
+        assert(record[0] == (uint8_t)f[i]);
+        assert(record[RECORD_SIZE - 1] == record[0]);
+        assert(tfs_close(f[i]) != -1);
+    }
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,263 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BLOCK_SIZE (1024)
+#define BLOCK_COUNT (256)
+#define INODE_COUNT (1024)
+#define THREAD_COUNT (8)
+#define FILES_PER_THREAD (200)
+
+static char image_path[] = "/tmp/tfs_journalXXXXXX";
+static char journal_path[sizeof(image_path) + sizeof(".journal")];
+static char backup_path[sizeof(image_path) + sizeof(".bak")];
+
+static void copy_file(char const *source, char const *dest) {
+    int in = open(source, O_RDONLY);
+    int out = open(dest, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(in != -1 && out != -1);
+    char buffer[65536];
+    ssize_t n;
+    while ((n = read(in, buffer, sizeof(buffer))) > 0) {
+        assert(write(out, buffer, (size_t)n) == n);
+    }
+    assert(n == 0);
+    assert(close(in) == 0 && close(out) == 0);
+}
+
+static bool files_equal(char const *a, char const *b) {
+    int fa = open(a, O_RDONLY);
+    int fb = open(b, O_RDONLY);
+    assert(fa != -1 && fb != -1);
+    char buffer_a[65536], buffer_b[65536];
+    bool equal = true;
+    ssize_t n;
+    while (equal && (n = read(fa, buffer_a, sizeof(buffer_a))) > 0) {
+        equal = read(fb, buffer_b, (size_t)n) == n &&
+                memcmp(buffer_a, buffer_b, (size_t)n) == 0;
+    }
+    equal = equal && n == 0 && read(fb, buffer_b, 1) == 0;
+    assert(close(fa) == 0 && close(fb) == 0);
+    return equal;
+}
+
+// Counts the blocks a new file can get, and removes it
+static size_t free_blocks(void) {
+    char block[BLOCK_SIZE] = {0};
+    int f = tfs_open("/fill", TFS_O_CREAT);
+    assert(f != -1);
+    size_t count = 0;
+    while (tfs_write(f, block, sizeof(block)) == sizeof(block)) {
+        count++;
+    }
+    assert(tfs_close(f) != -1);
+    assert(tfs_unlink("/fill") != -1);
+    return count;
+}
+
+static void check_size(char const *path, ssize_t size) {
+    char buffer[BLOCK_SIZE];
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == size);
+    assert(tfs_close(f) != -1);
+}
+
+static void *create_files(void *arg) {
+    int id = *(int *)arg;
+    char dir[16];
+    snprintf(dir, sizeof(dir), "/t%d", id);
+    assert(tfs_mkdir(dir) != -1);
+
+    // Each file is removed again, so that directories do not fill up
+    for (int i = 0; i < FILES_PER_THREAD; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "%s/f%d", dir, i);
+        int f = tfs_open(name, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+        if (i + 1 < FILES_PER_THREAD) {
+            assert(tfs_unlink(name) != -1);
+        }
+    }
+    return NULL;
+}
+
+static double create_run(tfs_params const *params) {
+    assert(tfs_init(params) != -1);
+
+    pthread_t threads[THREAD_COUNT];
+    int ids[THREAD_COUNT];
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        ids[i] = i;
+        assert(pthread_create(&threads[i], NULL, create_files, &ids[i]) == 0);
+    }
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // every file made it, whatever the durability level
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "/t%d/f%d", i, FILES_PER_THREAD - 1);
+        check_size(name, 0);
+    }
+    assert(tfs_destroy() != -1);
+    assert(unlink(image_path) == 0);
+
+    double seconds = (double)(end.tv_sec - start.tv_sec) +
+                     (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    return THREAD_COUNT * FILES_PER_THREAD / seconds;
+}
+
+int main() {
+    int fd = mkstemp(image_path);
+    assert(fd != -1);
+    assert(close(fd) == 0);
+    snprintf(journal_path, sizeof(journal_path), "%s.journal", image_path);
+    snprintf(backup_path, sizeof(backup_path), "%s.bak", image_path);
+
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_block_count = BLOCK_COUNT;
+    params.max_inode_count = INODE_COUNT;
+    params.image_path = image_path;
+
+    // start from a cleanly shut down image, and keep a copy of it
+    assert(tfs_init(&params) != -1);
+    assert(tfs_mkdir("/dir") != -1);
+    assert(tfs_destroy() != -1);
+    copy_file(image_path, backup_path);
+
+    // metadata only reaches the image once checkpointed, from the journal: a
+    // process that crashes leaves the image as it was, and a file it unlinked
+    // while borrowing it is dropped, blocks and all, when attaching the image
+    assert(tfs_init(&params) != -1);
+    size_t free_count = free_blocks();
+    assert(tfs_destroy() != -1);
+    copy_file(image_path, backup_path);
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        assert(tfs_init(&params) != -1);
+        assert(tfs_mkdir("/meta") != -1);
+        int f = tfs_open("/meta/empty", TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+        assert(tfs_sym_link("/meta/empty", "/meta/soft") != -1);
+        f = tfs_open("/borrowed", TFS_O_CREAT);
+        assert(f != -1);
+        char block[BLOCK_SIZE] = {0};
+        for (int i = 0; i < 8; i++) {
+            assert(tfs_write(f, block, sizeof(block)) == sizeof(block));
+        }
+        tfs_borrow_t borrow;
+        assert(tfs_borrow(f, BLOCK_SIZE, 0, &borrow) > 0);
+        assert(tfs_unlink("/borrowed") != -1);
+        assert(tfs_sync(TFS_DURABILITY_SYNCED) != -1);
+        _exit(0); // no tfs_destroy
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    // (file data is written through, but the blocks were zeroed already)
+    assert(files_equal(image_path, backup_path));
+    assert(tfs_init(&params) != -1);
+    check_size("/meta/empty", 0);
+    check_size("/meta/soft", 0);
+    assert(tfs_open("/borrowed", 0) == -1);
+    // all but the block of /meta (and an overflow extent block, if /fill
+    // ends up fragmented)
+    assert(free_blocks() + 2 >= free_count);
+    assert(tfs_destroy() != -1);
+    copy_file(image_path, backup_path);
+
+    // a process changes the metadata and crashes
+    pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        assert(tfs_init(&params) != -1);
+        int f = tfs_open("/dir/file", TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, "hello", 5) == 5);
+        assert(tfs_close(f) != -1);
+        assert(tfs_link("/dir/file", "/hard") != -1);
+        assert(tfs_sym_link("/dir/file", "/soft") != -1);
+        assert(tfs_mkdir("/other") != -1);
+        assert(tfs_rmdir("/other") != -1);
+        _exit(0); // no tfs_destroy
+    }
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    // none of the image's pages reached storage, but the journal did: the
+    // metadata is recovered by replaying it (file data is not journaled, so
+    // only the sizes are checked)
+    copy_file(backup_path, image_path);
+    struct stat st;
+    assert(stat(journal_path, &st) == 0 && st.st_size > 0);
+
+    // a transaction torn by the crash is ignored
+    fd = open(journal_path, O_WRONLY | O_APPEND);
+    assert(fd != -1);
+    assert(write(fd, "torn transaction", 16) == 16);
+    assert(close(fd) == 0);
+
+    assert(tfs_init(&params) != -1);
+    check_size("/dir/file", 5);
+    check_size("/hard", 5);
+    check_size("/soft", 5);
+    assert(tfs_open("/other", 0) == -1);
+    assert(tfs_mkdir("/other") != -1);
+
+    // the replayed hard link count is right: the inode outlives one unlink
+    assert(tfs_unlink("/dir/file") != -1);
+    check_size("/hard", 5);
+    assert(tfs_unlink("/hard") != -1);
+    assert(tfs_open("/soft", 0) == -1);
+
+    // syncing works at every level, for the whole file system and one file
+    int f = tfs_open("/synced", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "data", 4) == 4);
+    assert(tfs_sync(TFS_DURABILITY_NONE) != -1);
+    assert(tfs_sync(TFS_DURABILITY_WRITTEN) != -1);
+    assert(tfs_sync(TFS_DURABILITY_SYNCED) != -1);
+    assert(tfs_fsync(f, TFS_DURABILITY_SYNCED) != -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_fsync(f, TFS_DURABILITY_SYNCED) == -1);
+    assert(tfs_destroy() != -1);
+
+    // a clean shutdown leaves the journal empty
+    assert(stat(journal_path, &st) == 0 && st.st_size == 0);
+    assert(unlink(image_path) == 0);
+
+    // concurrent commits are grouped, at every durability level
+    tfs_durability_t const levels[] = {TFS_DURABILITY_NONE,
+                                       TFS_DURABILITY_WRITTEN,
+                                       TFS_DURABILITY_SYNCED};
+    char const *const names[] = {"none", "written", "synced"};
+    for (size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); i++) {
+        params.durability = levels[i];
+        printf("%-8s %10.0f creates/s\n", names[i], create_run(&params));
+    }
+
+    assert(unlink(journal_path) == 0);
+    assert(unlink(backup_path) == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,74 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BLOCK_COUNT ((size_t)1 << 26) // 64 GiB of 1 KiB blocks
+#define INODE_COUNT ((size_t)1 << 20)
+#define FILE_SIZE (256 << 10)
+
+/**
+ * Obtain the memory the process has committed (its resident set), in bytes.
+ */
+static size_t resident(void) {
+    FILE *statm = fopen("/proc/self/statm", "r");
+    assert(statm != NULL);
+    size_t total, pages;
+    assert(fscanf(statm, "%zu %zu", &total, &pages) == 2);
+    fclose(statm);
+    return pages * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static uint8_t contents[FILE_SIZE];
+static uint8_t buffer[FILE_SIZE];
+
+int main() {
+    for (size_t i = 0; i < sizeof(contents); i++) {
+        contents[i] = (uint8_t)(i % 239);
+    }
+
+    tfs_params params = tfs_default_params();
+    params.max_block_count = BLOCK_COUNT;
+    params.max_inode_count = INODE_COUNT;
+
+    // The tables are committed as they are used, not up front
+    size_t before = resident();
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    assert(tfs_init(&params) != -1);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    size_t grown = resident() - before;
+    printf("init of %zu blocks and %zu inodes: %.1f ms, %zu KiB committed\n",
+           BLOCK_COUNT, INODE_COUNT,
+           (double)(end.tv_sec - start.tv_sec) * 1e3 +
+               (double)(end.tv_nsec - start.tv_nsec) / 1e6,
+           grown >> 10);
+    assert(grown < (128 << 20));
+
+    // Everything works as usual
+    char name[16];
+    for (int i = 0; i < 4; i++) {
+        snprintf(name, sizeof(name), "/f%d", i);
+        int f = tfs_open(name, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, contents, sizeof(contents)) == sizeof(contents));
+        assert(tfs_close(f) != -1);
+    }
+    for (int i = 0; i < 4; i++) {
+        snprintf(name, sizeof(name), "/f%d", i);
+        int f = tfs_open(name, 0);
+        assert(f != -1);
+        assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(buffer));
+        assert(memcmp(buffer, contents, sizeof(contents)) == 0);
+        assert(tfs_close(f) != -1);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
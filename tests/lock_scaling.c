@@ -0,0 +1,94 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_THREADS (8)
+#define OPS_PER_THREAD (2000)
+#define FILE_SIZE (256)
+
+static uint8_t const contents[FILE_SIZE] = {1, 2, 3, 4};
+
+// each thread works in its own directory, so no two threads ever need the
+// same directory or file lock
+static void *worker(void *arg) {
+    size_t id = (size_t)arg;
+    char path[32];
+    uint8_t buffer[FILE_SIZE];
+
+    for (size_t i = 0; i < OPS_PER_THREAD; i++) {
+        snprintf(path, sizeof(path), "/d%zu/f%zu", id, i % 8);
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, contents, FILE_SIZE) == FILE_SIZE);
+        assert(tfs_close(f) != -1);
+
+        f = tfs_open(path, 0);
+        assert(f != -1);
+        assert(tfs_read(f, buffer, FILE_SIZE) == FILE_SIZE);
+        assert(memcmp(buffer, contents, FILE_SIZE) == 0);
+        assert(tfs_close(f) != -1);
+
+        assert(tfs_unlink(path) != -1);
+    }
+    return NULL;
+}
+
+static double run(size_t thread_count) {
+    pthread_t threads[MAX_THREADS];
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < thread_count; i++) {
+        assert(pthread_create(&threads[i], NULL, worker, (void *)i) == 0);
+    }
+    for (size_t i = 0; i < thread_count; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (double)(end.tv_sec - start.tv_sec) +
+           (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    char path[16];
+    for (size_t i = 0; i < MAX_THREADS; i++) {
+        snprintf(path, sizeof(path), "/d%zu", i);
+        assert(tfs_mkdir(path) != -1);
+    }
+
+    // Throughput is only reported, as how well it scales depends on the cores
+    // available to the test. What does not is that the locks all threads
+    // share (the inode bitmap and block pool locks) are held so briefly that
+    // threads seldom wait for them
+    for (size_t threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        tfs_lock_stats_t before, after;
+        tfs_lock_stats(&before);
+        double seconds = run(threads);
+        tfs_lock_stats(&after);
+
+        uint64_t acquired = after.ls_acquired - before.ls_acquired;
+        uint64_t contended = after.ls_contended - before.ls_contended;
+        printf("%zu threads: %.0f ops/s, %llu of %llu shared lock "
+               "acquisitions contended\n",
+               threads, (double)(threads * OPS_PER_THREAD) / seconds,
+               (unsigned long long)contended, (unsigned long long)acquired);
+        assert(acquired >= threads * OPS_PER_THREAD);
+        if (threads == 1) {
+            assert(contended == 0);
+        }
+        assert(contended * 50 <= acquired);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,137 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FILE_SIZE (8 * 1024 * 1024)
+#define CHUNK_SIZE (3000)
+
+char const path1[] = "/f1";
+char const path2[] = "/f2";
+
+static uint8_t pattern(size_t i, size_t seed) {
+    return (uint8_t)((i * 31 + seed) % 251);
+}
+
+void write_pattern(char const *path, size_t size, size_t seed) {
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+
+    uint8_t chunk[CHUNK_SIZE];
+    for (size_t done = 0; done < size;) {
+        size_t n = size - done < CHUNK_SIZE ? size - done : CHUNK_SIZE;
+        for (size_t i = 0; i < n; i++) {
+            chunk[i] = pattern(done + i, seed);
+        }
+        assert(tfs_write(f, chunk, n) == n);
+        done += n;
+    }
+
+    assert(tfs_close(f) != -1);
+}
+
+void check_pattern(char const *path, size_t size, size_t seed) {
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+
+    uint8_t *buffer = malloc(size + 1);
+    assert(buffer != NULL);
+    assert(tfs_read(f, buffer, size + 1) == size);
+    for (size_t i = 0; i < size; i++) {
+        assert(buffer[i] == pattern(i, seed));
+    }
+    free(buffer);
+
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_block_count = 2 * FILE_SIZE / params.block_size + 16;
+    assert(tfs_init(&params) != -1);
+
+    // a file much larger than a single block
+    write_pattern(path1, FILE_SIZE, 1);
+    check_pattern(path1, FILE_SIZE, 1);
+
+    // interleave two growing files so that their extents get fragmented
+    int f1 = tfs_open(path1, TFS_O_TRUNC);
+    int f2 = tfs_open(path2, TFS_O_CREAT);
+    assert(f1 != -1 && f2 != -1);
+    uint8_t chunk[CHUNK_SIZE];
+    for (size_t done = 0; done < 64 * CHUNK_SIZE; done += CHUNK_SIZE) {
+        for (size_t i = 0; i < CHUNK_SIZE; i++) {
+            chunk[i] = pattern(done + i, 2);
+        }
+        assert(tfs_write(f1, chunk, CHUNK_SIZE) == CHUNK_SIZE);
+        for (size_t i = 0; i < CHUNK_SIZE; i++) {
+            chunk[i] = pattern(done + i, 3);
+        }
+        assert(tfs_write(f2, chunk, CHUNK_SIZE) == CHUNK_SIZE);
+    }
+    assert(tfs_close(f1) != -1);
+    assert(tfs_close(f2) != -1);
+    check_pattern(path1, 64 * CHUNK_SIZE, 2);
+    check_pattern(path2, 64 * CHUNK_SIZE, 3);
+
+    // truncating and unlinking must give every block back
+    assert(tfs_unlink(path2) != -1);
+    write_pattern(path1, FILE_SIZE, 4);
+    check_pattern(path1, FILE_SIZE, 4);
+    assert(tfs_unlink(path1) != -1);
+    write_pattern(path2, 2 * FILE_SIZE, 5);
+    check_pattern(path2, 2 * FILE_SIZE, 5);
+    assert(tfs_unlink(path2) != -1);
+
+    // two files flushed a block at a time in turn get every other block, and
+    // as many extents as blocks
+    size_t block_size = params.block_size;
+    size_t blocks = FILE_SIZE / 2 / block_size;
+    f1 = tfs_open(path1, TFS_O_CREAT);
+    f2 = tfs_open(path2, TFS_O_CREAT);
+    assert(f1 != -1 && f2 != -1);
+    uint8_t *block = malloc(block_size);
+    assert(block != NULL);
+    for (size_t b = 0; b < blocks; b++) {
+        for (size_t i = 0; i < block_size; i++) {
+            block[i] = pattern(b * block_size + i, 6);
+        }
+        assert(tfs_write(f1, block, block_size) == (ssize_t)block_size);
+        assert(tfs_fsync(f1, TFS_DURABILITY_NONE) != -1);
+        assert(tfs_write(f2, block, block_size) == (ssize_t)block_size);
+        assert(tfs_fsync(f2, TFS_DURABILITY_NONE) != -1);
+    }
+    assert(tfs_close(f1) != -1);
+    assert(tfs_close(f2) != -1);
+    check_pattern(path1, blocks * block_size, 6);
+
+    // with the rest of the space taken, removing one leaves only single
+    // block holes, which a multi-megabyte file still fills (its extents
+    // spilling over several overflow extent blocks)
+    int rest = tfs_open("/rest", TFS_O_CREAT);
+    assert(rest != -1);
+    while (tfs_write(rest, block, block_size) == (ssize_t)block_size) {
+    }
+    assert(tfs_close(rest) != -1);
+    assert(tfs_unlink(path2) != -1);
+    size_t scattered = (blocks - blocks / 16) * block_size;
+    write_pattern(path2, scattered, 7);
+    check_pattern(path2, scattered, 7);
+    check_pattern(path1, blocks * block_size, 6);
+    free(block);
+
+    // and every block, overflow extent blocks included, comes back
+    assert(tfs_unlink(path1) != -1);
+    assert(tfs_unlink(path2) != -1);
+    assert(tfs_unlink("/rest") != -1);
+    write_pattern(path1, 2 * FILE_SIZE, 8);
+    check_pattern(path1, 2 * FILE_SIZE, 8);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
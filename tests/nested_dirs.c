@@ -0,0 +1,146 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define OPEN_ROUNDS (200)
+#define RMDIR_ROUNDS (500)
+
+char const deep_dirs[][32] = {"/a", "/a/b", "/a/b/c", "/a/b/c/d", "/a/b/c/d/e"};
+char const deep_file[] = "/a/b/c/d/e/file";
+
+static void write_str(char const *path, char const *str) {
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_write(f, str, strlen(str)) == strlen(str));
+    assert(tfs_close(f) != -1);
+}
+
+static void assert_contents(char const *path, char const *str) {
+    char buffer[64];
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == strlen(str));
+    assert(memcmp(buffer, str, strlen(str)) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+static double open_close_us(char const *path) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < OPEN_ROUNDS; i++) {
+        int f = tfs_open(path, 0);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return ((double)(end.tv_sec - start.tv_sec) * 1e6 +
+            (double)(end.tv_nsec - start.tv_nsec) / 1e3) /
+           OPEN_ROUNDS;
+}
+
+static pthread_barrier_t barrier;
+static bool linked;
+
+// Links a file into a directory that is being removed
+static void *linker(void *arg) {
+    (void)arg;
+    pthread_barrier_wait(&barrier);
+    linked = tfs_link("/file", "/r/link") != -1;
+    return NULL;
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    // parents must exist
+    assert(tfs_mkdir("/x/y") == -1);
+    assert(tfs_open("/x/f", TFS_O_CREAT) == -1);
+
+    for (size_t i = 0; i < sizeof(deep_dirs) / sizeof(deep_dirs[0]); i++) {
+        assert(tfs_mkdir(deep_dirs[i]) != -1);
+    }
+    assert(tfs_mkdir("/a/b") == -1); // already exists
+
+    write_str(deep_file, "deep contents");
+    write_str("/a/file", "shallow contents");
+    assert_contents(deep_file, "deep contents");
+    assert_contents("/a/file", "shallow contents");
+    assert_contents("//a//b/c/d/e/file", "deep contents");
+
+    // directories are not files, and files are not directories
+    assert(tfs_open("/a/b", 0) == -1);
+    assert(tfs_open("/a/file/x", TFS_O_CREAT) == -1);
+    assert(tfs_unlink("/a/b") == -1);
+
+    // the same name in different directories refers to different files
+    write_str("/a/b/file", "other contents");
+    assert_contents("/a/file", "shallow contents");
+    assert_contents("/a/b/file", "other contents");
+
+    // links across directories
+    assert(tfs_link(deep_file, "/a/b/hard") != -1);
+    assert(tfs_sym_link("/a/b/c/d/e/file", "/soft") != -1);
+    assert_contents("/a/b/hard", "deep contents");
+    assert_contents("/soft", "deep contents");
+
+    printf("deep open+close: %.1f us\n", open_close_us(deep_file));
+
+    // unlinking must not leave stale dentries behind
+    assert(tfs_unlink(deep_file) != -1);
+    assert(tfs_open(deep_file, 0) == -1);
+    assert(tfs_open("/soft", 0) == -1);
+    assert_contents("/a/b/hard", "deep contents");
+    write_str(deep_file, "new contents");
+    assert_contents(deep_file, "new contents");
+    assert_contents("/soft", "new contents");
+    assert_contents("/a/b/hard", "deep contents");
+
+    // only empty directories can be removed
+    assert(tfs_rmdir("/a/b/c/d/e") == -1);
+    assert(tfs_unlink(deep_file) != -1);
+    assert(tfs_rmdir("/a/b/c/d/e") != -1);
+    assert(tfs_open(deep_file, 0) == -1);
+    assert(tfs_open(deep_file, TFS_O_CREAT) == -1);
+    assert(tfs_rmdir("/a/b/c/d/e") == -1);
+
+    // the name can be reused by a file, and the old path stays dead
+    write_str("/a/b/c/d/e", "not a directory");
+    assert_contents("/a/b/c/d/e", "not a directory");
+    assert(tfs_open(deep_file, TFS_O_CREAT) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    // a name added while its directory is removed either keeps the
+    // directory alive or is refused, and is never lost with the directory
+    assert(tfs_init(NULL) != -1);
+    write_str("/file", "linked contents");
+    for (int i = 0; i < RMDIR_ROUNDS; i++) {
+        assert(tfs_mkdir("/r") != -1);
+        assert(pthread_barrier_init(&barrier, NULL, 2) == 0);
+        pthread_t thread;
+        assert(pthread_create(&thread, NULL, linker, NULL) == 0);
+        pthread_barrier_wait(&barrier);
+        bool removed = tfs_rmdir("/r") != -1;
+        assert(pthread_join(thread, NULL) == 0);
+        assert(pthread_barrier_destroy(&barrier) == 0);
+
+        assert(removed != linked);
+        if (linked) {
+            assert_contents("/r/link", "linked contents");
+            assert(tfs_unlink("/r/link") != -1);
+            assert(tfs_rmdir("/r") != -1);
+        }
+    }
+    // only the original name is left, so unlinking it frees the file
+    assert(tfs_unlink("/file") != -1);
+    assert(tfs_open("/file", 0) == -1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,126 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define BLOCK_SIZE (1024)
+#define BLOCK_COUNT (1024)
+#define FILE_BLOCKS (300)
+
+static uint8_t contents[FILE_BLOCKS * BLOCK_SIZE];
+
+static void write_file(char const *path) {
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, contents, sizeof(contents)) == sizeof(contents));
+    assert(tfs_close(f) != -1);
+}
+
+static void check_file(char const *path) {
+    static uint8_t buffer[sizeof(contents)];
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(memcmp(buffer, contents, sizeof(contents)) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    for (size_t i = 0; i < sizeof(contents); i++) {
+        contents[i] = (uint8_t)(i % 241);
+    }
+
+    // By default, there is a single pool of free blocks
+    assert(tfs_init(NULL) != -1);
+    tfs_alloc_stats_t stats;
+    tfs_alloc_stats(&stats);
+    assert(stats.as_nodes == 1);
+    write_file("/f");
+    check_file("/f");
+    tfs_alloc_stats(&stats);
+    assert(stats.as_local >= FILE_BLOCKS && stats.as_remote == 0);
+    assert(tfs_destroy() != -1);
+
+    // Split over two nodes (whether the host has them or not), on huge pages
+    // if there are any, faulted in up front
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_block_count = BLOCK_COUNT;
+    params.huge_pages = true;
+    params.prefault = true;
+    params.numa_nodes = 2;
+    assert(tfs_init(&params) != -1);
+    tfs_alloc_stats(&stats);
+    assert(stats.as_nodes == 2);
+
+    // A thread allocates from its own node's half while it has blocks left,
+    // and then from the other half
+    write_file("/f1");
+    tfs_alloc_stats(&stats);
+    assert(stats.as_local >= FILE_BLOCKS && stats.as_remote == 0);
+    write_file("/f2");
+    write_file("/f3");
+    tfs_alloc_stats(&stats);
+    printf("%llu blocks allocated locally, %llu remotely\n",
+           (unsigned long long)stats.as_local,
+           (unsigned long long)stats.as_remote);
+    assert(stats.as_local <= BLOCK_COUNT / 2);
+    assert(stats.as_remote > 0);
+    check_file("/f1");
+    check_file("/f2");
+    check_file("/f3");
+
+    // Freed blocks go back to their own half, so the local one has room
+    // again
+    assert(tfs_unlink("/f1") != -1);
+    assert(tfs_unlink("/f2") != -1);
+    assert(tfs_unlink("/f3") != -1);
+    uint64_t local = stats.as_local;
+    write_file("/f4");
+    check_file("/f4");
+    tfs_alloc_stats(&stats);
+    assert(stats.as_local > local);
+
+    assert(tfs_destroy() != -1);
+
+    // Nodes past MAX_NUMA_NODES share sub-pools
+    params.huge_pages = false;
+    params.prefault = false;
+    params.max_block_count = 100 * 64;
+    params.numa_nodes = MAX_NUMA_NODES + 1;
+    assert(tfs_init(&params) != -1);
+    tfs_alloc_stats(&stats);
+    assert(stats.as_nodes == MAX_NUMA_NODES);
+    write_file("/f1");
+    check_file("/f1");
+    assert(tfs_destroy() != -1);
+
+    // Sub-pools that do not divide the blocks evenly still get some each, so
+    // every block can be allocated
+    params.max_block_count = 10 * 64;
+
+    params.numa_nodes = 8;
+    assert(tfs_init(&params) != -1);
+    tfs_alloc_stats(&stats);
+    assert(stats.as_nodes == 8);
+    write_file("/f1");
+    write_file("/f2");
+    int f = tfs_open("/rest", TFS_O_CREAT);
+    assert(f != -1);
+    uint8_t block[BLOCK_SIZE];
+    size_t blocks = 0;
+    while (tfs_write(f, block, sizeof(block)) == sizeof(block)) {
+        blocks++;
+    }
+    assert(tfs_close(f) != -1);
+    tfs_alloc_stats(&stats);
+    assert(stats.as_local + stats.as_remote == 10 * 64);
+    check_file("/f1");
+    check_file("/f2");
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
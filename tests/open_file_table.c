@@ -0,0 +1,93 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define HANDLE_COUNT (200000)
+#define THREAD_COUNT (8)
+#define ROUNDS (2000)
+
+static void *churn(void *arg) {
+    (void)arg;
+    for (size_t i = 0; i < ROUNDS; i++) {
+        int f = tfs_open("/f", 0);
+        assert(f != -1);
+        assert(tfs_write(f, "x", 1) == 1);
+        assert(tfs_close(f) != -1);
+        // the slot may already be reused by another thread, but never under
+        // the same handle
+        assert(tfs_close(f) == -1);
+        assert(tfs_write(f, "x", 1) == -1);
+    }
+    return NULL;
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    int f = tfs_open("/f", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+
+    // hundreds of thousands of handles can be open at once
+    int *handles = malloc(HANDLE_COUNT * sizeof(int));
+    assert(handles != NULL);
+    for (size_t i = 0; i < HANDLE_COUNT; i++) {
+        handles[i] = tfs_open("/f", 0);
+        assert(handles[i] != -1);
+    }
+    for (size_t i = 0; i < HANDLE_COUNT; i++) {
+        assert(tfs_close(handles[i]) != -1);
+    }
+
+    // a closed handle stays invalid when its slot is reused
+    int stale = handles[HANDLE_COUNT - 1];
+    f = tfs_open("/f", 0);
+    assert(f != -1 && f != stale);
+    char c;
+    assert(tfs_read(stale, &c, 1) == -1);
+    assert(tfs_close(stale) == -1);
+    assert(tfs_close(f) != -1);
+    free(handles);
+
+    // invalid handles are rejected
+    assert(tfs_close(-1) == -1);
+    assert(tfs_close(0) == -1);
+    assert(tfs_read(0x7fffffff, &c, 1) == -1);
+
+    pthread_t threads[THREAD_COUNT];
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_create(&threads[i], NULL, churn, NULL) == 0);
+    }
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    // a small table fills up, and closing a handle makes room again
+    tfs_params params = tfs_default_params();
+    params.max_open_files_count = 2;
+    assert(tfs_init(&params) != -1);
+    f = tfs_open("/f", TFS_O_CREAT);
+    int g = tfs_open("/f", 0);
+    assert(f != -1 && g != -1);
+    assert(tfs_open("/f", 0) == -1);
+    assert(tfs_close(g) != -1);
+    assert(tfs_open("/f", 0) != -1);
+    assert(tfs_destroy() != -1);
+
+    // a table larger than file handles can address is refused, leaving the
+    // file system ready to be initialized again
+    params.max_open_files_count = (size_t)1 << 21;
+    assert(tfs_init(&params) == -1);
+    params.max_open_files_count = 2;
+    assert(tfs_init(&params) != -1);
+    assert(tfs_open("/f", TFS_O_CREAT) != -1);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
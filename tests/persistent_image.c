@@ -0,0 +1,123 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BLOCK_SIZE (1024)
+#define BLOCK_COUNT (256)
+#define BIG_SIZE (100 * BLOCK_SIZE)
+
+static uint8_t big[BIG_SIZE];
+
+static void check_file(char const *path, void const *contents, size_t len) {
+    uint8_t buffer[BIG_SIZE + 1];
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == (ssize_t)len);
+    assert(memcmp(buffer, contents, len) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    char path[] = "/tmp/tfs_imageXXXXXX";
+    int fd = mkstemp(path);
+    assert(fd != -1);
+    assert(close(fd) == 0);
+
+    for (size_t i = 0; i < BIG_SIZE; i++) {
+        big[i] = (uint8_t)(i % 199);
+    }
+
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_block_count = BLOCK_COUNT;
+    params.image_path = path;
+
+    // a new image is created, and its contents survive a restart
+    assert(tfs_init(&params) != -1);
+    assert(tfs_mkdir("/dir") != -1);
+    int f = tfs_open("/dir/big", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, big, BIG_SIZE) == BIG_SIZE);
+    assert(tfs_close(f) != -1);
+    f = tfs_open("/small", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "hello", 5) == 5);
+    assert(tfs_close(f) != -1);
+    assert(tfs_link("/small", "/hard") != -1);
+    assert(tfs_sym_link("/dir/big", "/soft") != -1);
+    assert(tfs_destroy() != -1);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    assert(tfs_init(&params) != -1);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("attached in %.3f ms\n",
+           (double)(end.tv_sec - start.tv_sec) * 1e3 +
+               (double)(end.tv_nsec - start.tv_nsec) / 1e6);
+
+    check_file("/dir/big", big, BIG_SIZE);
+    check_file("/soft", big, BIG_SIZE);
+    check_file("/hard", "hello", 5);
+    assert(tfs_unlink("/small") != -1);
+    check_file("/hard", "hello", 5);
+
+    // the free blocks are accounted for correctly after attaching: every
+    // block not in use can be allocated, and no block in use is handed out
+    f = tfs_open("/fill", TFS_O_CREAT);
+    assert(f != -1);
+    while (tfs_write(f, big, BLOCK_SIZE) == BLOCK_SIZE) {
+    }
+    assert(tfs_close(f) != -1);
+    check_file("/dir/big", big, BIG_SIZE);
+    assert(tfs_unlink("/fill") != -1);
+    assert(tfs_destroy() != -1);
+
+    // again, after the changes
+    assert(tfs_init(&params) != -1);
+    assert(tfs_open("/small", 0) == -1);
+    assert(tfs_open("/fill", 0) == -1);
+    check_file("/hard", "hello", 5);
+    check_file("/dir/big", big, BIG_SIZE);
+    assert(tfs_destroy() != -1);
+
+    // an image whose directory tree is inconsistent is not attached: past its
+    // first page (the superblock and the root inode), it is all ones
+    struct stat st;
+    assert(stat(path, &st) == 0);
+    fd = open(path, O_WRONLY);
+    assert(fd != -1);
+    memset(big, 0xff, BLOCK_SIZE);
+    for (off_t offset = 4096; offset < st.st_size; offset += BLOCK_SIZE) {
+        assert(pwrite(fd, big, BLOCK_SIZE, offset) == BLOCK_SIZE);
+    }
+    assert(close(fd) == 0);
+    assert(tfs_init(&params) == -1);
+    assert(tfs_destroy() != -1);
+
+    // an image is only attached with the parameters it was created with
+    params.max_block_count = 2 * BLOCK_COUNT;
+    assert(tfs_init(&params) == -1);
+    assert(tfs_destroy() != -1);
+
+    // files that are not images are left alone
+    FILE *fp = fopen(path, "wb");
+    assert(fp != NULL);
+    assert(fputs("not an image", fp) >= 0);
+    assert(fclose(fp) == 0);
+    params.max_block_count = BLOCK_COUNT;
+    assert(tfs_init(&params) == -1);
+    assert(tfs_destroy() != -1);
+
+    assert(unlink(path) == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,96 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define THREAD_COUNT (8)
+#define BLOCK_SIZE (1024)
+#define FILE_SIZE (8 * BLOCK_SIZE)
+#define READS_PER_THREAD (1000)
+
+static int shared;
+
+static uint8_t expected(size_t pos) { return (uint8_t)(pos * 31 % 251); }
+
+// every thread reads random records through the same handle
+static void *reader(void *arg) {
+    size_t seed = (size_t)arg;
+    uint8_t buffer[100];
+
+    for (size_t i = 0; i < READS_PER_THREAD; i++) {
+        seed = seed * 1103515245 + 12345;
+        size_t offset = seed % (FILE_SIZE - sizeof(buffer));
+        assert(tfs_pread(shared, buffer, sizeof(buffer), offset) ==
+               sizeof(buffer));
+        for (size_t j = 0; j < sizeof(buffer); j++) {
+            assert(buffer[j] == expected(offset + j));
+        }
+    }
+    return NULL;
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    // leave garbage in some freed blocks, which a hole must not expose
+    uint8_t garbage[4 * BLOCK_SIZE];
+    memset(garbage, 0xAB, sizeof(garbage));
+    int f = tfs_open("/garbage", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, garbage, sizeof(garbage)) == sizeof(garbage));
+    assert(tfs_close(f) != -1);
+    assert(tfs_unlink("/garbage") != -1);
+
+    // writing past the end of the file fills the gap with zeros
+    f = tfs_open("/sparse", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_pwrite(f, "end", 3, 3 * BLOCK_SIZE + 10) == 3);
+    uint8_t buffer[4 * BLOCK_SIZE];
+    assert(tfs_pread(f, buffer, sizeof(buffer), 0) == 3 * BLOCK_SIZE + 13);
+    for (size_t i = 0; i < 3 * BLOCK_SIZE + 10; i++) {
+        assert(buffer[i] == 0);
+    }
+    assert(memcmp(buffer + 3 * BLOCK_SIZE + 10, "end", 3) == 0);
+
+    // positional I/O leaves the handle's offset alone
+    assert(tfs_pwrite(f, "mid", 3, 100) == 3);
+    assert(tfs_read(f, buffer, 5) == 5);
+    assert(memcmp(buffer, "\0\0\0\0\0", 5) == 0);
+    assert(tfs_pread(f, buffer, 3, 100) == 3);
+    assert(memcmp(buffer, "mid", 3) == 0);
+    assert(tfs_read(f, buffer, 1) == 1 && buffer[0] == 0);
+    assert(tfs_pread(f, buffer, 10, 3 * BLOCK_SIZE + 13) == 0);
+    assert(tfs_pread(f, buffer, 10, 100 * BLOCK_SIZE) == 0);
+    assert(tfs_close(f) != -1);
+    assert(tfs_pread(f, buffer, 1, 0) == -1);
+    assert(tfs_pwrite(f, buffer, 1, 0) == -1);
+
+    // parallel readers sharing one handle
+    shared = tfs_open("/shared", TFS_O_CREAT);
+    assert(shared != -1);
+    for (size_t i = 0; i < FILE_SIZE; i += sizeof(buffer)) {
+        for (size_t j = 0; j < sizeof(buffer); j++) {
+            buffer[j] = expected(i + j);
+        }
+        assert(tfs_pwrite(shared, buffer, sizeof(buffer), i) ==
+               sizeof(buffer));
+    }
+
+    pthread_t threads[THREAD_COUNT];
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_create(&threads[i], NULL, reader, (void *)(i + 1)) ==
+               0);
+    }
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    assert(tfs_close(shared) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,161 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define BLOCK_SIZE (1024)
+#define FILE_BLOCKS (2048)
+#define CACHE_SIZE (1024)
+#define SHARING_THREADS (4)
+
+static uint8_t contents[FILE_BLOCKS * BLOCK_SIZE];
+static uint8_t buffer[FILE_BLOCKS * BLOCK_SIZE];
+
+/**
+ * Write a file larger than the buffer cache, so that its first blocks are no
+ * longer cached by the time it is read back.
+ */
+static void setup(size_t readahead_max_blocks) {
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_block_count = 2 * FILE_BLOCKS;
+    params.cache_size = CACHE_SIZE;
+    params.readahead_max_blocks = readahead_max_blocks;
+    assert(tfs_init(&params) != -1);
+
+    int f = tfs_open("/f", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, contents, sizeof(contents)) == sizeof(contents));
+    assert(tfs_close(f) != -1);
+}
+
+/**
+ * Stream the file one block at a time.
+ *
+ * Returns the time taken, in seconds.
+ */
+static double stream(tfs_readahead_stats_t *stats) {
+    int f = tfs_open("/f", 0);
+    assert(f != -1);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t b = 0; b < FILE_BLOCKS; b++) {
+        assert(tfs_read(f, buffer + b * BLOCK_SIZE, BLOCK_SIZE) ==
+               BLOCK_SIZE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    assert(memcmp(buffer, contents, sizeof(contents)) == 0);
+
+    assert(tfs_readahead_stats(f, stats) != -1);
+    assert(tfs_close(f) != -1);
+    return (double)(end.tv_sec - start.tv_sec) +
+           (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/**
+ * Read a file a block at a time through a handle shared with other threads,
+ * until its end.
+ *
+ * Returns the number of bytes read, as a pointer-sized integer.
+ */
+static void *share(void *arg) {
+    int f = *(int *)arg;
+    uint8_t block[BLOCK_SIZE];
+    size_t total = 0;
+    ssize_t n;
+    while ((n = tfs_read(f, block, sizeof(block))) > 0) {
+        assert(n == sizeof(block));
+        total += (size_t)n;
+    }
+    assert(n == 0);
+    return (void *)total;
+}
+
+int main() {
+    for (size_t i = 0; i < sizeof(contents); i++) {
+        contents[i] = (uint8_t)(i % 251);
+    }
+
+    tfs_readahead_stats_t stats;
+
+    // Without read-ahead, nothing is prefetched
+    setup(0);
+    double plain = stream(&stats);
+    assert(stats.rs_hits == 0 && stats.rs_prefetched == 0);
+    assert(tfs_destroy() != -1);
+
+    // A sequential reader finds (nearly) every block already prefetched, with
+    // the window grown to its maximum
+    setup(64);
+    double ahead = stream(&stats);
+    printf("plain %.3f s, read-ahead %.3f s (%.1fx), %llu hits, "
+           "%llu misses, %llu blocks prefetched\n",
+           plain, ahead, plain / ahead, (unsigned long long)stats.rs_hits,
+           (unsigned long long)stats.rs_misses,
+           (unsigned long long)stats.rs_prefetched);
+    assert(stats.rs_hits >= FILE_BLOCKS - 8);
+    assert(stats.rs_prefetched >= FILE_BLOCKS - 8);
+    assert(stats.rs_prefetched <= FILE_BLOCKS);
+    assert(stats.rs_window == 64);
+    assert(ahead < plain);
+
+    // Reads that do not continue where the previous one ended (here, because
+    // writes move the handle in between) never count as hits, and keep the
+    // window closed
+    int f = tfs_open("/f", 0);
+    assert(f != -1);
+    uint8_t block[BLOCK_SIZE];
+    for (size_t b = 0; b < 128; b += 2) {
+        assert(tfs_write(f, contents + b * BLOCK_SIZE, BLOCK_SIZE) ==
+               BLOCK_SIZE);
+        assert(tfs_read(f, block, sizeof(block)) == sizeof(block));
+        assert(memcmp(block, contents + (b + 1) * BLOCK_SIZE,
+                      sizeof(block)) == 0);
+    }
+    assert(tfs_readahead_stats(f, &stats) != -1);
+    assert(stats.rs_hits == 0 && stats.rs_window == 0);
+    assert(tfs_close(f) != -1);
+
+    // tfs_readv streams are sequential too
+    f = tfs_open("/f", 0);
+    assert(f != -1);
+    for (size_t b = 0; b < 128; b++) {
+        struct iovec iov[2] = {{.iov_base = block, .iov_len = BLOCK_SIZE / 2},
+                               {.iov_base = block + BLOCK_SIZE / 2,
+                                .iov_len = BLOCK_SIZE / 2}};
+        assert(tfs_readv(f, iov, 2) == sizeof(block));
+        assert(memcmp(block, contents + b * BLOCK_SIZE, sizeof(block)) == 0);
+    }
+    assert(tfs_readahead_stats(f, &stats) != -1);
+    assert(stats.rs_hits > 0 && stats.rs_window > 0);
+    assert(tfs_close(f) != -1);
+
+    // Threads reading through the same handle take turns with its offset and
+    // read-ahead state, so every block is read exactly once
+    f = tfs_open("/f", 0);
+    assert(f != -1);
+    pthread_t sharers[SHARING_THREADS];
+    for (int i = 0; i < SHARING_THREADS; i++) {
+        assert(pthread_create(&sharers[i], NULL, share, &f) == 0);
+    }
+    size_t total = 0;
+    for (int i = 0; i < SHARING_THREADS; i++) {
+        void *read;
+        assert(pthread_join(sharers[i], &read) == 0);
+        total += (size_t)read;
+    }
+    assert(total == sizeof(contents));
+    assert(tfs_readahead_stats(f, &stats) != -1);
+    assert(stats.rs_hits > 0);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
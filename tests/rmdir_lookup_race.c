@@ -0,0 +1,75 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#define LOOKUP_THREADS (3)
+#define ROUNDS (2000)
+
+static atomic_bool done;
+
+// Looks names up in a directory that keeps being created and removed: every
+// lookup fails, whether it finds the directory or not
+static void *looker(void *arg) {
+    (void)arg;
+    while (!atomic_load(&done)) {
+        assert(tfs_open("/d/missing", 0) == -1);
+        assert(tfs_unlink("/d/missing") == -1);
+        assert(tfs_rmdir("/d/sub") == -1);
+    }
+    return NULL;
+}
+
+// Keeps reusing the blocks freed by the removed directories for file data
+// that looks nothing like a directory
+static void *scribbler(void *arg) {
+    (void)arg;
+    char junk[4096];
+    memset(junk, 0x7f, sizeof(junk));
+    while (!atomic_load(&done)) {
+        int f = tfs_open("/junk", TFS_O_CREAT | TFS_O_TRUNC);
+        assert(f != -1);
+        assert(tfs_write(f, junk, sizeof(junk)) == sizeof(junk));
+        assert(tfs_close(f) != -1);
+    }
+    return NULL;
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    pthread_t lookers[LOOKUP_THREADS];
+    pthread_t writer;
+    for (int i = 0; i < LOOKUP_THREADS; i++) {
+        assert(pthread_create(&lookers[i], NULL, looker, NULL) == 0);
+    }
+    assert(pthread_create(&writer, NULL, scribbler, NULL) == 0);
+
+    for (int round = 0; round < ROUNDS; round++) {
+        assert(tfs_mkdir("/d") != -1);
+        assert(tfs_rmdir("/d") != -1);
+    }
+
+    atomic_store(&done, true);
+    for (int i = 0; i < LOOKUP_THREADS; i++) {
+        assert(pthread_join(lookers[i], NULL) == 0);
+    }
+    assert(pthread_join(writer, NULL) == 0);
+
+    // The root is still intact
+    assert(tfs_mkdir("/d") != -1);
+    int f = tfs_open("/d/file", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+    f = tfs_open("/d/file", 0);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,101 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define OPENS (1000)
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec / 1e9;
+}
+
+static void write_file(char const *path, char const *contents) {
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_write(f, contents, strlen(contents)) ==
+           (ssize_t)strlen(contents));
+    assert(tfs_close(f) != -1);
+}
+
+static void check_file(char const *path, char const *contents) {
+    char buffer[16];
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == (ssize_t)strlen(contents));
+    assert(memcmp(buffer, contents, strlen(contents)) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = 128;
+    assert(tfs_init(&params) != -1);
+
+    // Cycles end in an error instead of looping forever
+    assert(tfs_sym_link("/b", "/a") != -1);
+    assert(tfs_sym_link("/a", "/b") != -1);
+    assert(tfs_open("/a", 0) == -1);
+    assert(tfs_sym_link("/s", "/s") != -1);
+    assert(tfs_open("/s", 0) == -1);
+
+    // Chains are followed up to MAX_SYMLINK_HOPS links (spread over a few
+    // directories, which only have room for so many entries)
+    write_file("/f", "one");
+    char link[16], target[16];
+    strcpy(target, "/f");
+    for (int i = 0; i <= MAX_SYMLINK_HOPS; i++) {
+        if (i % 10 == 0) {
+            snprintf(link, sizeof(link), "/d%d", i / 10);
+            assert(tfs_mkdir(link) != -1);
+        }
+        snprintf(link, sizeof(link), "/d%d/l%d", i / 10, i);
+        assert(tfs_sym_link(target, link) != -1);
+        strcpy(target, link);
+    }
+    snprintf(link, sizeof(link), "/d%d/l%d", (MAX_SYMLINK_HOPS - 1) / 10,
+             MAX_SYMLINK_HOPS - 1);
+    double start = now();
+    check_file(link, "one");
+    double cold = now() - start;
+    char too_long[16];
+    snprintf(too_long, sizeof(too_long), "/d%d/l%d", MAX_SYMLINK_HOPS / 10,
+             MAX_SYMLINK_HOPS);
+    assert(tfs_open(too_long, 0) == -1);
+
+    // Once resolved, a chain costs a single lookup
+    start = now();
+    for (int i = 0; i < OPENS; i++) {
+        int f = tfs_open(link, 0);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+    double warm = (now() - start) / OPENS;
+    printf("cold open %.1f us, cached open %.1f us\n", cold * 1e6,
+           warm * 1e6);
+    assert(warm < cold);
+
+    // Removing a name anywhere drops the cached resolutions, and relinking
+    // the target makes the chain resolve to the new file
+    assert(tfs_unlink("/f") != -1);
+    assert(tfs_open(link, 0) == -1);
+    write_file("/f", "two");
+    check_file(link, "two");
+    check_file("/d0/l0", "two");
+
+    // Also through hard links
+    assert(tfs_link("/f", "/h") != -1);
+    assert(tfs_sym_link("/h", "/lh") != -1);
+    check_file("/lh", "two");
+    assert(tfs_unlink("/h") != -1);
+    assert(tfs_open("/lh", 0) == -1);
+    check_file("/d0/l0", "two");
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
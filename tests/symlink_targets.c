@@ -0,0 +1,97 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DIR "/a_long_directory_name/another_long_directory"
+#define NESTED DIR "/target"
+
+static void check_file(char const *path, char const *contents) {
+    char buffer[16];
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == (ssize_t)strlen(contents));
+    assert(memcmp(buffer, contents, strlen(contents)) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    char path[] = "/tmp/tfs_imageXXXXXX";
+    int fd = mkstemp(path);
+    assert(fd != -1);
+    assert(close(fd) == 0);
+
+    // Room for the root, two directories, one block of file data and two
+    // more blocks
+    tfs_params params = tfs_default_params();
+    params.max_block_count = 6;
+    params.image_path = path;
+    assert(tfs_init(&params) != -1);
+
+    assert(tfs_mkdir("/a_long_directory_name") != -1);
+    assert(tfs_mkdir(DIR) != -1);
+    int f = tfs_open(NESTED, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "x", 1) == 1);
+    assert(tfs_close(f) != -1);
+
+    // Targets that fit in the inode take no data block, up to the longest
+    char exact[33];
+    memset(exact, 'c', sizeof(exact) - 1);
+    exact[0] = '/';
+    exact[sizeof(exact) - 1] = '\0';
+    f = tfs_open(exact, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_sym_link(exact, "/exact") != -1);
+    for (int i = 0; i < 8; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "/s%d", i);
+        assert(tfs_sym_link("/exact", name) != -1);
+    }
+    check_file("/s7", "");
+
+    // Longer targets take a block each, up to the size of a block
+    assert(tfs_sym_link(NESTED, "/nested") != -1);
+    check_file("/nested", "x");
+    static char longest[MAX_SYMLINK_TARGET];
+    memset(longest, 'l', sizeof(longest) - 1);
+    longest[0] = '/';
+    longest[sizeof(longest) - 1] = '\0';
+    assert(tfs_sym_link(longest, "/longest") != -1);
+    assert(tfs_open("/longest", 0) == -1); // dangling (the name is too long)
+
+    // Out of blocks: the link is not created
+    assert(tfs_sym_link(NESTED, "/third") == -1);
+    assert(tfs_open("/third", 0) == -1);
+
+    // Removing a link gives its block back
+    assert(tfs_unlink("/longest") != -1);
+    assert(tfs_sym_link(NESTED, "/third") != -1);
+    check_file("/third", "x");
+
+    // Targets that are empty or too long are rejected
+    static char too_long[MAX_SYMLINK_TARGET + 1];
+    memset(too_long, 't', sizeof(too_long) - 1);
+    too_long[0] = '/';
+    too_long[sizeof(too_long) - 1] = '\0';
+    assert(tfs_unlink("/third") != -1);
+    assert(tfs_sym_link(too_long, "/too_long") == -1);
+    assert(tfs_sym_link("", "/empty") == -1);
+    assert(tfs_open("/too_long", 0) == -1);
+
+    // Both kinds of targets survive a restart
+    assert(tfs_destroy() != -1);
+    assert(tfs_init(&params) != -1);
+    check_file("/nested", "x");
+    check_file("/s0", "");
+    assert(tfs_destroy() != -1);
+
+    assert(unlink(path) == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,86 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#define RESOLVE_THREADS (3)
+#define ROUNDS (2000)
+
+static atomic_bool done;
+
+// Follows a link that keeps being created and removed: it either resolves to
+// the file or is not found
+static void *resolver(void *arg) {
+    (void)arg;
+    char buffer[8];
+    while (!atomic_load(&done)) {
+        int f = tfs_open("/link", 0);
+        if (f != -1) {
+            assert(tfs_read(f, buffer, sizeof(buffer)) == 4);
+            assert(memcmp(buffer, "data", 4) == 0);
+            assert(tfs_close(f) != -1);
+        }
+    }
+    return NULL;
+}
+
+// Keeps unlinking a name that is a file one moment and a directory the next
+static void *unlinker(void *arg) {
+    (void)arg;
+    while (!atomic_load(&done)) {
+        tfs_unlink("/a");
+    }
+    return NULL;
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    int f = tfs_open("/file", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "data", 4) == 4);
+    assert(tfs_close(f) != -1);
+
+    pthread_t resolvers[RESOLVE_THREADS];
+    for (int i = 0; i < RESOLVE_THREADS; i++) {
+        assert(pthread_create(&resolvers[i], NULL, resolver, NULL) == 0);
+    }
+
+    // The inode of each removed link is reused by the next one, whose target
+    // is rewritten in place
+    for (int round = 0; round < ROUNDS; round++) {
+        assert(tfs_sym_link("/file", "/link") != -1);
+        assert(tfs_unlink("/link") != -1);
+        assert(tfs_sym_link("/missing", "/other") != -1);
+        assert(tfs_unlink("/other") != -1);
+    }
+
+    atomic_store(&done, true);
+    for (int i = 0; i < RESOLVE_THREADS; i++) {
+        assert(pthread_join(resolvers[i], NULL) == 0);
+    }
+
+    // The inode of the removed file is reused by the directory created in its
+    // place, which an unlink that looked the file up must leave alone
+    atomic_store(&done, false);
+    pthread_t other;
+    assert(pthread_create(&other, NULL, unlinker, NULL) == 0);
+    for (int round = 0; round < ROUNDS; round++) {
+        f = tfs_open("/a", TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+        tfs_unlink("/a"); // unless the other thread got there first
+        assert(tfs_mkdir("/a") != -1);
+        assert(tfs_rmdir("/a") != -1);
+    }
+    atomic_store(&done, true);
+    assert(pthread_join(other, NULL) == 0);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
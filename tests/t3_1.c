@@ -10,9 +10,9 @@ int r;
 
 void* funThread(void *arg){
     (void) arg;
-    file_closed = 1; 
 
     assert(tfs_close(r) != -1);
+    file_closed = 1;
 
     return NULL;
 }
@@ -23,12 +23,14 @@ int main(){
     r = tfs_open("/f1", TFS_O_CREAT);
     assert(r != -1);
 
-    assert(pthread_create(&thread, NULL, funThread, NULL) == -1);
-    assert(pthread_join(&thread, NULL) == -1);
-    assert(tfs_destroy() == -1);
-    assert(file_closed != 1);
+    // A file opened by one thread can be closed by another
+    assert(pthread_create(&thread, NULL, funThread, NULL) == 0);
+    assert(pthread_join(thread, NULL) == 0);
+    assert(file_closed == 1);
+    assert(tfs_close(r) == -1);
+    assert(tfs_destroy() != -1);
 
     printf("Successful test.\n");
 
     return 0;
-}
\ No newline at end of file
+}
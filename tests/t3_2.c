@@ -4,63 +4,41 @@
 #include <string.h>
 #include <pthread.h>
 
-int file_closed = 0;
-int r;
-char* buffer = "Hello World";
-int main(){
+#define THREAD_COUNT 3
 
+char const buffer[] = "Hello World";
 
-    pthread_t thread[3];
-    assert(tfs_init(NULL) != -1);
+void* funThread(void *arg){
+    (void) arg;
+    char output[sizeof(buffer)];
 
-    //Criar 3 threads e todas tentam ler ficheiros diferentes
-    //Criar 3 threads r todas tentam ler o mesmo ficheiro
+    int f = tfs_open("/f1", 0);
+    assert(f != -1);
+    assert(tfs_read(f, output, sizeof(buffer)) == sizeof(buffer));
+    assert(memcmp(output, buffer, sizeof(buffer)) == 0);
+    assert(tfs_close(f) != -1);
 
-    r = tfs_open("/f1", TFS_O_CREAT);
-    assert(r != -1);
-    assert(tfs_write(r, buffer, 12) != -1);
-    assert(pthread_create(&thread[0], NULL, tfs_read(r, buffer, 12), NULL) == -1);
-    assert(pthread_create(&thread[1], NULL, tfs_read(r, buffer, 12), NULL) == -1);
-    assert(pthread_create(&thread[2], NULL, tfs_read(r, buffer, 12), NULL) == -1);
+    return NULL;
+}
+
+int main(){
+    pthread_t thread[THREAD_COUNT];
+    assert(tfs_init(NULL) != -1);
 
-    assert(pthread_join(&thread[0], NULL) == -1);
-    assert(pthread_join(&thread[1], NULL) == -1);
-    assert(pthread_join(&thread[2], NULL) == -1);
-    
+    // Write a file, then 3 threads read it at the same time
+    int r = tfs_open("/f1", TFS_O_CREAT);
+    assert(r != -1);
+    assert(tfs_write(r, buffer, sizeof(buffer)) == sizeof(buffer));
     assert(tfs_close(r) != -1);
-    file_closed = 1;
-    assert(file_closed != 1);
+
+    for (int i = 0; i < THREAD_COUNT; i++)
+        assert(pthread_create(&thread[i], NULL, funThread, NULL) == 0);
+    for (int i = 0; i < THREAD_COUNT; i++)
+        assert(pthread_join(thread[i], NULL) == 0);
+
     assert(tfs_destroy() != -1);
 
     printf("Successful test.\n");
 
     return 0;
-
 }
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
@@ -4,38 +4,45 @@
 #include <string.h>
 #include <pthread.h>
 
-int r, s, t;
-char* buffer =  "Hello World number two";
+#define THREAD_COUNT 3
 
-int main(){
-    pthread_t thread[3];
-    assert(tfs_init(NULL) != -1);
+char const buffer[] = "Hello World number two";
+char const *paths[THREAD_COUNT] = {"/f1", "/f2", "/f3"};
 
-    r = tfs_open("/f1", TFS_O_CREAT);
-    s = tfs_open("/f2", TFS_O_CREAT);
-    t = tfs_open("/f2", TFS_O_CREAT);
+void* funThread(void *arg){
+    char const *path = arg;
+    char output[sizeof(buffer)];
 
-    assert(r != -1 && s != -1 && t != -1);
-    assert(tfs_write(r, buffer, 23) != -1);
-    assert(tfs_write(s, buffer, 23) != -1);
-    assert(tfs_write(t, buffer, 23) != -1);
-    
-    assert(pthread_create(&thread[0], NULL, tfs_read(r, buffer, 23), NULL) == -1);
-    assert(pthread_create(&thread[1], NULL, tfs_read(s, buffer, 23), NULL) == -1);
-    assert(pthread_create(&thread[2], NULL, tfs_read(t, buffer, 23), NULL) == -1);
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, output, sizeof(buffer)) == sizeof(buffer));
+    assert(memcmp(output, buffer, sizeof(buffer)) == 0);
+    assert(tfs_close(f) != -1);
 
-    assert(pthread_join(&thread[0], NULL) == -1);
-    assert(pthread_join(&thread[1], NULL) == -1);
-    assert(pthread_join(&thread[2], NULL) == -1);
+    return NULL;
+}
 
-    assert(tfs_close(r) != -1);
-    assert(tfs_close(s) != -1);
-    assert(tfs_close(t) != -1);
+int main(){
+    pthread_t thread[THREAD_COUNT];
+    assert(tfs_init(NULL) != -1);
+
+    // Write 3 files, then each thread reads a different one
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        int f = tfs_open(paths[i], TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, buffer, sizeof(buffer)) == sizeof(buffer));
+        assert(tfs_close(f) != -1);
+    }
+
+    for (int i = 0; i < THREAD_COUNT; i++)
+        assert(pthread_create(&thread[i], NULL, funThread,
+                              (void *) paths[i]) == 0);
+    for (int i = 0; i < THREAD_COUNT; i++)
+        assert(pthread_join(thread[i], NULL) == 0);
 
     assert(tfs_destroy() != -1);
 
     printf("Successful test.\n");
 
     return 0;
-
-}
\ No newline at end of file
+}
@@ -0,0 +1,91 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define THREAD_COUNT (4)
+#define RECORDS_PER_THREAD (200)
+#define HEADER_SIZE (8)
+#define PAYLOAD_SIZE (300)
+#define RECORD_SIZE (HEADER_SIZE + PAYLOAD_SIZE)
+
+static int shared;
+
+// each record is written as a header and a payload fragment
+static void *producer(void *arg) {
+    uint8_t id = (uint8_t)(size_t)arg;
+    uint8_t header[HEADER_SIZE];
+    uint8_t payload[PAYLOAD_SIZE];
+    memset(header, id, sizeof(header));
+    memset(payload, id, sizeof(payload));
+
+    struct iovec iov[] = {{header, sizeof(header)}, {payload, sizeof(payload)}};
+    for (size_t i = 0; i < RECORDS_PER_THREAD; i++) {
+        assert(tfs_writev(shared, iov, 2) == RECORD_SIZE);
+    }
+    return NULL;
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    // fragments spanning block boundaries, including empty ones
+    char a[700], b[1], c[900];
+    memset(a, 'a', sizeof(a));
+    memset(b, 'b', sizeof(b));
+    memset(c, 'c', sizeof(c));
+    struct iovec out[] = {
+        {a, sizeof(a)}, {NULL, 0}, {b, sizeof(b)}, {c, sizeof(c)}};
+
+    int f = tfs_open("/f", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_writev(f, out, 4) == sizeof(a) + sizeof(b) + sizeof(c));
+    assert(tfs_writev(f, out, 0) == 0);
+    assert(tfs_writev(f, out, -1) == -1);
+    assert(tfs_close(f) != -1);
+
+    char x[1000], y[1000];
+    struct iovec in[] = {{x, sizeof(x)}, {y, sizeof(y)}};
+    f = tfs_open("/f", 0);
+    assert(f != -1);
+    assert(tfs_readv(f, in, 2) == sizeof(a) + sizeof(b) + sizeof(c));
+    assert(memcmp(x, a, sizeof(a)) == 0 && x[sizeof(a)] == 'b');
+    assert(memcmp(x + sizeof(a) + 1, c, sizeof(x) - sizeof(a) - 1) == 0);
+    assert(memcmp(y, c, sizeof(a) + 1 + sizeof(c) - sizeof(x)) == 0);
+    assert(tfs_readv(f, in, 2) == 0);
+    assert(tfs_close(f) != -1);
+    assert(tfs_readv(f, in, 2) == -1);
+
+    // records written concurrently are never interleaved
+    shared = tfs_open("/records", TFS_O_CREAT);
+    assert(shared != -1);
+    pthread_t threads[THREAD_COUNT];
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_create(&threads[i], NULL, producer, (void *)(i + 1)) ==
+               0);
+    }
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    assert(tfs_close(shared) != -1);
+
+    f = tfs_open("/records", 0);
+    assert(f != -1);
+    uint8_t record[RECORD_SIZE];
+    for (size_t i = 0; i < THREAD_COUNT * RECORDS_PER_THREAD; i++) {
+        assert(tfs_read(f, record, sizeof(record)) == sizeof(record));
+        for (size_t j = 1; j < sizeof(record); j++) {
+            assert(record[j] == record[0]);
+        }
+    }
+    assert(tfs_read(f, record, 1) == 0);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
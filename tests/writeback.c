@@ -0,0 +1,211 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define BLOCK_SIZE (1024)
+#define RECORD_SIZE (100)
+#define FILE_SIZE (32 * BLOCK_SIZE)
+#define FILE_COUNT (4)
+
+static uint8_t expected(size_t pos) { return (uint8_t)(pos * 7 % 253); }
+
+/**
+ * Append small records to a few files in turn, checking their contents
+ * (before and after closing them) and how many extents they ended up in.
+ *
+ * Returns the time the appends took, in seconds.
+ */
+static double interleaved_appends(size_t writeback_size, size_t *spans) {
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.writeback_size = writeback_size;
+    assert(tfs_init(&params) != -1);
+
+    int f[FILE_COUNT];
+    for (int i = 0; i < FILE_COUNT; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "/f%d", i);
+        f[i] = tfs_open(name, TFS_O_CREAT);
+        assert(f[i] != -1);
+    }
+
+    uint8_t record[RECORD_SIZE];
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t pos = 0; pos < FILE_SIZE; pos += RECORD_SIZE) {
+        size_t n = FILE_SIZE - pos < RECORD_SIZE ? FILE_SIZE - pos
+                                                 : RECORD_SIZE;
+        for (size_t j = 0; j < n; j++) {
+            record[j] = expected(pos + j);
+        }
+        for (int i = 0; i < FILE_COUNT; i++) {
+            assert(tfs_write(f[i], record, n) == (ssize_t)n);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // Buffered data is visible before it reaches the data blocks
+    static uint8_t buffer[FILE_SIZE];
+    assert(tfs_pread(f[0], buffer, FILE_SIZE, 0) == FILE_SIZE);
+    for (size_t j = 0; j < FILE_SIZE; j++) {
+        assert(buffer[j] == expected(j));
+    }
+    struct iovec iov[2] = {{.iov_base = buffer, .iov_len = 10},
+                           {.iov_base = buffer + 10, .iov_len = 100}};
+    int g = tfs_open("/f1", 0);
+    assert(g != -1);
+    assert(tfs_read(g, buffer, FILE_SIZE - 50) == FILE_SIZE - 50);
+    assert(tfs_readv(g, iov, 2) == 50);
+    for (size_t j = 0; j < 50; j++) {
+        assert(buffer[j] == expected(FILE_SIZE - 50 + j));
+    }
+    assert(tfs_close(g) != -1);
+
+    for (int i = 0; i < FILE_COUNT; i++) {
+        assert(tfs_close(f[i]) != -1);
+    }
+
+    // Count the extents of a file through the spans of a borrow
+    int h = tfs_open("/f2", TFS_O_APPEND);
+    assert(h != -1);
+    tfs_borrow_t borrow;
+    ssize_t borrowed = tfs_borrow(h, FILE_SIZE, 0, &borrow);
+    assert(borrowed > 0);
+    *spans = borrow.b_span_count;
+    size_t pos = 0;
+    for (size_t s = 0; s < borrow.b_span_count; s++) {
+        uint8_t const *data = borrow.b_spans[s].s_data;
+        for (size_t j = 0; j < borrow.b_spans[s].s_len; j++) {
+            assert(data[j] == expected(pos + j));
+        }
+        pos += borrow.b_spans[s].s_len;
+    }
+    assert(pos == (size_t)borrowed);
+    assert(tfs_borrow_release(&borrow) != -1);
+
+    // Appending through a handle opened with TFS_O_APPEND, then writing
+    // elsewhere, flushes the buffer first
+    assert(tfs_write(h, "abc", 3) == 3);
+    assert(tfs_pwrite(h, "xy", 2, FILE_SIZE + 1) == 2);
+    assert(tfs_pread(h, buffer, 4, FILE_SIZE - 1) == 4);
+    assert(buffer[0] == expected(FILE_SIZE - 1));
+    assert(memcmp(buffer + 1, "axy", 3) == 0);
+    assert(tfs_close(h) != -1);
+
+    assert(tfs_destroy() != -1);
+    return (double)(end.tv_sec - start.tv_sec) +
+           (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/**
+ * Fill a small file system with appends, checking that every write that
+ * succeeded was given a block once flushed.
+ */
+static void fill(void) {
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_block_count = 48;
+    assert(tfs_init(&params) != -1);
+
+    int f = tfs_open("/full", TFS_O_CREAT);
+    assert(f != -1);
+    uint8_t record[RECORD_SIZE];
+    memset(record, 'r', sizeof(record));
+    size_t written = 0;
+    ssize_t n;
+    while ((n = tfs_write(f, record, sizeof(record))) > 0) {
+        written += (size_t)n;
+    }
+    assert(written > 40 * BLOCK_SIZE);
+    assert(tfs_close(f) != -1);
+
+    f = tfs_open("/full", 0);
+    assert(f != -1);
+    static uint8_t buffer[48 * BLOCK_SIZE];
+    assert(tfs_read(f, buffer, sizeof(buffer)) == (ssize_t)written);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+}
+
+/**
+ * Append to a file whose blocks are scattered over many extents, with only
+ * scattered blocks left, checking that every write that succeeded is still
+ * there once the file is closed (the buffer must reserve the overflow extent
+ * blocks the flush may need).
+ */
+static void fragmented(void) {
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_block_count = 320;
+    assert(tfs_init(&params) != -1);
+
+    // Two files flushed a block at a time in turn get every other block
+    int f = tfs_open("/scattered", TFS_O_CREAT);
+    int g = tfs_open("/other", TFS_O_CREAT);
+    assert(f != -1 && g != -1);
+    uint8_t block[BLOCK_SIZE];
+    memset(block, 'b', sizeof(block));
+    for (int i = 0; i < 128; i++) {
+        assert(tfs_write(f, block, sizeof(block)) == sizeof(block));
+        assert(tfs_fsync(f, TFS_DURABILITY_NONE) != -1);
+        assert(tfs_write(g, block, sizeof(block)) == sizeof(block));
+        assert(tfs_fsync(g, TFS_DURABILITY_NONE) != -1);
+    }
+    assert(tfs_close(g) != -1);
+
+    // Fill the rest, then free every other block
+    g = tfs_open("/filler", TFS_O_CREAT);
+    assert(g != -1);
+    while (tfs_write(g, block, sizeof(block)) == sizeof(block)) {
+    }
+    assert(tfs_close(g) != -1);
+    assert(tfs_unlink("/other") != -1);
+
+    size_t written = 128 * BLOCK_SIZE;
+    uint8_t record[RECORD_SIZE];
+    for (int i = 0; i < 200; i++) {
+        memset(record, i, sizeof(record));
+        ssize_t n = tfs_write(f, record, sizeof(record));
+        if (n <= 0) {
+            break;
+        }
+        written += (size_t)n;
+    }
+    assert(written > 128 * BLOCK_SIZE);
+    assert(tfs_close(f) != -1);
+
+    f = tfs_open("/scattered", 0);
+    assert(f != -1);
+    static uint8_t buffer[160 * BLOCK_SIZE];
+    assert(tfs_read(f, buffer, sizeof(buffer)) == (ssize_t)written);
+    for (size_t j = 128 * BLOCK_SIZE; j < written; j++) {
+        assert(buffer[j] == (uint8_t)((j - 128 * BLOCK_SIZE) / RECORD_SIZE));
+    }
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+}
+
+int main() {
+    size_t through_spans, back_spans;
+    double through = interleaved_appends(0, &through_spans);
+    double back = interleaved_appends(32 * BLOCK_SIZE, &back_spans);
+    printf("write-through %.3f s (%zu spans), write-back %.3f s (%zu spans)\n",
+           through, through_spans, back, back_spans);
+
+    // Blocks allocated at flush time are contiguous, whereas appends written
+    // through take turns at the allocator
+    assert(back_spans == 1);
+    assert(through_spans > 1);
+
+    fill();
+    fragmented();
+
+    printf("Successful test.\n");
+
+    return 0;
+}